@@ -35,7 +35,7 @@
 
 #include "AudioFileSourceHTTPStream2.h"
 
-AudioFileSourceHTTPStream2::AudioFileSourceHTTPStream2()
+AudioFileSourceHTTPStream2::AudioFileSourceHTTPStream2() : http(ownHttp)
 {
   pos = 0;
   reconnectTries = 0;
@@ -44,7 +44,7 @@ AudioFileSourceHTTPStream2::AudioFileSourceHTTPStream2()
   sslEnabled = false;
 }
 
-AudioFileSourceHTTPStream2::AudioFileSourceHTTPStream2(const char *url, bool post, char* data)
+AudioFileSourceHTTPStream2::AudioFileSourceHTTPStream2(const char *url, bool post, char* data) : http(ownHttp)
 {
   saveURL[0] = 0;
   reconnectTries = 0;
@@ -55,6 +55,20 @@ AudioFileSourceHTTPStream2::AudioFileSourceHTTPStream2(const char *url, bool pos
   open(url);
 }
 
+// リクエスト済みのHTTPClientから読み出す（codeは応答のステータスコード）
+// 応答を終わらせる（end()する）のは持ち主。読み出せない場合はsizeが0になる
+AudioFileSourceHTTPStream2::AudioFileSourceHTTPStream2(HTTPClient *requested, int code) : http(*requested)
+{
+  pos = 0;
+  saveURL[0] = 0;
+  reconnectTries = 0;
+  rootCACertificate = NULL;
+  sslEnabled = false;
+  attached = true;
+  size = (code == HTTP_CODE_OK) ? http.getSize() : 0;
+  if (code != HTTP_CODE_OK) cb.st(STATUS_HTTPFAIL, PSTR("Can't open HTTP request"));
+}
+
 bool AudioFileSourceHTTPStream2::open(const char *url)
 {
   int code;
@@ -95,7 +109,7 @@ bool AudioFileSourceHTTPStream2::open(const char *url)
 
 AudioFileSourceHTTPStream2::~AudioFileSourceHTTPStream2()
 {
-  http.end();
+  if (!attached) http.end();
 }
 
 uint32_t AudioFileSourceHTTPStream2::read(void *data, uint32_t len)
@@ -121,6 +135,7 @@ uint32_t AudioFileSourceHTTPStream2::readInternal(void *data, uint32_t len, bool
 retry:
   if (!http.connected()) {
     cb.st(STATUS_DISCONNECTED, PSTR("Stream disconnected"));
+    if (attached) return 0;
     http.end();
     for (int i = 0; i < reconnectTries; i++) {
       char buff[64];
@@ -153,6 +168,7 @@ retry:
   size_t avail = stream->available();
   if (!nonBlock && !avail) {
     cb.st(STATUS_NODATA, PSTR("No stream data available"));
+    if (attached) return 0;
     http.end();
     if (strlen(saveURL) > 0) goto retry;
   }
@@ -174,7 +190,7 @@ bool AudioFileSourceHTTPStream2::seek(int32_t pos, int dir)
 
 bool AudioFileSourceHTTPStream2::close()
 {
-  http.end();
+  if (!attached) http.end();
   postEnabled = false;
   return true;
 }
@@ -22,6 +22,7 @@
   ・httpsに対応
   ・http/https自動判定
   ・ルート証明書の登録、証明書を検証しない、両モード対応　（ただし動作未確認）
+  ・リクエスト済みのHTTPClientから読み出す（接続を使い回す場合用。close()しても接続は切らない）
 
   Copyright (C) 2017  Earle F. Philhower, III
   Modified by Kaz (https://akibabara.com/blog/)
@@ -56,6 +57,7 @@ class AudioFileSourceHTTPStream2 : public AudioFileSource
   public:
     AudioFileSourceHTTPStream2();
     AudioFileSourceHTTPStream2(const char *url, bool post=false, char* data=nullptr);
+    AudioFileSourceHTTPStream2(HTTPClient *requested, int code);  // リクエスト済みのHTTPClientから読み出す（codeは応答のステータスコード）
     virtual ~AudioFileSourceHTTPStream2() override;
     
     virtual bool open(const char *url) override;
@@ -70,6 +72,7 @@ class AudioFileSourceHTTPStream2 : public AudioFileSource
     void useHTTP10 () { http.useHTTP10(true); }
     void setRootCA(const char* root_ca);
     void unsetRootCA();
+    bool isAttached() { return attached; }   // リクエスト済みのHTTPClientから読み出しているか？
 
     enum { STATUS_HTTPFAIL=2, STATUS_DISCONNECTED, STATUS_RECONNECTING, STATUS_RECONNECTED, STATUS_NODATA };
     int size;
@@ -83,7 +86,9 @@ class AudioFileSourceHTTPStream2 : public AudioFileSource
     virtual uint32_t readInternal(void *data, uint32_t len, bool nonBlock);
     WiFiClient client;
     WiFiClientSecure sclient;
-    HTTPClient http;
+    HTTPClient ownHttp;
+    HTTPClient &http;       // ownHttpか、リクエスト済みのHTTPClient
+    bool attached = false;  // リクエスト済みのHTTPClientを使っている（終わらせるのは持ち主）
     int pos;
     int reconnectTries;
     int reconnectDelayMs;
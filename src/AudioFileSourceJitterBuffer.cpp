@@ -0,0 +1,165 @@
+/*
+  AudioFileSourceJitterBuffer.cpp
+  ズンダチャン ストリーミング再生用のバッファー CLASS
+
+  Copyright (c) 2024 Kaz  (https://akibabara.com/blog/)
+  Released under the MIT license.
+  see https://opensource.org/licenses/MIT
+*/
+#include "AudioFileSourceJitterBuffer.h"
+
+// コンストラクタ（bufferはsizeバイトのメモリ、throughputHintは前回までに測ったネットワークの速度(byte/s)）
+AudioFileSourceJitterBuffer::AudioFileSourceJitterBuffer(AudioFileSource *src, uint8_t *buffer, uint32_t size, uint32_t throughputHint)
+  : src{src}, _buffer{buffer}, _size{size}, _hint{throughputHint} {
+  _lastData = millis();
+}
+
+// バッファーから読み出す
+// 最初と、空になった時（アンダーラン）は、必要な量がたまるまで待つ。最後まで読んだら0を返す
+// 受信はloop()でまとめて行い、ここではたまっている量が足りない時だけ行う
+uint32_t AudioFileSourceJitterBuffer::read(void *data, uint32_t len) {
+  if (_length < len) _fill();
+  if (!_started || (_length == 0 && !_eof)) {
+    unsigned long st = millis();
+    bool ok = _prefill();
+    if (!_started) {
+      stat.prefillBytes = _length;
+      stat.marginMs = marginMs;
+      _started = true;
+    } else {
+      stat.underruns ++;
+      stat.underrunMs += millis() - st;
+    }
+    if (!ok) return 0;
+  }
+  if (_length == 0) return 0;
+
+  // バッファーの量を記録する
+  if (_fillNum == 0 || _length < stat.minFill) stat.minFill = _length;
+  _fillSum += _length;
+  _fillNum ++;
+  stat.avgFill = _fillSum / _fillNum;
+  stat.fillHist[(uint64_t)_length * jitterHistBins / (_size + 1)] ++;
+
+  // リングバッファーから読み出す
+  uint8_t *p = reinterpret_cast<uint8_t*>(data);
+  uint32_t n = (len < _length) ? len : _length;
+  uint32_t toEnd = _size - _readPtr;
+  if (n <= toEnd) {
+    memcpy(p, _buffer + _readPtr, n);
+  } else {
+    memcpy(p, _buffer + _readPtr, toEnd);
+    memcpy(p + toEnd, _buffer, n - toEnd);
+  }
+  _readPtr = (_readPtr + n) % _size;
+  _length -= n;
+  _pos += n;
+  stat.bytes += n;
+  return n;
+}
+
+// 受信済みのデータをバッファーに入れる（待たない）
+void AudioFileSourceJitterBuffer::_fill() {
+  if (_eof) return;
+  uint32_t got = 0;
+  while (_length < _size) {
+    uint32_t space = (_writePtr >= _readPtr) ? _size - _writePtr : _readPtr - _writePtr;
+    uint32_t n = src->readNonBlock(_buffer + _writePtr, space);
+    if (n == 0) break;
+    _writePtr = (_writePtr + n) % _size;
+    _length += n;
+    _received += n;
+    got += n;
+    if (n < space) break;   // 受信済みのデータは全部読んだ
+  }
+  if (got > 0) {
+    _lastData = millis();
+  } else {
+    int32_t total = src->getSize();
+    if ((total > 0 && _received >= (uint32_t)total) || !src->isOpen()) _eof = true;   // 全部受信した・切れた
+  }
+}
+
+// 必要な量がたまるまで待つ（ためられなければfalse）
+// 待っている間にネットワークの速度を測り、ためる量を計算し直す
+// 速度は最初にデータが届いてからの量で測る（最初に届いた分は、届くまでの時間がわからないので数えない）
+bool AudioFileSourceJitterBuffer::_prefill() {
+  unsigned long first = 0;      // 最初にデータが届いた時刻
+  uint32_t firstReceived = 0;   // 〃 までに受信した量
+  uint32_t received = _received;
+  unsigned long elapsed = 0;
+  uint32_t measured = 0;
+  while (!_eof) {
+    _fill();
+    if (first == 0 && _received > received) {
+      first = millis();
+      firstReceived = _received;
+    }
+    if (stat.bitrate == 0 && _pos == 0) _parseBitrate();
+    elapsed = (first == 0) ? 0 : millis() - first;
+    measured = _received - firstReceived;
+    if (_length >= _target(elapsed, measured)) break;
+    if (millis() - _lastData > timeoutMs) {
+      _eof = true;
+      break;
+    }
+    delay(1);
+  }
+  if (elapsed >= measureMs && measured > 0) stat.throughput = (uint64_t)measured * 1000 / elapsed;
+  if (!_started) stat.prefillMs = (first == 0) ? 0 : millis() - first;
+  return (_length > 0);
+}
+
+// 再生を始めるまでにためる量
+// 残りの音声をネットワークの速度で受信しながらビットレートで再生して、途中で空にならない量に余裕を足す
+// ビットレートや速度がわからない・残りの量がわからず速度が足りない場合は、いっぱいまでためる
+uint32_t AudioFileSourceJitterBuffer::_target(unsigned long elapsed, uint32_t measured) {
+  uint32_t rate = stat.bitrate;
+  uint32_t tput = (elapsed >= measureMs && measured > 0) ? (uint64_t)measured * 1000 / elapsed : _hint;
+  if (rate == 0 || tput == 0) return _size;
+  uint64_t need = (uint64_t)rate * marginMs / 1000;
+  if (tput < rate) {
+    int32_t total = src->getSize();
+    if (total <= 0) return _size;
+    uint64_t remain = _length + ((uint32_t)total > _received ? total - _received : 0);
+    need += remain * (rate - tput) / rate;
+  }
+  if (need < minPrefill) need = minPrefill;
+  return (need < _size) ? need : _size;
+}
+
+// 先頭のヘッダーからビットレートを調べる（WAV・MP3）
+// ヘッダーがまだ届いていなければ何もしない（次に呼ばれた時に調べる）。わからなければ0のまま
+void AudioFileSourceJitterBuffer::_parseBitrate() {
+  const uint8_t *b = _buffer;
+  uint32_t n = (_readPtr == 0 && _writePtr > 0) ? _writePtr : _length;  // 先頭から続いている量
+  if (n < 12) return;
+  auto le32 = [b](uint32_t i) -> uint32_t { return b[i] | (b[i+1] << 8) | (b[i+2] << 16) | ((uint32_t)b[i+3] << 24); };
+  if (memcmp(b, "RIFF", 4) == 0 && memcmp(b+8, "WAVE", 4) == 0) {
+    // WAV: fmtチャンクのbyteRate
+    uint32_t i = 12;
+    while (i + 8 <= n) {
+      uint32_t len = le32(i + 4);
+      if (memcmp(b + i, "fmt ", 4) == 0) {
+        if (i + 20 <= n) stat.bitrate = le32(i + 16);
+        return;
+      }
+      if (len > n - i - 8) return;   // fmtより前のチャンクがまだ届いていない（壊れた長さも含む）
+      i += 8 + len + (len & 1);
+    }
+    return;
+  }
+  // MP3: ID3v2タグを飛ばして、最初のフレームヘッダーのビットレート（レイヤー3のみ）
+  uint32_t i = 0;
+  if (memcmp(b, "ID3", 3) == 0) {
+    i = 10 + ((b[6] & 0x7f) << 21 | (b[7] & 0x7f) << 14 | (b[8] & 0x7f) << 7 | (b[9] & 0x7f));
+    if (b[5] & 0x10) i += 10;   // フッターあり
+  }
+  if (i + 4 > n) return;
+  if (b[i] != 0xff || (b[i+1] & 0xe0) != 0xe0 || ((b[i+1] >> 1) & 3) != 1) return;
+  static const uint16_t kbpsV1[16] = { 0, 32, 40, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320, 0 };
+  static const uint16_t kbpsV2[16] = { 0, 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160, 0 };
+  uint8_t index = b[i+2] >> 4;
+  uint16_t kbps = (((b[i+1] >> 3) & 3) == 3) ? kbpsV1[index] : kbpsV2[index];
+  stat.bitrate = kbps * 125;
+}
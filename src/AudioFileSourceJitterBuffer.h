@@ -0,0 +1,73 @@
+/*
+  AudioFileSourceJitterBuffer.h
+  ズンダチャン ストリーミング再生用のバッファー CLASS
+
+  AudioFileSourceBuffer の代わりに、ダウンロードしながら再生する音声をためておくリングバッファー。
+  再生を始める（止まった後に再開する）までにためる量を、測ったネットワークの速度と音声のビットレートから決める。
+  ネットワークが再生より十分速ければ少しだけためてすぐ再生し、遅ければ最後まで止まらずに再生できる量をためる。
+  バッファーの量の分布と、空になって再生が止まった回数・時間を記録する。
+
+  Copyright (c) 2024 Kaz  (https://akibabara.com/blog/)
+  Released under the MIT license.
+  see https://opensource.org/licenses/MIT
+*/
+#pragma once
+#include <Arduino.h>
+#include <AudioFileSource.h>
+
+static constexpr uint8_t jitterHistBins = 8;   // バッファーの量の分布の区分数（容量を等分する）
+
+struct JitterStat {  // ストリーミング再生の計測結果（1回の再生ごと）
+  uint32_t bitrate = 0;       // 音声のビットレート(byte/s)（0は不明）
+  uint32_t throughput = 0;    // 測ったネットワークの速度(byte/s)（0は測れなかった）
+  uint32_t marginMs = 0;      // ゆらぎに備えて余分にためた音声の長さ(ms)
+  uint32_t prefillBytes = 0;  // 再生を始めるまでにためた量
+  uint32_t prefillMs = 0;     // 〃 かかった時間(ms)（最初のデータが届いてから）
+  uint16_t underruns = 0;     // バッファーが空になって再生が止まった回数
+  uint32_t underrunMs = 0;    // 〃 止まっていた時間の合計(ms)
+  uint32_t minFill = 0;       // 再生中のバッファーの量の最小値
+  uint32_t avgFill = 0;       // 〃 平均値
+  uint32_t bytes = 0;         // 再生に渡した量
+  uint32_t fillHist[jitterHistBins] = {};  // 再生中のバッファーの量の分布（read()の回数）
+};
+
+class AudioFileSourceJitterBuffer : public AudioFileSource {
+ public:
+  uint32_t marginMs = 200;        // 計算した量に加えてためる音声の長さ(ms)（ネットワークのゆらぎに備える）
+  uint32_t minPrefill = 2048;     // 再生を始めるまでにためる最小の量
+  unsigned long measureMs = 100;  // ネットワークの速度はこの時間以上受信してから使う（それまではthroughputHintを使う）
+  unsigned long timeoutMs = 5000; // この時間データが届かなければ終わりにする
+  JitterStat stat;                // 計測結果
+
+  AudioFileSourceJitterBuffer(AudioFileSource *src, uint8_t *buffer, uint32_t size, uint32_t throughputHint=0);
+  virtual ~AudioFileSourceJitterBuffer() override {}
+  virtual uint32_t read(void *data, uint32_t len) override;
+  virtual bool seek(int32_t pos, int dir) override { return false; }
+  virtual bool close() override { return src->close(); }
+  virtual bool isOpen() override { return src->isOpen(); }
+  virtual uint32_t getSize() override { return src->getSize(); }
+  virtual uint32_t getPos() override { return _pos; }
+  virtual bool loop() override { _fill(); return true; }
+  uint32_t getFill() { return _length; }   // バッファーにたまっている量
+
+ private:
+  AudioFileSource *src;
+  uint8_t *_buffer;
+  uint32_t _size;
+  uint32_t _readPtr = 0;
+  uint32_t _writePtr = 0;
+  uint32_t _length = 0;         // たまっている量
+  uint32_t _pos = 0;            // 再生に渡した量
+  uint32_t _received = 0;       // 受信した量
+  bool _eof = false;            // 最後まで受信した
+  bool _started = false;        // 最初のプリフィルが終わった
+  uint32_t _hint;               // 前回までに測ったネットワークの速度(byte/s)
+  unsigned long _lastData = 0;  // 最後にデータが届いた時刻
+  uint64_t _fillSum = 0;        // バッファーの量の合計（平均用）
+  uint32_t _fillNum = 0;        // 〃 回数
+
+  void _fill();                 // 受信済みのデータをバッファーに入れる（待たない）
+  bool _prefill();              // 必要な量がたまるまで待つ（ためられなければfalse）
+  uint32_t _target(unsigned long elapsed, uint32_t measured);  // 再生を始めるまでにためる量（elapsedの間にmeasuredバイト受信した）
+  void _parseBitrate();         // 先頭のヘッダーからビットレートを調べる（WAV・MP3）
+};
@@ -62,6 +62,8 @@ class AudioOutputM5Speaker : public AudioOutput
 
     const int16_t* getBuffer(void) const { return _tri_buffer[(_tri_index + 2) % 3]; }
     const uint32_t getUpdateCount(void) const { return _update_count; }
+    /// 次のバッファーを埋めてよいか（スピーカーの再生中と再生待ちが両方埋まっていなければtrue）
+    bool needsData(void) const { return _m5sound->isPlaying(_virtual_ch) < 2; }
 
   protected:
     m5::Speaker_Class* _m5sound;
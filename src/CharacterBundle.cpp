@@ -0,0 +1,207 @@
+/*
+  CharacterBundle.cpp
+  ズンダチャン　キャラクターバンドル（画像・部位テーブル・キャラクター設定・起動サウンドをまとめたファイル）を読み込むクラス
+
+  Copyright (c) 2024 Kaz  (https://akibabara.com/blog/)
+  Released under the MIT license.
+  see https://opensource.org/licenses/MIT
+*/
+#include "CharacterBundle.h"
+#include <new>
+namespace character_bundle {
+
+static constexpr size_t readChunk = 32 * 1024;  // 1回に読み込むバイト数
+
+// ファイルを読み込む（ファイル全体をPSRAMに読み込み、内容を確かめてから入れ替える。失敗した場合は前の内容のまま）
+bool CharacterBundle::load(fs::FS& fs, const char* path) {
+  unsigned long tm = millis();
+  File file = fs.open(path, "r");
+  if (!file) {
+    spf("CharacterBundle: %s not found\n", path);
+    return false;
+  }
+  size_t size = file.size();
+  uint8_t* buf = (uint8_t*)heap_caps_malloc(size, MALLOC_CAP_SPIRAM);
+  if (buf == nullptr) {
+    spf("CharacterBundle: cannot allocate %u bytes\n", size);
+    file.close();
+    return false;
+  }
+  size_t got = 0;
+  while (got < size) {
+    size_t n = file.read(buf + got, (size - got < readChunk) ? size - got : readChunk);
+    if (n == 0) break;
+    got += n;
+  }
+  file.close();
+  if (got != size || !_validate(buf, size)) {
+    spf("CharacterBundle: %s is broken\n", path);
+    free(buf);
+    return false;
+  }
+  unload();
+  _buf = buf;
+  _size = size;
+  _parse();
+  if (_imgInfo == nullptr) {
+    unload();
+    return false;
+  }
+  loadMs = millis() - tm;
+  spf("CharacterBundle: %s loaded (%s, %u bytes, %u ms)\n", path, name.c_str(), _size, loadMs);
+  return true;
+}
+
+// 読み込んだ内容を解放する
+void CharacterBundle::unload() {
+  if (_imgInfo != nullptr) free(_imgInfo);
+  if (_buf != nullptr) free(_buf);
+  _imgInfo = nullptr;
+  _buf = nullptr;
+  _size = 0;
+  _tableNum = 0;
+  _sounds = nullptr;
+  soundNum = 0;
+  characterNo = -1;
+}
+
+// 画像データとテーブル情報をアバターに登録する（描画タスク実行中は呼ばないこと）
+void CharacterBundle::applyImages(zundavatar::Zundavatar* avatar) {
+  if (_imgInfo == nullptr) return;
+  avatar->setImageData(_imgInfo, _tableNames, _tables, _tableNum, _offsets);
+}
+
+// 起動サウンドのデータ（WAV）
+const unsigned char* CharacterBundle::soundData(uint16_t no) {
+  return (no < soundNum) ? _buf + _sounds[no].offset : nullptr;
+}
+
+// 起動サウンドのバイト数
+size_t CharacterBundle::soundSize(uint16_t no) {
+  return (no < soundNum) ? _sounds[no].size : 0;
+}
+
+// ファイルの内容が正しいか調べる（各データの位置と大きさがファイルの範囲内か、画像番号が画像の数より小さいか）
+bool CharacterBundle::_validate(const uint8_t* buf, size_t size) {
+  if (size < sizeof(BundleHeader)) return false;
+  const BundleHeader* h = (const BundleHeader*)buf;
+  if (memcmp(h->magic, "ZCB1", 4) != 0 || h->version != 2 || h->fileSize != size) return false;
+  if (h->imageNum == 0 || h->tableNum == 0 || h->tableNum > zundavatar::tableNumZundavatar) return false;
+  auto inside = [size](uint32_t ofs, uint32_t len) { return ofs <= size && len <= size - ofs; };
+
+  // 文字列（名前・ホスト名・キャラ設定・部位名）
+  uint32_t p = h->stringsOffset;
+  for (int i=0; i<3+h->tableNum; i++) {
+    const uint8_t* end = (p < size) ? (const uint8_t*)memchr(buf + p, 0, size - p) : nullptr;
+    if (end == nullptr) return false;
+    p = end - buf + 1;
+  }
+  // テーブル
+  p = h->tablesOffset;
+  for (int t=0; t<h->tableNum; t++) {
+    if ((p & 1) || !inside(p, 2)) return false;
+    uint16_t n = *(const uint16_t*)(buf + p);
+    if (!inside(p + 2, n * 6)) return false;
+    const uint16_t* nos = (const uint16_t*)(buf + p + 2);
+    for (int i=0; i<n; i++) {
+      if (nos[i] >= h->imageNum) return false;
+    }
+    p += 2 + n * 6;
+  }
+  // 画像情報
+  if ((h->imagesOffset & 3) || !inside(h->imagesOffset, h->imageNum * sizeof(BundleImage))) return false;
+  if (h->paletteOffset != 0 && ((h->paletteOffset & 1) || !inside(h->paletteOffset, 256 * 2))) return false;
+  const BundleImage* imgs = (const BundleImage*)(buf + h->imagesOffset);
+  for (int i=0; i<h->imageNum; i++) {
+    const BundleImage& m = imgs[i];
+    uint32_t px = (uint32_t)m.width * m.height;
+    if (px == 0 || px > 0xFFFF) return false;
+    if (m.data == 0 && m.span == 0 && m.index == 0 && m.packed == 0) return false;
+    if (m.data != 0 && ((m.data & 1) || !inside(m.data, px * 2))) return false;
+    if (m.index != 0 && (h->paletteOffset == 0 || !inside(m.index, px))) return false;
+    if (m.packed != 0 && (m.packedSize == 0 || !inside(m.packed, m.packedSize))) return false;
+    if (m.span != 0) {
+      if ((m.span & 1) || (m.spanSize & 1) || (m.spanRows & 3) || !inside(m.span, m.spanSize) || !inside(m.spanRows, m.height * 4)) return false;
+      // 各行のスパン（数, 飛ばす数, 長さ, 色...）がデータの中と画像の幅に収まっているか
+      const uint16_t* span = (const uint16_t*)(buf + m.span);
+      const uint32_t* rows = (const uint32_t*)(buf + m.spanRows);
+      uint32_t words = m.spanSize / 2;
+      for (int y=0; y<m.height; y++) {
+        uint32_t q = rows[y];
+        if (q >= words) return false;
+        uint32_t n = span[q++];
+        uint32_t x = 0;
+        while (n-- > 0) {
+          if (words - q < 2) return false;
+          uint32_t len = span[q + 1];
+          x += span[q] + len;
+          if (x > m.width || len > words - q - 2) return false;
+          q += 2 + len;
+        }
+      }
+    }
+  }
+  // サウンド
+  if ((h->soundsOffset & 3) || !inside(h->soundsOffset, h->soundNum * sizeof(BundleSound))) return false;
+  const BundleSound* sounds = (const BundleSound*)(buf + h->soundsOffset);
+  for (int i=0; i<h->soundNum; i++) {
+    if (!inside(sounds[i].offset, sounds[i].size)) return false;
+  }
+  return true;
+}
+
+// 読み込んだファイルから各情報を取り出す（_validate()で調べた後に呼ぶ）
+void CharacterBundle::_parse() {
+  const BundleHeader* h = (const BundleHeader*)_buf;
+  characterNo = h->characterNo;
+  speakerNo = h->speakerNo;
+  masterServer = h->masterServer;
+
+  // 文字列
+  const char* s = (const char*)_buf + h->stringsOffset;
+  name = s;
+  s += strlen(s) + 1;
+  hostName = s;
+  s += strlen(s) + 1;
+  characterInfo = s;
+  s += strlen(s) + 1;
+  _tableNum = h->tableNum;
+  for (int t=0; t<_tableNum; t++) {
+    _tableNames[t] = s;
+    s += strlen(s) + 1;
+  }
+
+  // テーブル
+  uint8_t* p = _buf + h->tablesOffset;
+  for (int t=0; t<_tableNum; t++) {
+    uint16_t n = *(uint16_t*)p;
+    _tables[t] = (uint16_t*)(p + 2);
+    _offsets[t] = (const zundavatar::XYaddress*)(p + 2 + n * 2);
+    p += 2 + n * 6;
+  }
+
+  // 画像情報（ImageInfoはconstのメンバなので、確保した領域に1つずつ作る）
+  _imgInfo = (zundavatar::ImageInfo*)heap_caps_malloc(h->imageNum * sizeof(zundavatar::ImageInfo), MALLOC_CAP_SPIRAM);
+  if (_imgInfo == nullptr) return;
+  const BundleImage* imgs = (const BundleImage*)(_buf + h->imagesOffset);
+  const uint16_t* palette = h->paletteOffset ? (const uint16_t*)(_buf + h->paletteOffset) : nullptr;
+  for (int i=0; i<h->imageNum; i++) {
+    const BundleImage& m = imgs[i];
+    new (&_imgInfo[i]) zundavatar::ImageInfo{
+      m.data ? (const unsigned short*)(_buf + m.data) : nullptr,
+      m.width, m.height, (uint16_t)(m.width * m.height), m.posX, m.posY, m.transparent,
+      m.span ? (const uint16_t*)(_buf + m.span) : nullptr,
+      m.span ? (const uint32_t*)(_buf + m.spanRows) : nullptr,
+      m.index ? _buf + m.index : nullptr,
+      m.index ? palette : nullptr,
+      m.packed ? _buf + m.packed : nullptr,
+      m.packed ? m.packedSize : 0
+    };
+  }
+
+  // サウンド
+  soundNum = h->soundNum;
+  _sounds = (const BundleSound*)(_buf + h->soundsOffset);
+}
+
+}
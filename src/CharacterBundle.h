@@ -0,0 +1,109 @@
+/*
+  CharacterBundle.h
+  ズンダチャン　キャラクターバンドル（画像・部位テーブル・キャラクター設定・起動サウンドをまとめたファイル）を読み込むクラス
+
+  キャラクターバンドルは画像変換ツール（pngmerger_rgb565.py の出力先を.zcbにする）で作成し、LittleFSやSDに置いておく。
+  ファイル全体をPSRAMに読み込み、画像データなどはそのバッファを直接指すので、読み込み後の変換やコピーはしない。
+
+  Copyright (c) 2024 Kaz  (https://akibabara.com/blog/)
+  Released under the MIT license.
+  see https://opensource.org/licenses/MIT
+*/
+#pragma once
+#include <FS.h>
+#include "Zundavatar.h"
+
+// デバッグに便利なマクロ定義 --------
+#define sp(x) Serial.println(x)
+#define spn(x) Serial.print(x)
+#define spf(fmt, ...) Serial.printf(fmt, __VA_ARGS__)
+
+namespace character_bundle {
+
+/* ファイルの形式（tools/psdutil_lib.py の generate_bundle() と対になっている。数値はリトルエンディアン、位置はファイルの先頭から）
+*  ヘッダー   BundleHeader
+*  文字列     名前・ホスト名・キャラ設定の文章・部位名（テーブル数分）をNUL区切りで並べたもの
+*  テーブル   部位ごとに 画像数(u16), 画像番号(u16)..., 体の[0]の左上からの相対位置(x,y)...
+*  画像情報   画像ごとに BundleImage
+*  パレット   256色（バイトスワップ済み）。パレット形式の画像が無ければ位置は0
+*  サウンド   サウンドごとに 位置(u32), バイト数(u32)
+*  画像データ・サウンドのデータは、それぞれの位置から4バイト境界に揃えて置かれている
+*/
+
+struct BundleHeader {
+  char magic[4];          // "ZCB1"
+  uint16_t version;       // 形式のバージョン(2)
+  uint16_t imageNum;      // 画像の数
+  uint16_t tableNum;      // テーブル（部位）の数
+  uint16_t soundNum;      // 起動サウンドの数
+  int16_t speakerNo;      // VOICEVOXの話者番号
+  uint8_t characterNo;    // キャラクター番号
+  uint8_t masterServer;   // マスターサーバー
+  uint32_t stringsOffset; // 文字列の位置
+  uint32_t tablesOffset;  // テーブルの位置
+  uint32_t imagesOffset;  // 画像情報の位置
+  uint32_t paletteOffset; // パレットの位置（0は無し）
+  uint32_t soundsOffset;  // サウンドの表の位置
+  uint32_t fileSize;      // ファイル全体のバイト数
+  uint32_t reserved[2];
+};
+static_assert(sizeof(BundleHeader) == 48, "BundleHeader must match the tool's layout");
+
+struct BundleImage {
+  uint16_t width, height; // 幅と高さ
+  uint16_t posX, posY;    // 元画像上の位置
+  uint16_t transparent;   // 透明色
+  uint16_t reserved;
+  uint32_t data;          // 通常の画像データの位置（0は無し、以下同じ）
+  uint32_t span;          // スパン形式の画像データの位置
+  uint32_t spanRows;      // スパン形式の各行の開始位置の表の位置
+  uint32_t index;         // パレット形式の画像データの位置
+  uint32_t packed;        // 圧縮形式の画像データの位置
+  uint32_t spanSize;      // スパン形式の画像データのバイト数
+  uint32_t packedSize;    // 圧縮形式の画像データのバイト数
+};
+static_assert(sizeof(BundleImage) == 40, "BundleImage must match the tool's layout");
+
+struct BundleSound {
+  uint32_t offset;        // データの位置
+  uint32_t size;          // バイト数
+};
+
+class CharacterBundle {
+public:
+  // キャラクター設定（CharacterConfig.h と同じ内容）
+  int16_t characterNo = -1;   // キャラクター番号
+  String name = "";           // キャラクターの名前
+  String hostName = "";       // ホスト名
+  String characterInfo = "";  // ChatGPTに渡すキャラ設定の文章
+  int16_t speakerNo = 0;      // VOICEVOXの話者番号
+  bool masterServer = false;  // マスターサーバー
+  uint16_t soundNum = 0;      // 起動サウンドの数
+  uint32_t loadMs = 0;        // 読み込みにかかった時間(ms)
+
+  CharacterBundle() {};
+  ~CharacterBundle() { unload(); }
+
+  // メンバ関数
+  bool load(fs::FS& fs, const char* path);    // ファイルを読み込む（失敗した場合は前の内容のまま）
+  void unload();                              // 読み込んだ内容を解放する
+  bool isLoaded() { return _buf != nullptr; } // 読み込み済みか
+  size_t size() { return _size; }             // ファイルのバイト数
+  void applyImages(zundavatar::Zundavatar* avatar);  // 画像データとテーブル情報をアバターに登録する（描画タスク実行中は呼ばないこと）
+  const unsigned char* soundData(uint16_t no);  // 起動サウンドのデータ（WAV）
+  size_t soundSize(uint16_t no);                // 起動サウンドのバイト数
+
+private:
+  uint8_t* _buf = nullptr;    // ファイル全体（PSRAM）
+  size_t _size = 0;
+  zundavatar::ImageInfo* _imgInfo = nullptr;  // 画像データと情報（_bufを指す）
+  const char* _tableNames[zundavatar::tableNumZundavatar];  // 部位名
+  uint16_t* _tables[zundavatar::tableNumZundavatar];        // 部位ごとのテーブル
+  const zundavatar::XYaddress* _offsets[zundavatar::tableNumZundavatar];  // 部位ごとの相対位置
+  uint16_t _tableNum = 0;
+  const BundleSound* _sounds = nullptr;
+  static bool _validate(const uint8_t* buf, size_t size);  // ファイルの内容が正しいか調べる（位置がファイルの範囲内かなど）
+  void _parse();              // 読み込んだファイルから各情報を取り出す（_validate()で調べた後に呼ぶ）
+};
+
+}
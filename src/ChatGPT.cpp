@@ -60,6 +60,11 @@ void ChatGPT::setMainValues(int charmax, int charno, char** charnames, char** ho
   hostNames = hostnames;
 }
 
+// キャラ設定の文章を変更する（共通の設定は後ろに付け足す）
+void ChatGPT::setCharacterInfo(String info) {
+  initSystemMessage = info + COMMON_INFO;
+}
+
 // ルート証明書をセットする
 void ChatGPT::setRootCA(const char* root_ca) {
   rootCACertificate = root_ca;
@@ -79,7 +79,7 @@ public:
   String endpointCgatGPT     = "https://api.openai.com/v1";
 
   // キャラ設定
-  const String initSystemMessage = CHARACTER_INFO COMMON_INFO;
+  String initSystemMessage = CHARACTER_INFO COMMON_INFO;  // キャラクターバンドルを読み込んだ場合は setCharacterInfo() で置き換える
 
   ChatGPT();
   //~ChatGPT() = default;
@@ -88,6 +88,7 @@ public:
   // メンバ関数
   void init(String apikey);    // 初期化、バッファーメモリ確保、
   void setMainValues(int charmax, int charno, char** charnames, char** hostnames);  // キャラクター情報を本クラスに与える
+  void setCharacterInfo(String info);   // キャラ設定の文章を変更する（共通の設定は後ろに付け足す）
   void setRootCA(const char* root_ca);  // ルート証明書をセットする
   void unsetRootCA();       // ルート証明書を無効にする
   void usePSRAM(bool psram);        // PSRAMを使う
@@ -0,0 +1,304 @@
+/*
+  VoicevoxCache.cpp
+  ズンダチャン VOICEVOX 音声キャッシュ CLASS
+
+  Copyright (c) 2024 Kaz  (https://akibabara.com/blog/)
+  Released under the MIT license.
+  see https://opensource.org/licenses/MIT
+*/
+#include "VoicevoxCache.h"
+namespace voicevox_tts {
+
+// LittleFSの保存先を設定して、保存済みのファイルを調べる（nullptrならPSRAMだけ使う）
+// ファイル名はキーのハッシュ値。登録数の上限を超えた分は消す
+void VoicevoxCache::begin(fs::FS* fs) {
+  _fs = fs;
+  _fileNum = 0;
+  if (_fs == nullptr) return;
+  if (!_fs->exists(dir)) _fs->mkdir(dir);
+  File root = _fs->open(dir);
+  if (!root || !root.isDirectory()) {
+    spf("VoicevoxCache: cannot open %s\n", dir.c_str());
+    _fs = nullptr;
+    return;
+  }
+  String extra[8];
+  int extraNum = 0;
+  File file = root.openNextFile();
+  while (file) {
+    String name = file.name();
+    int slash = name.lastIndexOf('/');
+    if (slash >= 0) name = name.substring(slash + 1);
+    if (name.length() == 12 && name.endsWith(".ztc") && _fileNum < ttsCacheFsMax) {
+      _files[_fileNum++] = { (uint32_t)strtoul(name.substring(0, 8).c_str(), nullptr, 16), (uint32_t)file.size(), 0 };
+    } else if (extraNum < 8) {
+      extra[extraNum++] = dir + "/" + name;
+    }
+    file = root.openNextFile();
+  }
+  root.close();
+  for (int i=0; i<extraNum; i++) _fs->remove(extra[i]);
+  while (fsBytes() > fsMaxBytes && _fileNum > 0) _removeFile(0);
+  spf("VoicevoxCache: %u files, %u bytes\n", _fileNum, fsBytes());
+}
+
+// キーを作る（話者id・合成パラメーター・文）
+String VoicevoxCache::makeKey(uint8_t speaker, const String& params, const String& text) {
+  return String(speaker) + "|" + params + "|" + text;
+}
+
+// キャッシュを探す。PSRAMに無くLittleFSにあればPSRAMに読み込む。見つかればスロット番号（参照済み）、無ければ-1
+int16_t VoicevoxCache::find(const String& key) {
+  uint32_t hash = _hash(key);
+  for (int i=0; i<ttsCacheRamMax; i++) {
+    TtsCacheEntry& e = entries[i];
+    if (e.pcm != nullptr && e.hash == hash && e.key == key) {
+      e.stamp = ++_stamp;
+      e.pins ++;
+      int16_t f = _findFile(hash);
+      if (f >= 0) _files[f].stamp = e.stamp;
+      stat.ramHits ++;
+      return i;
+    }
+  }
+  int16_t slot = _load(key, hash);
+  if (slot >= 0) {
+    stat.fsHits ++;
+  } else {
+    stat.misses ++;
+  }
+  return slot;
+}
+
+// 登録する（pcmはキャッシュのものになる）。スロット番号（参照済み）、入らなければ-1（pcmは呼び出し元のまま）
+// vowelsはoffset(ms)からの時刻なので、文の先頭からの時刻にして保存する
+int16_t VoicevoxCache::put(const String& key, const uint8_t* fmt, uint8_t* pcm, uint32_t size, const VowelData* vowels, uint16_t vowelNum, uint32_t offset) {
+  int16_t slot = _reserve(size + vowelNum * sizeof(VowelData));
+  if (slot < 0) return -1;
+  VowelData* vd = (VowelData*)ps_malloc(vowelNum * sizeof(VowelData) + 1);
+  if (vd == nullptr) return -1;
+  for (int i=0; i<vowelNum; i++) {
+    vd[i] = { vowels[i].vowel, vowels[i].timeline - offset };
+  }
+  TtsCacheEntry& e = entries[slot];
+  e.key = key;
+  e.hash = _hash(key);
+  memcpy(e.fmt, fmt, sizeof(e.fmt));
+  e.pcm = pcm;
+  e.size = size;
+  e.vowels = vd;
+  e.vowelNum = vowelNum;
+  e.stamp = ++_stamp;
+  e.pins = 1;
+  e.stored = false;
+  return slot;
+}
+
+// 参照をやめる
+void VoicevoxCache::unpin(int16_t slot) {
+  if (slot >= 0 && slot < ttsCacheRamMax && entries[slot].pins > 0) entries[slot].pins --;
+}
+
+// LittleFSに保存していないものを保存する（再生中は呼ばないこと。cancelがtrueになったら途中でやめる）
+// 書き込み中はフラッシュのキャッシュが止まり、PSRAMから読んで再生していると音が途切れるので、再生が終わってから行う
+void VoicevoxCache::persist(volatile bool* cancel) {
+  if (_fs == nullptr) return;
+  for (int i=0; i<ttsCacheRamMax; i++) {
+    if (cancel != nullptr && *cancel) break;
+    TtsCacheEntry& e = entries[i];
+    if (e.pcm == nullptr || e.stored) continue;
+    e.stored = true;    // 保存しないもの・失敗したものも二度は試さない
+    if (e.size > fsMaxEntryBytes) continue;
+    if (_store(e)) stat.fsWrites ++;
+    else stat.fsErrors ++;
+  }
+}
+
+// キャッシュを全部捨てる（filesがtrueならLittleFSのファイルも消す。再生中は呼ばないこと）
+void VoicevoxCache::clear(bool files) {
+  for (int i=0; i<ttsCacheRamMax; i++) _release(entries[i]);
+  if (files && _fs != nullptr) {
+    while (_fileNum > 0) _removeFile(0);
+  }
+}
+
+// PSRAMの登録数
+uint16_t VoicevoxCache::ramEntries() {
+  uint16_t num = 0;
+  for (int i=0; i<ttsCacheRamMax; i++) {
+    if (entries[i].pcm != nullptr) num ++;
+  }
+  return num;
+}
+
+// PSRAMで使っているバイト数
+uint32_t VoicevoxCache::ramBytes() {
+  uint32_t bytes = 0;
+  for (int i=0; i<ttsCacheRamMax; i++) {
+    if (entries[i].pcm != nullptr) bytes += entries[i].size + entries[i].vowelNum * sizeof(VowelData);
+  }
+  return bytes;
+}
+
+// LittleFSで使っているバイト数
+uint32_t VoicevoxCache::fsBytes() {
+  uint32_t bytes = 0;
+  for (int i=0; i<_fileNum; i++) bytes += _files[i].bytes;
+  return bytes;
+}
+
+// 計測結果をシリアルに出力する
+void VoicevoxCache::printStat(String title) {
+  spf("## %s : ram hits=%u fs hits=%u misses=%u evictions ram=%u fs=%u writes=%u errors=%u\n", title.c_str(),
+      stat.ramHits, stat.fsHits, stat.misses, stat.ramEvictions, stat.fsEvictions, stat.fsWrites, stat.fsErrors);
+  spf("   ram %u entries %u bytes / fs %u entries %u bytes\n", ramEntries(), ramBytes(), fsEntries(), fsBytes());
+}
+
+// キーのハッシュ値（FNV-1a）
+uint32_t VoicevoxCache::_hash(const String& key) {
+  uint32_t h = 2166136261u;
+  for (const char* p = key.c_str(); *p; p++) {
+    h = (h ^ (uint8_t)*p) * 16777619u;
+  }
+  return h;
+}
+
+// キャッシュファイルのパス
+String VoicevoxCache::_path(uint32_t hash) {
+  char name[16];
+  snprintf(name, sizeof(name), "/%08x.ztc", hash);
+  return dir + name;
+}
+
+// LittleFSの登録を探す
+int16_t VoicevoxCache::_findFile(uint32_t hash) {
+  for (int i=0; i<_fileNum; i++) {
+    if (_files[i].hash == hash) return i;
+  }
+  return -1;
+}
+
+// LittleFSから読み込んでPSRAMに登録する（キーが違う・壊れているファイルは使わない）
+int16_t VoicevoxCache::_load(const String& key, uint32_t hash) {
+  int16_t f = (_fs != nullptr) ? _findFile(hash) : -1;
+  if (f < 0) return -1;
+  File file = _fs->open(_path(hash), "r");
+  if (!file) {
+    _removeFile(f);
+    return -1;
+  }
+  TtsCacheFileHeader h;
+  bool ok = (file.read((uint8_t*)&h, sizeof(h)) == sizeof(h) && memcmp(h.magic, "ZTC1", 4) == 0
+             && h.keyLen == key.length() && h.vowelNum <= 1024
+             && file.size() == sizeof(h) + h.keyLen + h.vowelNum * sizeof(VowelData) + h.pcmSize);
+  if (ok) {
+    char* k = (char*)malloc(h.keyLen + 1);
+    ok = (k != nullptr && file.read((uint8_t*)k, h.keyLen) == h.keyLen && memcmp(k, key.c_str(), h.keyLen) == 0);
+    if (k != nullptr) free(k);
+  }
+  if (!ok) {    // 同じハッシュ値の別のキーの場合も消す（新しい方を後で保存する）
+    file.close();
+    _removeFile(f);
+    return -1;
+  }
+  int16_t slot = _reserve(h.pcmSize + h.vowelNum * sizeof(VowelData));
+  uint8_t* pcm = (slot >= 0) ? (uint8_t*)ps_malloc(h.pcmSize) : nullptr;
+  VowelData* vd = (pcm != nullptr) ? (VowelData*)ps_malloc(h.vowelNum * sizeof(VowelData) + 1) : nullptr;
+  size_t vbytes = h.vowelNum * sizeof(VowelData);
+  if (vd == nullptr || file.read((uint8_t*)vd, vbytes) != vbytes || file.read(pcm, h.pcmSize) != h.pcmSize) {
+    if (pcm != nullptr) free(pcm);
+    if (vd != nullptr) free(vd);
+    file.close();
+    stat.fsErrors ++;
+    return -1;
+  }
+  file.close();
+  TtsCacheEntry& e = entries[slot];
+  e.key = key;
+  e.hash = hash;
+  memcpy(e.fmt, h.fmt, sizeof(e.fmt));
+  e.pcm = pcm;
+  e.size = h.pcmSize;
+  e.vowels = vd;
+  e.vowelNum = h.vowelNum;
+  e.stamp = ++_stamp;
+  e.pins = 1;
+  e.stored = true;
+  _files[f].stamp = e.stamp;
+  return slot;
+}
+
+// PSRAMの空きを作ってスロットを返す（入らなければ-1）
+// 参照されていないものを、最後に使ったのが古い順に捨てる
+int16_t VoicevoxCache::_reserve(uint32_t bytes) {
+  if (bytes > ramMaxBytes) return -1;
+  while (true) {
+    int16_t empty = -1;
+    int16_t oldest = -1;
+    for (int i=0; i<ttsCacheRamMax; i++) {
+      TtsCacheEntry& e = entries[i];
+      if (e.pcm == nullptr) {
+        if (empty < 0) empty = i;
+      } else if (e.pins == 0 && (oldest < 0 || e.stamp < entries[oldest].stamp)) {
+        oldest = i;
+      }
+    }
+    if (empty >= 0 && ramBytes() + bytes <= ramMaxBytes) return empty;
+    if (oldest < 0) return -1;
+    _release(entries[oldest]);
+    stat.ramEvictions ++;
+  }
+}
+
+// スロットを空きにする
+void VoicevoxCache::_release(TtsCacheEntry& e) {
+  if (e.pcm != nullptr) free(e.pcm);
+  if (e.vowels != nullptr) free(e.vowels);
+  e = TtsCacheEntry();
+}
+
+// LittleFSに保存する（容量の上限を超える場合は、最後に使ったのが古いファイルから消す）
+bool VoicevoxCache::_store(TtsCacheEntry& e) {
+  uint32_t bytes = sizeof(TtsCacheFileHeader) + e.key.length() + e.vowelNum * sizeof(VowelData) + e.size;
+  if (bytes > fsMaxBytes) return false;
+  int16_t f = _findFile(e.hash);
+  if (f >= 0) _removeFile(f);
+  while (_fileNum > 0 && (_fileNum >= ttsCacheFsMax || fsBytes() + bytes > fsMaxBytes)) {
+    int16_t oldest = 0;
+    for (int i=1; i<_fileNum; i++) {
+      if (_files[i].stamp < _files[oldest].stamp) oldest = i;
+    }
+    _removeFile(oldest);
+    stat.fsEvictions ++;
+  }
+  TtsCacheFileHeader h;
+  memcpy(h.magic, "ZTC1", 4);
+  h.keyLen = e.key.length();
+  h.vowelNum = e.vowelNum;
+  memcpy(h.fmt, e.fmt, sizeof(h.fmt));
+  h.pcmSize = e.size;
+  String path = _path(e.hash);
+  File file = _fs->open(path, "w");
+  if (!file) return false;
+  size_t vbytes = e.vowelNum * sizeof(VowelData);
+  bool ok = (file.write((const uint8_t*)&h, sizeof(h)) == sizeof(h)
+             && file.write((const uint8_t*)e.key.c_str(), h.keyLen) == h.keyLen
+             && file.write((const uint8_t*)e.vowels, vbytes) == vbytes
+             && file.write(e.pcm, e.size) == e.size);
+  file.close();
+  if (!ok) {
+    _fs->remove(path);
+    return false;
+  }
+  _files[_fileNum++] = { e.hash, bytes, e.stamp };
+  return true;
+}
+
+// LittleFSのファイルを消す
+void VoicevoxCache::_removeFile(int16_t no) {
+  _fs->remove(_path(_files[no].hash));
+  for (int i=no; i<_fileNum-1; i++) _files[i] = _files[i+1];
+  _fileNum --;
+}
+
+}
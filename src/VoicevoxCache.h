@@ -0,0 +1,111 @@
+/*
+  VoicevoxCache.h
+  ズンダチャン VOICEVOX 音声キャッシュ CLASS
+
+  話者id・合成パラメーター・文をキーにして、合成したWAV（fmtとPCMデータ）とリップシンク用データを保存する。
+  よく使うものはPSRAMに置き（LRUで捨てる）、LittleFSにも保存しておくので再起動後も使える。
+  PSRAMにあるものは再生中の文から参照されている間は捨てない。LittleFSへの書き込みは再生が終わった後にまとめて行う。
+
+  Copyright (c) 2024 Kaz  (https://akibabara.com/blog/)
+  Released under the MIT license.
+  see https://opensource.org/licenses/MIT
+*/
+#pragma once
+#include <Arduino.h>
+#include <FS.h>
+
+// デバッグに便利なマクロ定義 --------
+#define sp(x) Serial.println(x)
+#define spn(x) Serial.print(x)
+#define spf(fmt, ...) Serial.printf(fmt, __VA_ARGS__)
+
+namespace voicevox_tts {
+
+enum VVVowel : uint8_t { null, a, i, u, e, o, n };  // リップシンク用の母音
+
+struct VowelData {  // VOICEVOX REST APIの時系列母音データ格納用
+  VVVowel vowel;
+  uint32_t timeline;
+};
+static_assert(sizeof(VowelData) == 8, "VowelData is stored in cache files as is");
+
+static constexpr uint16_t ttsCacheRamMax = 32;  // PSRAMに置くキャッシュの登録数の上限
+static constexpr uint16_t ttsCacheFsMax = 64;   // LittleFSに置くキャッシュの登録数の上限
+
+struct TtsCacheEntry {  // 音声キャッシュ（文1つ分）
+  String key = "";            // キー（空は未使用）
+  uint32_t hash = 0;          // キーのハッシュ値（ファイル名に使う）
+  uint8_t fmt[16];            // WAVのfmtチャンクの中身
+  uint8_t* pcm = nullptr;     // PCMデータ（PSRAM）
+  uint32_t size = 0;          // PCMデータのバイト数
+  VowelData* vowels = nullptr;  // リップシンク用データ（文の先頭からの時刻）
+  uint16_t vowelNum = 0;      // 〃 の数
+  uint32_t stamp = 0;         // 最後に使った順番（小さいものから捨てる）
+  uint8_t pins = 0;           // 再生中の文から参照されている数（0でなければ捨てない）
+  bool stored = false;        // LittleFSに保存済み
+};
+struct TtsCacheFile {  // LittleFSに保存したキャッシュ
+  uint32_t hash;              // キーのハッシュ値
+  uint32_t bytes;             // ファイルのバイト数
+  uint32_t stamp;             // 最後に使った順番（起動時からあるものは0）
+};
+struct TtsCacheFileHeader {  // キャッシュファイルの形式  ヘッダー, キー, リップシンク用データ, PCMデータ
+  char magic[4];              // "ZTC1"
+  uint16_t keyLen;            // キーのバイト数
+  uint16_t vowelNum;          // リップシンク用データの数
+  uint8_t fmt[16];            // WAVのfmtチャンクの中身
+  uint32_t pcmSize;           // PCMデータのバイト数
+};
+static_assert(sizeof(TtsCacheFileHeader) == 28, "TtsCacheFileHeader layout");
+struct TtsCacheStat {  // 音声キャッシュの計測結果
+  uint32_t ramHits = 0;       // PSRAMにあった回数
+  uint32_t fsHits = 0;        // LittleFSにあった回数
+  uint32_t misses = 0;        // 無くて合成した回数
+  uint32_t ramEvictions = 0;  // PSRAMから捨てた数
+  uint32_t fsEvictions = 0;   // LittleFSから消した数
+  uint32_t fsWrites = 0;      // LittleFSに保存した数
+  uint32_t fsErrors = 0;      // LittleFSの読み書きに失敗した数
+};
+
+class VoicevoxCache {
+public:
+  uint32_t ramMaxBytes = 2*1024*1024;   // PSRAMで使うメモリの上限（超えたら使っていないものから捨てる）
+  uint32_t fsMaxBytes = 1024*1024;      // LittleFSで使う容量の上限（超えたら使っていないものから消す）
+  uint32_t fsMaxEntryBytes = 128*1024;  // これより大きい音声はLittleFSに保存しない（定型文向け。24kHzで約2.7秒）
+  String dir = "/ttscache";             // LittleFSの保存先
+  TtsCacheEntry entries[ttsCacheRamMax];  // PSRAMのキャッシュ
+  TtsCacheStat stat;                    // 計測結果
+
+  VoicevoxCache() {};
+  ~VoicevoxCache() { clear(false); }
+
+  // メンバ関数
+  void begin(fs::FS* fs);               // LittleFSの保存先を設定して、保存済みのファイルを調べる（nullptrならPSRAMだけ使う）
+  static String makeKey(uint8_t speaker, const String& params, const String& text);  // キーを作る
+  int16_t find(const String& key);      // キャッシュを探す。PSRAMに無くLittleFSにあればPSRAMに読み込む。見つかればスロット番号（参照済み）、無ければ-1
+  int16_t put(const String& key, const uint8_t* fmt, uint8_t* pcm, uint32_t size, const VowelData* vowels, uint16_t vowelNum, uint32_t offset);  // 登録する（pcmはキャッシュのものになる）。スロット番号（参照済み）、入らなければ-1
+  void unpin(int16_t slot);             // 参照をやめる
+  void persist(volatile bool* cancel);  // LittleFSに保存していないものを保存する（再生中は呼ばないこと。cancelがtrueになったら途中でやめる）
+  void clear(bool files);               // キャッシュを全部捨てる（filesがtrueならLittleFSのファイルも消す。再生中は呼ばないこと）
+  uint16_t ramEntries();                // PSRAMの登録数
+  uint32_t ramBytes();                  // PSRAMで使っているバイト数
+  uint16_t fsEntries() { return _fileNum; }  // LittleFSの登録数
+  uint32_t fsBytes();                   // LittleFSで使っているバイト数
+  void printStat(String title);         // 計測結果をシリアルに出力する
+
+private:
+  fs::FS* _fs = nullptr;
+  TtsCacheFile _files[ttsCacheFsMax];
+  uint16_t _fileNum = 0;
+  uint32_t _stamp = 0;
+  static uint32_t _hash(const String& key);  // キーのハッシュ値（FNV-1a）
+  String _path(uint32_t hash);          // キャッシュファイルのパス
+  int16_t _findFile(uint32_t hash);     // LittleFSの登録を探す
+  int16_t _load(const String& key, uint32_t hash);  // LittleFSから読み込んでPSRAMに登録する
+  int16_t _reserve(uint32_t bytes);     // PSRAMの空きを作ってスロットを返す（入らなければ-1）
+  void _release(TtsCacheEntry& e);      // スロットを空きにする
+  bool _store(TtsCacheEntry& e);        // LittleFSに保存する
+  void _removeFile(int16_t no);         // LittleFSのファイルを消す
+};
+
+}
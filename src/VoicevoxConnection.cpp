@@ -0,0 +1,88 @@
+/*
+  VoicevoxConnection.cpp
+  ズンダチャン VOICEVOX REST-API 接続 CLASS
+
+  Copyright (c) 2024 Kaz  (https://akibabara.com/blog/)
+  Released under the MIT license.
+  see https://opensource.org/licenses/MIT
+*/
+#include "VoicevoxConnection.h"
+namespace voicevox_tts {
+
+// リクエストを送って応答のステータスコードを返す（本文はstream()から読み、end()で終わる）
+// 残っている接続は、接続先が同じ・使わなかった時間が短い・前の応答の残りが無い場合だけ使い回す
+// 使い回した接続で送れなかったら（サーバーに切られていた）、接続し直して1回だけ送り直す
+int VoicevoxConnection::request(const String& url, const char* method, const uint8_t* payload, size_t size) {
+  stat.requests ++;
+  int slash = url.indexOf("/", url.indexOf("://") + 3);
+  String base = (slash < 0) ? url : url.substring(0, slash);
+  bool reuse = keepAlive && client.connected();
+  if (reuse && (base != _base || millis() - _lastUse > idleMs || client.available() > 0)) {
+    client.stop();
+    stat.expired ++;
+    reuse = false;
+  }
+  _base = base;
+  int code = _send(url, method, payload, size);
+  if (code < 0 && reuse) {
+    client.stop();
+    stat.retries ++;
+    reuse = false;
+    code = _send(url, method, payload, size);
+  }
+  if (reuse) stat.reused ++;
+  else if (code == HTTPC_ERROR_CONNECTION_REFUSED) stat.failed ++;
+  else stat.opened ++;
+  _lastUse = millis();
+  return code;
+}
+
+// リクエストを送る（接続されていなければ接続する）
+int VoicevoxConnection::_send(const String& url, const char* method, const uint8_t* payload, size_t size) {
+  if (!keepAlive) client.stop();
+  http.begin(client, url);
+  http.setReuse(keepAlive);
+  return http.sendRequest(method, (uint8_t*)payload, size);
+}
+
+// 応答の本文の残りを読み捨てる（全部読めたらtrue）
+bool VoicevoxConnection::discard(uint32_t bytes, unsigned long timeout) {
+  WiFiClient* st = stream();
+  unsigned long lastms = millis();
+  uint8_t buf[64];
+  while (bytes > 0) {
+    size_t avail = st->available();
+    if (avail == 0) {
+      if (!client.connected() || millis() - lastms > timeout) return false;
+      delay(1);
+      continue;
+    }
+    int n = st->read(buf, (bytes < sizeof(buf)) ? bytes : sizeof(buf));
+    if (n > 0) {
+      bytes -= n;
+      lastms = millis();
+    }
+  }
+  return true;
+}
+
+// 応答を読み終わる。本文を全部読んだならtrueにすると接続を残す
+// 読み残しがある接続は、次の応答に前の本文がまざるので切る
+void VoicevoxConnection::end(bool reusable) {
+  if (!reusable || !keepAlive) client.stop();
+  http.end();   // サーバーがConnection: closeを返した場合もここで切れる
+  _lastUse = millis();
+}
+
+// 接続を切る
+void VoicevoxConnection::close() {
+  client.stop();
+}
+
+// 計測結果をシリアルに出力する
+void VoicevoxConnection::printStat(String title) {
+  spf("## %s : requests=%u opened=%u reused=%u retries=%u expired=%u failed=%u\n", title.c_str(),
+      stat.requests, stat.opened, stat.reused, stat.retries, stat.expired, stat.failed);
+}
+
+}
@@ -0,0 +1,60 @@
+/*
+  VoicevoxConnection.h
+  ズンダチャン VOICEVOX REST-API 接続 CLASS
+
+  VOICEVOX REST-APIへのHTTP/1.1の接続をkeep-aliveで使い回す（audio_queryとsynthesisで共用する）。
+  使う前に接続を確かめ、サーバーに切られていたら接続し直してリクエストを送り直す。
+  1つの接続なので、同時に複数のタスクから使わないこと。
+
+  Copyright (c) 2024 Kaz  (https://akibabara.com/blog/)
+  Released under the MIT license.
+  see https://opensource.org/licenses/MIT
+*/
+#pragma once
+#include <Arduino.h>
+#include <HTTPClient.h>
+#include <WiFiClient.h>
+
+// デバッグに便利なマクロ定義 --------
+#define sp(x) Serial.println(x)
+#define spn(x) Serial.print(x)
+#define spf(fmt, ...) Serial.printf(fmt, __VA_ARGS__)
+
+namespace voicevox_tts {
+
+struct ConnStat {  // 接続の計測結果
+  uint32_t requests = 0;      // リクエストの数
+  uint32_t opened = 0;        // 新しく接続した数
+  uint32_t reused = 0;        // 接続を使い回した数
+  uint32_t retries = 0;       // 使い回した接続が切れていて、接続し直して送り直した数
+  uint32_t expired = 0;       // しばらく使っていなかったので、使う前に切った数
+  uint32_t failed = 0;        // 接続できなかった数
+};
+
+class VoicevoxConnection {
+public:
+  bool keepAlive = true;          // 接続を使い回す（falseならリクエストごとに接続する）
+  unsigned long idleMs = 4000;    // 最後に使ってからこの時間が過ぎた接続は使わない（VOICEVOXは5秒で切る）
+  ConnStat stat;                  // 計測結果
+  WiFiClient client;              // httpより先に宣言する（httpのデストラクタがclientを使う）
+  HTTPClient http;                // 応答のヘッダーや本文はこれから読む
+
+  VoicevoxConnection() {};
+  ~VoicevoxConnection() {};
+
+  // メンバ関数
+  int request(const String& url, const char* method, const uint8_t* payload=nullptr, size_t size=0);  // リクエストを送って応答のステータスコードを返す（本文はstream()から読む）
+  WiFiClient* stream() { return http.getStreamPtr(); }  // 応答の本文を読むストリーム
+  int size() { return http.getSize(); }  // 応答の本文のバイト数（不明なら-1）
+  bool discard(uint32_t bytes, unsigned long timeout);  // 応答の本文の残りを読み捨てる（全部読めたらtrue）
+  void end(bool reusable);        // 応答を読み終わる。本文を全部読んだならtrueにすると接続を残す
+  void close();                   // 接続を切る
+  void printStat(String title);   // 計測結果をシリアルに出力する
+
+private:
+  String _base = "";              // 接続先（http://ホスト:ポート）
+  unsigned long _lastUse = 0;     // 最後に使った時刻
+  int _send(const String& url, const char* method, const uint8_t* payload, size_t size);  // リクエストを送る
+};
+
+}
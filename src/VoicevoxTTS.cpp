@@ -11,6 +11,8 @@
 
 namespace voicevox_tts {
 
+void taskSynthLoop(void *args);   // タスク処理：文単位パイプラインの合成
+
 DriveContextTTS::DriveContextTTS(VoicevoxTTS *vvtts) : vvtts{vvtts} {}
 VoicevoxTTS *DriveContextTTS::getVoicevoxTTS() { return vvtts; }
 
@@ -117,6 +119,11 @@ void VoicevoxTTS::setEndpoint(VoicevoxApiType apiType, String url) {
   }
 }
 
+// 音声キャッシュの保存先のファイルシステムを設定する（設定しなければPSRAMだけ使う）
+void VoicevoxTTS::setCacheFS(fs::FS &fs) {
+  cache.begin(&fs);
+}
+
 // httpでGETアクセスを行う
 // HtmlStatus VoicevoxTTS::httpRequest(String url, String method) {
 //   HtmlStatus hres = { "", 0, -1 };
@@ -148,12 +155,19 @@ void VoicevoxTTS::setEndpoint(VoicevoxApiType apiType, String url) {
 // }
 
 // Webサーバーにアクセスして、JSONをデコードする
+// REST-APIはconnの接続を使い回す（本文を読み切った場合だけ接続を残す）
 HtmlStatus VoicevoxTTS::httpGetJson(String url, HttpMethod method, bool decodeJson, String postData) {
-  HTTPClient http;
+  HTTPClient localHttp;
+  bool useConn = isRestApiUrl(url);
+  HTTPClient& http = (useConn) ? conn.http : localHttp;
   HtmlStatus hres = { "", 0, -1 };
+  bool bodyRead = false;
 
   // 接続
-  if (url.startsWith("https://")) {
+  if (useConn) {
+    const char* type = (method == HttpMethod::GET) ? "GET" : (method == HttpMethod::POST) ? "POST" : "HEAD";
+    hres.code = conn.request(url, type, (uint8_t*)postData.c_str(), postData.length());
+  } else if (url.startsWith("https://")) {
     if (useRootCACertificate) {
       sclient.setCACert(rootCACertificate); // 証明書を設定する
     } else {
@@ -163,16 +177,17 @@ HtmlStatus VoicevoxTTS::httpGetJson(String url, HttpMethod method, bool decodeJs
   } else {
     http.begin(client, url);  // 普通のhttp接続
   }
-  //http.setReuse(true);
-  http.setFollowRedirects(HTTPC_FORCE_FOLLOW_REDIRECTS);
 
   // データ取得開始
-  if (method == HttpMethod::GET) {
-    hres.code = http.GET();
-  } else if (method == HttpMethod::POST) {
-    hres.code = http.POST(postData);
-  } else if (method == HttpMethod::HEAD) {
-    hres.code = http.sendRequest("HEAD");
+  if (!useConn) {
+    http.setFollowRedirects(HTTPC_FORCE_FOLLOW_REDIRECTS);
+    if (method == HttpMethod::GET) {
+      hres.code = http.GET();
+    } else if (method == HttpMethod::POST) {
+      hres.code = http.POST(postData);
+    } else if (method == HttpMethod::HEAD) {
+      hres.code = http.sendRequest("HEAD");
+    }
   }
   if (hres.code == HTTP_CODE_OK) {
     hres.size = http.getSize();
@@ -182,15 +197,25 @@ HtmlStatus VoicevoxTTS::httpGetJson(String url, HttpMethod method, bool decodeJs
         Stream* stream = http.getStreamPtr();
         DeserializationError error = deserializeJson(*json, *stream);
         if (error) Serial.print(error.f_str());
+        else bodyRead = true;
       } else {
         //hres.html = http.getString();
       }
     }
   }
-  http.end();
+  if (useConn) {
+    conn.end(bodyRead || (hres.code == HTTP_CODE_OK && (hres.size == 0 || method == HttpMethod::HEAD)));
+  } else {
+    http.end();
+  }
   return hres;
 }
 
+// REST-APIのURLか？（connの接続を使う）
+bool VoicevoxTTS::isRestApiUrl(const String& url) {
+  return (apiType == VoicevoxApiType::RestApi && url.startsWith("http://") && url.startsWith(endpointRestApi));
+}
+
 // テキストを喋る
 void VoicevoxTTS::speak(String text, bool waiting) {
   if (debug) Serial.println("Speak: "+text);
@@ -387,15 +412,45 @@ void VoicevoxTTS::speakRestApi(String text){
    * LANからアクセスできるようにする方法
    * C:\Users\xxx\AppData\Local\Programs\VOICEVOX/run.exe --host 192.168.x.xx --port 50021
    * Document: http://192.168.x.xx:50021/docs
+   * sentencePipelineがtrueなら文単位で合成タスクに任せてすぐ戻る（全文の合成を待たずに最初の文から再生する）
   */
   String url, audioUrl;
-  bool mp3Ready = false;
   HtmlStatus hres;
-  unsigned long timeout = 0;
 
-  // 初期化
-  for (int i=0; i<MAX_VOWEL_HISTORY; i++) {
-    vowelHistories[i] = { VVVowel::null, 0 };
+  // 初期化（前の合成タスクがキャッシュを保存しているだけなら、今のファイルで保存を打ち切らせて終わるまで待つ）
+  // 保存できなかった文はstoredがfalseのまま残り、次の発話の後に保存される
+  if (synthRunning && !nowPlaying) synthCancel = true;
+  while (synthRunning) delay(1);
+  speakStat = SpeakStat();
+  speakStartMs = millis();
+  vowelCount = 0;
+
+  // 文単位パイプライン：文に分割して合成タスクを開始する
+  if (sentencePipeline && usePsram) {
+    nowPlaying = true;
+    segmentNum = 0;
+    String texts[MAX_TTS_SEGMENTS];
+    uint8_t num = splitSentences(text, texts, MAX_TTS_SEGMENTS);
+    for (int i=0; i<num; i++) {
+      segments[i] = { texts[i], nullptr, 0, 0, false, -1 };
+    }
+    segmentNum = num;
+    speakStat.segments = num;
+    wavByteRate = 0;
+    synthCancel = false;
+    synthLoopDone = false;
+    playEnded = false;
+    synthRunning = true;
+    DriveContextTTS *ctx = new DriveContextTTS(this);
+    xTaskCreateUniversal(
+      taskSynthLoop,  // Function to implement the task
+      "taskSynthLoop",// Name of the task
+      8192,           // Stack size in words
+      ctx,            // Task input parameter
+      2,              // Priority of the task
+      NULL,           // Task handle.
+      0);             // 通信はWiFiと同じコアで行う
+    return;
   }
 
   // (1)音声合成用のクエリを作成する
@@ -406,85 +461,458 @@ void VoicevoxTTS::speakRestApi(String text){
   // レスポンス処理1
   int accNum = 0;
   if (hres.code == HTTP_CODE_OK) {
-    int index = 0;
-    unsigned long timeline = 0;
     if ((*json).containsKey("accent_phrases")) {
       accNum = (*json)["accent_phrases"].size();
-      // リップシンク用データを配列に保存する。JSONのフォーマットはmemo.txt参照
-      int moraNum;
-      if ((*json).containsKey("prePhonemeLength")) {
-        timeline = (*json)["prePhonemeLength"].as<float>() * 1000;
-      }
-      for (int i=0; i<accNum; i++) {
-        VVVowel vowel;
-        uint16_t wait = 0;
-        if ((*json)["accent_phrases"][i].containsKey("moras")) {
-          moraNum = (*json)["accent_phrases"][i]["moras"].size();
-          for (int j=0; j<moraNum; j++) {
-            String jvowel = (*json)["accent_phrases"][i]["moras"][j]["vowel"];
-            jvowel.toLowerCase();
-            if (jvowel == "a") vowel = VVVowel::a;
-            else if (jvowel == "i") vowel = VVVowel::i;
-            else if (jvowel == "u") vowel = VVVowel::u;
-            else if (jvowel == "e") vowel = VVVowel::e;
-            else if (jvowel == "o") vowel = VVVowel::o;
-            else if (jvowel == "n") vowel = VVVowel::n;
-            else if (jvowel == "cl") vowel = VVVowel::u;  // ッ
-            else {
-              vowel = VVVowel::n;
-              Serial.println("******* Unknown Vowel String \""+jvowel+"\"");
-            }
-            wait = (*json)["accent_phrases"][i]["moras"][j]["consonant_length"].as<float>() * 1000;
-            wait += (*json)["accent_phrases"][i]["moras"][j]["vowel_length"].as<float>() * 1000;
-            vowelHistories[index] = { vowel, timeline };
-            timeline += wait;
-            index ++;
-          }
-        }
-        if (index >= (sizeof(vowelHistories)/sizeof(vowelHistories[0])-1)) break;
-        if ((*json)["accent_phrases"][i].containsKey("pause_mora")) {
-          if ((*json)["accent_phrases"][i]["pause_mora"].containsKey("vowel_length")) {
-            wait = (*json)["accent_phrases"][i]["pause_mora"]["vowel_length"].as<float>() * 1000;
-            vowelHistories[index] = { VVVowel::n, timeline };
-            timeline += wait;
-            index ++;
-          }
-        }
-        if (index >= (sizeof(vowelHistories)/sizeof(vowelHistories[0])-1)) break;
-      }
     }
-    vowelHistories[index] = { VVVowel::null, timeline };
-    // sp("index="+String(index));
-    // for (int i=0; i<=index; i++) {
-    //   sp("vowelHistories["+String(i)+"] = "+ String(vowelHistories[i].vowel) +" , "+ String(vowelHistories[i].timeline));
-    // }
+    vowelCount = _parseVowels(0, 0);
   }
 
   // (2)音声合成を実行し、再生する
   if (accNum > 0) {
+    _applyParams();
     size_t bytesWritten = serializeJson(*json, postBuffer, preallocatePostSize+1);
     audioUrl = endpointRestApi + "/synthesis?&speaker="+String(characterID);
     if (debug) Serial.println("Post size="+String(bytesWritten));
     if (debug) Serial.println("playUrlWAV: "+audioUrl);
     playUrlWAV(audioUrl, true, postBuffer);
+    speakStat.segments = 1;
+    speakStat.firstAudioMs = millis() - speakStartMs;
   }
 
 }
 
+// audio_queryの結果からリップシンク用データを作る（indexから書き込み、次の位置を返す）
+// timelineはoffset(ms)からの通しの時刻にする。最後に口を閉じるデータ(null)を入れる
+uint16_t VoicevoxTTS::_parseVowels(uint16_t index, uint32_t offset) {
+  const int maxIndex = MAX_VOWEL_HISTORY - 1;   // 最後のnullの分を残す
+  if (index > maxIndex) return index;
+  uint32_t timeline = offset;
+  float msScale = (speedScale > 0) ? 1000 / speedScale : 1000;  // 話速を変えた分だけ時刻を縮める
+  if ((*json).containsKey("accent_phrases")) {
+    int accNum = (*json)["accent_phrases"].size();
+    // リップシンク用データを配列に保存する。JSONのフォーマットはmemo.txt参照
+    int moraNum;
+    if ((*json).containsKey("prePhonemeLength")) {
+      timeline += (*json)["prePhonemeLength"].as<float>() * msScale;
+    }
+    for (int i=0; i<accNum; i++) {
+      VVVowel vowel;
+      uint16_t wait = 0;
+      if ((*json)["accent_phrases"][i].containsKey("moras")) {
+        moraNum = (*json)["accent_phrases"][i]["moras"].size();
+        for (int j=0; j<moraNum && index<maxIndex; j++) {
+          String jvowel = (*json)["accent_phrases"][i]["moras"][j]["vowel"];
+          jvowel.toLowerCase();
+          if (jvowel == "a") vowel = VVVowel::a;
+          else if (jvowel == "i") vowel = VVVowel::i;
+          else if (jvowel == "u") vowel = VVVowel::u;
+          else if (jvowel == "e") vowel = VVVowel::e;
+          else if (jvowel == "o") vowel = VVVowel::o;
+          else if (jvowel == "n") vowel = VVVowel::n;
+          else if (jvowel == "cl") vowel = VVVowel::u;  // ッ
+          else {
+            vowel = VVVowel::n;
+            Serial.println("******* Unknown Vowel String \""+jvowel+"\"");
+          }
+          wait = (*json)["accent_phrases"][i]["moras"][j]["consonant_length"].as<float>() * msScale;
+          wait += (*json)["accent_phrases"][i]["moras"][j]["vowel_length"].as<float>() * msScale;
+          vowelHistories[index] = { vowel, timeline };
+          timeline += wait;
+          index ++;
+        }
+      }
+      if (index >= maxIndex) break;
+      if ((*json)["accent_phrases"][i].containsKey("pause_mora")) {
+        if ((*json)["accent_phrases"][i]["pause_mora"].containsKey("vowel_length")) {
+          wait = (*json)["accent_phrases"][i]["pause_mora"]["vowel_length"].as<float>() * msScale;
+          vowelHistories[index] = { VVVowel::n, timeline };
+          timeline += wait;
+          index ++;
+        }
+      }
+      if (index >= maxIndex) break;
+    }
+  }
+  vowelHistories[index] = { VVVowel::null, timeline };
+  return index + 1;
+}
+
+// テキストを文に分割する（。！？と改行の後で区切る。続く閉じカッコや記号は前の文に含める）
+// 空の文は捨てる。maxNumを超えた分は最後の文にまとめる
+uint8_t VoicevoxTTS::splitSentences(const String& text, String* out, uint8_t maxNum) {
+  static const char* const enders[] = { "\xE3\x80\x82", "\xEF\xBC\x81", "\xEF\xBC\x9F", "!", "?", "\n", "\r" };  // 。！？!?改行
+  static const char* const closers[] = { "\xE3\x80\x8D", "\xE3\x80\x8F", "\xEF\xBC\x89", ")" };  // 」』）)
+  auto match = [&text](int pos, const char* const* list, int num) -> int {
+    for (int k=0; k<num; k++) {
+      int len = strlen(list[k]);
+      if (strncmp(text.c_str() + pos, list[k], len) == 0) return len;
+    }
+    return 0;
+  };
+  uint8_t num = 0;
+  int len = text.length();
+  int start = 0;
+  int pos = 0;
+  while (pos < len && maxNum > 0) {
+    int n = match(pos, enders, 7);
+    if (n == 0) {
+      pos ++;
+      continue;
+    }
+    // 区切りが続く間と閉じカッコは前の文に含める
+    pos += n;
+    while (pos < len && ((n = match(pos, enders, 7)) > 0 || (n = match(pos, closers, 4)) > 0)) pos += n;
+    if (num == maxNum - 1) break;   // 残りは最後の文にまとめる
+    String s = text.substring(start, pos);
+    s.trim();
+    if (s.length() > 0) out[num++] = s;
+    start = pos;
+  }
+  if (start < len && maxNum > 0) {
+    String s = text.substring(start);
+    s.trim();
+    if (s.length() > 0) out[num++] = s;
+  }
+  return num;
+}
+
+// タスク処理：文単位パイプラインの合成
+void taskSynthLoop(void *args) {
+  DriveContextTTS *ctx = reinterpret_cast<DriveContextTTS *>(args);
+  VoicevoxTTS *vvtts = ctx->getVoicevoxTTS();
+  delete ctx;
+  bool started = vvtts->_synthLoop();
+  vvtts->synthLoopDone = true;
+  // 再生が終わってから、キャッシュに登録した音声をLittleFSに保存する（書き込み中は音が途切れるため）
+  if (started) {
+    while (!vvtts->playEnded) delay(10);
+  }
+  if (vvtts->useCache && !vvtts->synthCancel) vvtts->cache.persist(&vvtts->synthCancel);
+  vvtts->synthRunning = false;
+  vTaskDelete(NULL);
+}
+
+// 文を順番に合成して受信する（再生を開始したらtrueを返す）
+// 最初に受信できた文で再生を開始し、以降の文は再生中に合成する。再生が始まらなかった場合はここで後始末をする
+// キャッシュにある文は通信せずにそれを使い、合成した文はキャッシュに登録する
+bool VoicevoxTTS::_synthLoop() {
+  bool started = false;
+  uint32_t offset = 0;    // 次の文の開始時刻(ms)
+  String params = _cacheParams();
+  for (uint8_t no=0; no<segmentNum; no++) {
+    TtsSegment& seg = segments[no];
+    bool ok = false;
+    if (!synthCancel) {
+      String key = VoicevoxCache::makeKey(characterID, params, seg.text);
+      int16_t slot = useCache ? cache.find(key) : -1;
+      if (slot >= 0) {
+        ok = _playCached(no, slot, offset, started);
+        if (ok) speakStat.cacheHits ++;
+        if (debug) Serial.println("VOICEVOX cache hit "+String(no)+": "+seg.text);
+      } else {
+        // (1)音声合成用のクエリを作成する
+        unsigned long tm = millis();
+        String url = endpointRestApi + "/audio_query?text="+URLEncode(seg.text.c_str()) + "&speaker="+String(characterID);
+        HtmlStatus hres = httpGetJson(url, HttpMethod::POST, true, "");
+        speakStat.queryMs += millis() - tm;
+        debugUrlPrint("VOICEVOX RestApi Query "+String(no), "POST "+url, hres.code);  // デバッグ情報
+        if (hres.code == HTTP_CODE_OK && (*json)["accent_phrases"].size() > 0) {
+          // (2)リップシンク用データを作り（公開は受信開始時）、音声合成を実行して受信する
+          _applyParams();
+          uint16_t vowelStart = vowelCount;
+          uint16_t vowelEnd = _parseVowels(vowelStart, offset);
+          tm = millis();
+          ok = _synthSegment(no, vowelEnd, started);
+          speakStat.synthMs += millis() - tm;
+          // (3)キャッシュに登録する（リップシンク用データが入りきらなかった文は登録しない）
+          if (ok && useCache && vowelEnd < MAX_VOWEL_HISTORY) {
+            seg.cacheSlot = cache.put(key, wavHeader+20, seg.data, seg.size, &vowelHistories[vowelStart], vowelEnd - vowelStart, offset);
+          }
+        }
+      }
+    }
+    if (!ok) {
+      if (!synthCancel) speakStat.failed ++;
+      seg.size = seg.filled;  // 途中まで受信できた分は再生する
+    }
+    if (seg.size > 0) {
+      uint32_t ms = (uint64_t)seg.size * 1000 / wavByteRate;
+      offset += ms;
+      speakStat.audioMs += ms;
+    }
+    seg.done = true;
+  }
+  if (!started) {
+    _releaseSegments();
+    if (synthCancel) Serial.println("VoicevoxTTS canceled.");
+    else Serial.println("VoicevoxTTS request failed.");
+    nowPlaying = false;
+  }
+  return started;
+}
+
+// キャッシュの音声を文の音声データにする。最初の文なら再生を開始する
+// PCMデータはキャッシュのものをそのまま使う（参照中なので捨てられない。_releaseSegments()で参照をやめる）
+bool VoicevoxTTS::_playCached(uint8_t no, int16_t slot, uint32_t offset, bool& started) {
+  TtsSegment& seg = segments[no];
+  TtsCacheEntry& e = cache.entries[slot];
+  if (!_setWavFormat(e.fmt)) {   // 前の文と形式が違う
+    cache.unpin(slot);
+    return false;
+  }
+  seg.cacheSlot = slot;
+  seg.data = e.pcm;
+  seg.size = e.size;
+
+  // リップシンク用データを文の開始時刻に合わせて公開する（入りきらない分は捨てて口を閉じる）
+  uint16_t index = vowelCount;
+  for (int i=0; i<e.vowelNum && index<MAX_VOWEL_HISTORY; i++) {
+    vowelHistories[index++] = { e.vowels[i].vowel, e.vowels[i].timeline + offset };
+  }
+  if (index == MAX_VOWEL_HISTORY && index > vowelCount) vowelHistories[index-1].vowel = VVVowel::null;
+  vowelCount = index;
+  if (!started) {
+    format = AudioFormat::wav;
+    segsrc = new AudioFileSourceSegments(this);
+    playAudio(segsrc);
+    started = true;
+  }
+  seg.filled = e.size;
+  return true;
+}
+
+// キャッシュのキーにする合成パラメーター
+String VoicevoxTTS::_cacheParams() {
+  return String(speedScale, 2) + "," + String(pitchScale, 2) + "," + String(intonationScale, 2) + "," + String(volumeScale, 2);
+}
+
+// audio_queryの結果に合成パラメーターを設定する
+void VoicevoxTTS::_applyParams() {
+  (*json)["speedScale"] = speedScale;
+  (*json)["pitchScale"] = pitchScale;
+  (*json)["intonationScale"] = intonationScale;
+  (*json)["volumeScale"] = volumeScale;
+}
+
+// 1つの文を合成して受信する。最初の文なら再生を開始する
+bool VoicevoxTTS::_synthSegment(uint8_t no, uint16_t vowelEnd, bool& started) {
+  TtsSegment& seg = segments[no];
+  size_t postSize = serializeJson(*json, postBuffer, preallocatePostSize+1);
+  String url = endpointRestApi + "/synthesis?&speaker="+String(characterID);
+  int code = conn.request(url, "POST", (uint8_t*)postBuffer, postSize);
+  debugUrlPrint("VOICEVOX RestApi Synthesis "+String(no), "POST "+url, code, "Post size="+String(postSize));  // デバッグ情報
+  int size = conn.size();
+  if (code != HTTP_CODE_OK || size <= 0 || synthCancel) {
+    conn.end(false);
+    return false;
+  }
+
+  // WAVのヘッダーを読んで、PCMデータ用のメモリを確保する
+  WiFiClient* stream = conn.stream();
+  uint32_t remain = size;
+  uint32_t dataSize = 0;
+  if (!_readWavHeader(stream, remain, dataSize)) {
+    Serial.println("VoicevoxTTS bad wav header.");
+    conn.end(false);
+    return false;
+  }
+  if (dataSize > remain) dataSize = remain;
+  uint16_t blockAlign = wavHeader[32] | (wavHeader[33] << 8);
+  dataSize -= dataSize % blockAlign;  // 文をつなげてもサンプルがずれないようにする
+  seg.data = (uint8_t *)ps_malloc(dataSize);
+  if (seg.data == nullptr) {
+    Serial.printf("VoicevoxTTS unable to allocate %d bytes\n", dataSize);
+    conn.end(false);
+    return false;
+  }
+  seg.size = dataSize;
+
+  // リップシンク用データを公開して、最初の文なら再生を開始する
+  vowelCount = vowelEnd;
+  if (!started) {
+    format = AudioFormat::wav;
+    segsrc = new AudioFileSourceSegments(this);
+    playAudio(segsrc);
+    started = true;
+  }
+
+  // PCMデータを受信する（再生タスクは受信済みの分から読み出す）
+  unsigned long lastms = millis();
+  while (seg.filled < seg.size && !synthCancel) {
+    size_t avail = stream->available();
+    if (avail == 0) {
+      if (!conn.http.connected() || millis() - lastms > VoicevoxGenerateTimeout) break;
+      delay(1);
+      continue;
+    }
+    size_t len = seg.size - seg.filled;
+    if (len > avail) len = avail;
+    if (len > 4096) len = 4096;
+    int n = stream->read(seg.data + seg.filled, len);
+    if (n > 0) {
+      seg.filled += n;
+      lastms = millis();
+    }
+  }
+  // 残り（データの後のチャンクなど）を読み捨てて、接続を次の文で使えるようにする
+  bool ok = (seg.filled == seg.size);
+  conn.end(ok && conn.discard(remain - seg.size, VoicevoxGenerateTimeout));
+  return ok;
+}
+
+// WAVのヘッダーを読んで形式を確かめる（remainは読んだ分だけ減らす）
+// 最初の文ならwavHeaderを作り、以降の文は同じ形式でなければ失敗にする
+bool VoicevoxTTS::_readWavHeader(Stream* stream, uint32_t& remain, uint32_t& dataSize) {
+  auto readBytes = [&](uint8_t* buf, uint32_t len) -> bool {
+    if (len > remain) return false;
+    stream->setTimeout(2000);
+    if (stream->readBytes(buf, len) != len) return false;
+    remain -= len;
+    return true;
+  };
+  uint8_t head[12];
+  uint8_t fmt[16];
+  bool fmtFound = false;
+  if (!readBytes(head, 12) || memcmp(head, "RIFF", 4) != 0 || memcmp(head+8, "WAVE", 4) != 0) return false;
+  while (true) {
+    uint8_t chunk[8];
+    if (!readBytes(chunk, 8)) return false;
+    uint32_t len = chunk[4] | (chunk[5] << 8) | (chunk[6] << 16) | (chunk[7] << 24);
+    if (memcmp(chunk, "data", 4) == 0) {
+      dataSize = len;
+      break;
+    }
+    uint32_t skip = len + (len & 1);
+    if (memcmp(chunk, "fmt ", 4) == 0 && len >= 16) {
+      if (!readBytes(fmt, 16)) return false;
+      fmtFound = true;
+      skip -= 16;
+    }
+    while (skip > 0) {
+      uint8_t tmp[16];
+      uint32_t n = (skip < sizeof(tmp)) ? skip : sizeof(tmp);
+      if (!readBytes(tmp, n)) return false;
+      skip -= n;
+    }
+  }
+  if (!fmtFound || (fmt[0] | (fmt[1] << 8)) != 1) return false;   // リニアPCMのみ
+  return _setWavFormat(fmt);
+}
+
+// 再生用のWAVヘッダーを作る（最初の文）、以降の文は同じ形式か確かめる
+bool VoicevoxTTS::_setWavFormat(const uint8_t* fmt) {
+  if (wavByteRate == 0) {
+    // 再生用のヘッダー。データの大きさは不明なので最大にしておく（終わりは読み出し側で判断する）
+    const uint32_t riffSize = 0x7FFFFFFF;
+    memcpy(wavHeader, "RIFF", 4);
+    memcpy(wavHeader+4, &riffSize, 4);
+    memcpy(wavHeader+8, "WAVEfmt ", 8);
+    const uint32_t fmtSize = 16;
+    memcpy(wavHeader+16, &fmtSize, 4);
+    memcpy(wavHeader+20, fmt, 16);
+    memcpy(wavHeader+36, "data", 4);
+    const uint32_t dataMax = riffSize - 36;
+    memcpy(wavHeader+40, &dataMax, 4);
+    wavByteRate = fmt[8] | (fmt[9] << 8) | (fmt[10] << 16) | (fmt[11] << 24);
+    return (wavByteRate > 0 && (fmt[12] | (fmt[13] << 8)) > 0);
+  }
+  return (memcmp(wavHeader+20, fmt, 16) == 0);
+}
+
+// 文ごとの音声データを解放する
+void VoicevoxTTS::_releaseSegments() {
+  for (int i=0; i<MAX_TTS_SEGMENTS; i++) {
+    if (segments[i].cacheSlot >= 0) cache.unpin(segments[i].cacheSlot);   // キャッシュのものは参照をやめるだけ
+    else if (segments[i].data) free(segments[i].data);
+    segments[i] = { "", nullptr, 0, 0, false, -1 };
+  }
+  segmentNum = 0;
+}
+
+// 文単位パイプラインの計測結果をシリアルに出力する
+void VoicevoxTTS::printSpeakStat(String title) {
+  spf("## %s : segments=%u failed=%u cached=%u firstAudio=%ums query=%ums synth=%ums audio=%ums stalls=%u (%ums)\n", title.c_str(),
+      speakStat.segments, speakStat.failed, speakStat.cacheHits, speakStat.firstAudioMs, speakStat.queryMs, speakStat.synthMs,
+      speakStat.audioMs, speakStat.stalls, speakStat.stallMs);
+  if (useCache) cache.printStat("VOICEVOX cache");
+  conn.printStat("VOICEVOX conn");
+}
+
+// URLの音声の再生の計測結果をシリアルに出力する
+void VoicevoxTTS::printStreamStat(String title) {
+  JitterStat& st = streamStat;
+  spf("## %s : bitrate=%u throughput=%u margin=%ums prefill=%u (%ums) underruns=%u (%ums) fill min=%u avg=%u bytes=%u\n", title.c_str(),
+      st.bitrate, st.throughput, st.marginMs, st.prefillBytes, st.prefillMs, st.underruns, st.underrunMs, st.minFill, st.avgFill, st.bytes);
+  spn("## fill histogram :");
+  for (int i=0; i<jitterHistBins; i++) spf(" %u", st.fillHist[i]);
+  sp("");
+}
+
+// 読み出した音声の長さ(ms)
+uint32_t AudioFileSourceSegments::getPlayedMs() {
+  if (_pos <= sizeof(vvtts->wavHeader) || vvtts->wavByteRate == 0) return 0;
+  return (uint64_t)(_pos - sizeof(vvtts->wavHeader)) * 1000 / vvtts->wavByteRate;
+}
+
+// 文ごとのPCMデータを順番に読み出す（先頭はWAVヘッダー）
+// 次の文がまだ届いていなければ届くまで待ち、待った時間を記録する。全部読み終わるか中断したら0を返す
+uint32_t AudioFileSourceSegments::read(void *data, uint32_t len) {
+  uint8_t *p = reinterpret_cast<uint8_t*>(data);
+  if (_pos < sizeof(vvtts->wavHeader)) {
+    uint32_t n = sizeof(vvtts->wavHeader) - _pos;
+    if (n > len) n = len;
+    memcpy(p, vvtts->wavHeader + _pos, n);
+    _pos += n;
+    return n;
+  }
+  unsigned long stallms = 0;
+  while (!vvtts->synthCancel && _seg < vvtts->segmentNum) {
+    TtsSegment& seg = vvtts->segments[_seg];
+    uint32_t filled = seg.filled;
+    if (_segPos < filled) {
+      uint32_t n = filled - _segPos;
+      if (n > len) n = len;
+      memcpy(p, seg.data + _segPos, n);
+      _segPos += n;
+      _pos += n;
+      if (vvtts->speakStat.firstAudioMs == 0) vvtts->speakStat.firstAudioMs = millis() - vvtts->speakStartMs;
+      if (stallms != 0) {
+        vvtts->speakStat.stalls ++;
+        vvtts->speakStat.stallMs += millis() - stallms;
+      }
+      return n;
+    }
+    if (seg.done) {   // 次の文へ
+      _seg ++;
+      _segPos = 0;
+      continue;
+    }
+    if (stallms == 0 && _pos > sizeof(vvtts->wavHeader)) stallms = millis();  // 最初の文の受信待ちは数えない
+    delay(1);
+  }
+  return 0;
+}
+
 // 指定URLから音声ファイルをダウンロードして再生する
 void VoicevoxTTS::playUrl(String url, AudioFormat audioformat, bool post, char* data) {
   if (!nowPlaying) {
     nowPlaying = true;
     format = audioformat;
-    file = new AudioFileSourceHTTPStream2(url.c_str(), post, data);
+    if (isRestApiUrl(url)) {  // REST-APIはconnの接続を使い回す
+      int code = conn.request(url, post ? "POST" : "GET", (uint8_t*)data, (post && data) ? strlen(data) : 0);
+      file = new AudioFileSourceHTTPStream2(&conn.http, code);
+    } else {
+      file = new AudioFileSourceHTTPStream2(url.c_str(), post, data);
+    }
     if (file->size > 0) {
       if (useRootCACertificate) {
         file->setRootCA(rootCACertificate);  // ルート証明書
       } else {
         file->unsetRootCA();
       }
-      buff = new AudioFileSourceBuffer(file, preallocateBuffer, preallocateBufferSize);
-      playAudio(buff);
+      jbuff = new AudioFileSourceJitterBuffer(file, preallocateBuffer, preallocateBufferSize, netThroughput);
+      jbuff->marginMs = jitterMarginMs;
+      playAudio(jbuff);
     } else {
       Serial.println("VoicevoxTTS open-url failed.");
       stopAudio();  // メモリ開放
@@ -504,14 +932,14 @@ void VoicevoxTTS::playProgmem(const unsigned char* data, size_t size, AudioForma
 }
 
 // 再生開始
-void VoicevoxTTS::playAudio(AudioFileSourceBuffer *buff) {
+void VoicevoxTTS::playAudio(AudioFileSource *src) {
   sp("playAudio");
   if (format == AudioFormat::mp3) {
     mp3 = new AudioGeneratorMP3();
-    mp3->begin(buff, _out);
+    mp3->begin(src, _out);
   } else if (format == AudioFormat::wav) {
     wav = new AudioGeneratorWAV();
-    wav->begin(buff, _out);
+    wav->begin(src, _out);
   }
   startAutoPlay();
 }
@@ -519,40 +947,77 @@ void VoicevoxTTS::playAudio(AudioFileSourceBuffer *buff) {
 // 再生停止（再生の停止とメモリ開放）
 void VoicevoxTTS::stopAudio() {
   sp("stopAudio");
-  if (mp3 != NULL) {
-    if (format == AudioFormat::mp3) {
-      mp3->stop();
-      delete mp3;
-      mp3 = NULL;
-    } else if (format == AudioFormat::wav) {
-      wav->stop();
-      delete wav;
-      wav = NULL;
-    }
+  if (format == AudioFormat::mp3 && mp3 != NULL) {
+    mp3->stop();
+    delete mp3;
+    mp3 = NULL;
+  } else if (format == AudioFormat::wav && wav != NULL) {
+    wav->stop();
+    delete wav;
+    wav = NULL;
   }
   if (buff != NULL) {
     buff->close();
     delete buff;
     buff = NULL;
   }
+  if (jbuff != NULL) {  // 計測結果を残し、次の再生でためる量を調整する
+    jbuff->close();
+    streamStat = jbuff->stat;
+    if (streamStat.throughput > 0) {
+      netThroughput = (netThroughput == 0) ? streamStat.throughput : (netThroughput * 3 + streamStat.throughput) / 4;
+    }
+    if (streamStat.underruns > 0) {   // 止まったら余裕を倍にする
+      jitterMarginMs *= 2;
+      if (jitterMarginMs > jitterMarginMaxMs) jitterMarginMs = jitterMarginMaxMs;
+    } else {    // 止まらなければ少しずつ減らす
+      jitterMarginMs = jitterMarginMs * 7 / 8;
+      if (jitterMarginMs < jitterMarginMinMs) jitterMarginMs = jitterMarginMinMs;
+    }
+    delete jbuff;
+    jbuff = NULL;
+    if (debug) printStreamStat("VOICEVOX stream");
+  }
   if (file != NULL) {
     file->close();
+    if (file->isAttached()) conn.end(file->size > 0 && (int)file->getPos() >= file->size);  // 最後まで受信していれば接続を残す
     delete file;
     file = NULL;
   }
+  if (segsrc != NULL) {   // 文単位パイプラインなら合成タスクが全部の文を処理し終わるのを待って後始末をする
+    if (!synthLoopDone) synthCancel = true;   // 最後まで再生した場合は中断にしない（キャッシュを保存する）
+    while (!synthLoopDone) delay(1);
+    delete segsrc;
+    segsrc = NULL;
+    _releaseSegments();
+    if (debug) printSpeakStat("VOICEVOX speak");
+    playEnded = true;
+  }
   nowPlaying = false;
   for (int i=0; i<levelsCnt; i++) levels[i] = 0;
 }
 
 // タスク処理：自動音声再生
+// 出力のバッファーが空くまで待ってから（待っている間は他のタスクが動く）、デコードしてバッファーを1つ埋める
+// 出力が進まなかった場合（音声データの受信待ちなど）も1tick休んで、同じコアの描画タスクやloop()を止めないようにする
 void taskAudioOutputLoop(void *args) {
   DriveContextTTS *ctx = reinterpret_cast<DriveContextTTS *>(args);
   VoicevoxTTS *vvtts = ctx->getVoicevoxTTS();
+  AudioOutputM5Speaker *out = vvtts->_out;
+  AudioLoopStat& st = vvtts->audioStat;
+  st = AudioLoopStat();
   vvtts->_nowPlayingVowel = VVVowel::null;
+  vvtts->_vowelCursor = 0;
   unsigned long stams = millis();
-  int vidx = 0;
+  uint32_t updates = out->getUpdateCount();
 
   while (vvtts->nowAutoPlaying) {
+    // 出力のバッファーが空くまで待つ
+    uint32_t tw = micros();
+    while (vvtts->nowAutoPlaying && !out->needsData()) vTaskDelay(1);
+    uint32_t tm = micros();
+    st.waitUs += tm - tw;
+
     // 再生の継続処理
     if (vvtts->format == AudioFormat::mp3) {
       if(vvtts->mp3 != NULL) {
@@ -567,31 +1032,61 @@ void taskAudioOutputLoop(void *args) {
         } else break;
       }
     }
-    // 音声レベル取得
-    vvtts->levels[vvtts->levelsIdx] = abs(*(vvtts->_out)->getBuffer());
-    vvtts->levelsIdx = (vvtts->levelsIdx + 1) % vvtts->levelsCnt;
+    // 音声レベル取得（出力したバッファーごと）
+    bool progressed = (out->getUpdateCount() != updates);
+    if (progressed) {
+      st.buffers += out->getUpdateCount() - updates;
+      updates = out->getUpdateCount();
+      vvtts->levels[vvtts->levelsIdx] = abs(*out->getBuffer());
+      vvtts->levelsIdx = (vvtts->levelsIdx + 1) % vvtts->levelsCnt;
+    }
     // 母音データ取得
-    unsigned long pastms = millis() - stams;
-    for (int i=vidx; i<MAX_VOWEL_HISTORY; i++) {
-      if (vvtts->vowelHistories[i].timeline < pastms) {
-        vvtts->_nowPlayingVowel = vvtts->vowelHistories[i].vowel;
-        if (i < MAX_VOWEL_HISTORY-1 && vvtts->vowelHistories[i].vowel != VVVowel::null) {
-          vvtts->_nowPlayingLength = vvtts->vowelHistories[i+1].timeline - vvtts->vowelHistories[i].timeline;
-        } else {
-          vvtts->_nowPlayingLength = 100;
-        }
-        vidx = i;
-        if (vvtts->vowelHistories[i].vowel == VVVowel::null) break;
-      } else {
-        break;
-      }
+    // 文単位パイプラインは読み出した音声の位置を経過時間にする（次の文を待って止まっても母音がずれない）
+    vvtts->_advanceVowel((vvtts->segsrc != NULL) ? vvtts->segsrc->getPlayedMs() : millis() - stams);
+
+    // 計測
+    uint32_t us = micros() - tm;
+    st.loops ++;
+    st.busyUs += us;
+    if (us > st.maxBusyUs) st.maxBusyUs = us;
+    if (!progressed) {
+      st.idleYields ++;
+      vTaskDelay(1);
     }
   }
+  st.elapsedMs = millis() - stams;
   vvtts->stopAudio();   // 再生停止
+  if (vvtts->debug) vvtts->printAudioStat("VOICEVOX audio");
   vvtts->nowAutoPlaying = false;
   vTaskDelete(NULL);
 }
 
+// 再生位置pastms(ms)までの母音に進める（再生タスクから呼ばれる）
+// カーソルは戻らないので、再生中にそれぞれの母音を1回だけ見る（合成タスクが後の文の母音を追加しても前からやり直さない）
+void VoicevoxTTS::_advanceVowel(unsigned long pastms) {
+  uint16_t vnum = vowelCount;   // 合成タスクが後の文の分を追加していく
+  uint16_t i = _vowelCursor;
+  if (i >= vnum || vowelHistories[i].timeline >= pastms) return;
+  while (i + 1 < vnum && vowelHistories[i + 1].timeline < pastms) i ++;   // 過ぎてしまった母音は飛ばす
+  _nowPlayingVowel = vowelHistories[i].vowel;
+  if (i < vnum-1 && vowelHistories[i].vowel != VVVowel::null) {
+    _nowPlayingLength = vowelHistories[i+1].timeline - vowelHistories[i].timeline;
+  } else {
+    _nowPlayingLength = 100;
+  }
+  _vowelCursor = i + 1;
+}
+
+// 再生タスクの計測結果をシリアルに出力する
+void VoicevoxTTS::printAudioStat(String title) {
+  AudioLoopStat& st = audioStat;
+  uint32_t hz = (st.elapsedMs > 0) ? (uint64_t)st.loops * 1000 / st.elapsedMs : 0;
+  uint32_t avg = (st.loops > 0) ? st.busyUs / st.loops : 0;
+  uint32_t cpu = (st.elapsedMs > 0) ? st.busyUs / 10 / st.elapsedMs : 0;
+  spf("## %s : loops=%u (%uHz) buffers=%u busy avg=%uus max=%uus (%u%%) wait=%ums yields=%u time=%ums\n", title.c_str(),
+      st.loops, hz, st.buffers, avg, st.maxBusyUs, cpu, (uint32_t)(st.waitUs / 1000), st.idleYields, st.elapsedMs);
+}
+
 // 自動音声再生を開始する
 void VoicevoxTTS::startAutoPlay() {
   DriveContextTTS *ctx = new DriveContextTTS(this);
@@ -611,6 +1106,7 @@ void VoicevoxTTS::startAutoPlay() {
 
 // 自動音声再生を終了する
 void VoicevoxTTS::stopAutoPlay() {
+  if (synthRunning) synthCancel = true;   // 文単位パイプラインの合成も中断する
   if (nowAutoPlaying) {
     // タスクを削除する（実際はタスク内で処理）
     nowAutoPlaying = false;
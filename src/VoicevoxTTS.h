@@ -17,12 +17,16 @@
 //#include <AudioFileSource.h>
 #include <AudioFileSourceBuffer.h>
 #include "AudioFileSourceHTTPStream2.h" // AudioFileSourceHTTPStreamのhttps両対応版
+#include "AudioFileSourceJitterBuffer.h"  // ダウンロードしながら再生する音声のバッファー
 #include <AudioFileSourcePROGMEM.h>
 #include <AudioGeneratorMP3.h>
 #include <AudioGeneratorWAV.h>
 #include <ArduinoJson.h>
+#include "VoicevoxCache.h"   // 合成した音声のキャッシュ
+#include "VoicevoxConnection.h"  // REST-APIの接続（keep-aliveで使い回す）
 
 #define MAX_VOWEL_HISTORY 201   // VOICEVOX REST APIから取得したリップシンク用データの保持数
+#define MAX_TTS_SEGMENTS 16     // 文単位で分割して合成する文の最大数（超えた分は最後の文にまとめる）
 
 // デバッグに便利なマクロ定義 --------
 #define sp(x) Serial.println(x)
@@ -40,11 +44,33 @@ enum VoicevoxApiType {  // 使用するAPIの選択
   RestApi         // VOICEVOX REST-API  http://localhost:50021/docs
 };
 enum AudioFormat : uint8_t  { mp3, wav }; // オーディオフォーマット
-enum VVVowel : uint8_t { null, a, i, u, e, o, n };  // リップシンク用の母音
-
-struct VowelData {  // VOICEVOX REST APIの時系列母音データ格納用
-  VVVowel vowel;
-  uint16_t timeline;
+struct TtsSegment {  // 文単位の音声データ（合成タスクが書き込み、再生タスクが読み出す）
+  String text;                // 文
+  uint8_t *data;              // PCMデータ（WAVのヘッダーは除く）
+  uint32_t size;              // PCMデータのバイト数
+  volatile uint32_t filled;   // 受信済みのバイト数
+  volatile bool done;         // 受信完了（失敗した場合もtrueで、size=0）
+  int16_t cacheSlot;          // dataがキャッシュのものならスロット番号（-1はdataを自分で解放する）
+};
+struct SpeakStat {  // 文単位パイプラインの計測結果（speak()ごとにリセット）
+  uint8_t segments = 0;       // 分割した文の数
+  uint8_t failed = 0;         // 合成に失敗した文の数
+  uint32_t firstAudioMs = 0;  // speak()から最初の音声データを再生に渡すまでの時間(ms)
+  uint32_t queryMs = 0;       // audio_queryにかかった時間の合計(ms)
+  uint32_t synthMs = 0;       // synthesisにかかった時間の合計(ms)
+  uint32_t audioMs = 0;       // 合成した音声の長さの合計(ms)
+  uint16_t stalls = 0;        // 次の文の受信が間に合わず再生が止まった回数
+  uint32_t stallMs = 0;       // 〃 止まっていた時間の合計(ms)
+  uint8_t cacheHits = 0;      // キャッシュから再生した文の数
+};
+struct AudioLoopStat {  // 再生タスクの計測結果（再生ごとにリセット）
+  uint32_t loops = 0;         // ループの回数
+  uint32_t buffers = 0;       // 出力に渡したバッファーの数
+  uint64_t busyUs = 0;        // デコード・音声レベル・母音の処理にかかった時間の合計(us)（音声データの受信待ちを含む）
+  uint32_t maxBusyUs = 0;     // 〃 1回の最大(us)
+  uint64_t waitUs = 0;        // 出力のバッファーが空くのを待った時間の合計(us)
+  uint32_t idleYields = 0;    // 出力が進まなかったので1tick休んだ回数
+  uint32_t elapsedMs = 0;     // 再生タスクの実行時間(ms)
 };
 struct HtmlStatus {
   String html;
@@ -52,6 +78,8 @@ struct HtmlStatus {
   int code;
 };
 
+class AudioFileSourceSegments;
+
 class VoicevoxTTS {
 public:
   // 可能ならPSRAM上にJSON解析用のメモリを割り当てる
@@ -72,23 +100,26 @@ public:
 
   enum HttpMethod { GET, POST, HEAD };
 
-  int preallocateBufferSize = 30*1024;  // AudioFileSourceBuffer()で使うメモリサイズ
+  int preallocateBufferSize = 30*1024;  // AudioFileSourceBuffer()・AudioFileSourceJitterBuffer()で使うメモリサイズ（ためる量の上限）
   int preallocateJsonSize = 30*1024;    // JSON解析で使うメモリサイズ
   int preallocatePostSize = 100*1024;   // REST-APIでPOSTするJSONのメモリサイズ（参考:280文字で20KBほど使う）
-  uint8_t *preallocateBuffer; // AudioFileSourceBuffer()で使うメモリのポインタ
+  uint8_t *preallocateBuffer; // 〃 メモリのポインタ
   byte *jsonBuffer;   // AJSON解析で使うメモリのポインタ
   char *postBuffer;   // POSTするJSONデータのメモリのポインタ
 
   AudioOutputM5Speaker *_out;
-  AudioGeneratorMP3 *mp3;
-  AudioGeneratorWAV *wav;
+  AudioGeneratorMP3 *mp3 = nullptr;
+  AudioGeneratorWAV *wav = nullptr;
   AudioFileSourceBuffer *buff = nullptr;
+  AudioFileSourceJitterBuffer *jbuff = nullptr;  // URLの音声の再生用
   AudioFileSourceHTTPStream2 *file = nullptr;
   AudioFileSource *filepg = nullptr;
+  AudioFileSourceSegments *segsrc = nullptr;  // 文単位パイプラインの再生用
   AudioFormat format;
 
   WiFiClient client;
   WiFiClientSecure sclient;
+  VoicevoxConnection conn;  // REST-APIの接続（audio_queryとsynthesisで使い回す）
   //HTTPClient http;
 
   bool debug = true;        // シリアルコンソールにデバッグ情報を出力する
@@ -100,6 +131,10 @@ public:
   VoicevoxApiType apiType;  // 使用するAPIの種類
   String _apikeyWeb = "";   // WEB版VOICEVOX APIで使用するAPI KEY
   uint8_t characterID = 1;    // キャラクターID（話者id）
+  float speedScale = 1.0;       // 話速（REST-APIのみ）
+  float pitchScale = 0.0;       // 音高（〃）
+  float intonationScale = 1.0;  // 抑揚（〃）
+  float volumeScale = 1.0;      // 音量（〃）
 
   // APIのエンドポイント・デフォルト値
   String endpointWebApiSlow  = "https://api.tts.quest/v3/voicevox/synthesis";
@@ -114,8 +149,31 @@ public:
   int levels[levelsCnt];    // 音声レベル配列
   int levelsIdx = 0;        // 上記インデックス
   VowelData vowelHistories[MAX_VOWEL_HISTORY];  // VOICEVOX REST APIから取得したリップシンク用データ
+  volatile uint16_t vowelCount = 0;  // vowelHistoriesの有効なデータ数（再生タスクはここまで読む）
   VVVowel _nowPlayingVowel = VVVowel::null;   // 現在発話中の母音
   uint16_t _nowPlayingLength = 0;   // 現在発話中の母音の長さ(ms)
+  uint16_t _vowelCursor = 0;        // 次に発話する母音のvowelHistoriesの位置（再生中は戻らない）
+  AudioLoopStat audioStat;          // 再生タスクの計測結果
+
+  // 文単位パイプライン（REST-APIのみ。文ごとに合成し、最初の文が届いたら残りを合成しながら再生する）
+  bool sentencePipeline = true;     // 文単位パイプラインを使う（PSRAMが必要、falseなら全文を合成してから再生）
+  TtsSegment segments[MAX_TTS_SEGMENTS];  // 文ごとの音声データ
+  volatile uint8_t segmentNum = 0;  // 文の数
+  volatile bool synthRunning = false; // 合成タスク実行中はtrueになる
+  volatile bool synthCancel = false;  // 合成と再生を中断する
+  volatile bool synthLoopDone = false;  // 合成タスクが全部の文を処理し終わった（この後はsegmentsを触らない）
+  volatile bool playEnded = false;      // 再生が終わった（合成タスクはこの後でキャッシュをLittleFSに保存する）
+  uint8_t wavHeader[44];            // 再生用のWAVヘッダー（最初の文の形式で作る）
+  uint32_t wavByteRate = 0;         // 1秒あたりのバイト数（0は形式が未定）
+  unsigned long speakStartMs = 0;   // speak()を呼んだ時刻
+  SpeakStat speakStat;              // 文単位パイプラインの計測結果
+  bool useCache = true;             // 合成した音声をキャッシュする（文単位パイプラインのみ）
+  VoicevoxCache cache;              // 合成した音声のキャッシュ
+  JitterStat streamStat;            // URLの音声の最後の再生の計測結果（バッファーの量・止まった回数）
+  uint32_t netThroughput = 0;       // 測ったネットワークの速度の移動平均(byte/s)（次の再生でためる量の見積もりに使う）
+  uint32_t jitterMarginMs = 200;    // 計算した量に加えてためる音声の長さ(ms)（止まったら増やし、止まらなければ減らす）
+  uint32_t jitterMarginMinMs = 200; // 〃 最小値
+  uint32_t jitterMarginMaxMs = 2000; // 〃 最大値
 
   VoicevoxTTS();
   //~VoicevoxTTS() = default;
@@ -129,6 +187,7 @@ public:
   void unsetRootCA();       // ルート証明書を無効にする
   void usePSRAM(bool psram);        // PSRAMを使う
   void setEndpoint(VoicevoxApiType apiType, String url); // APIのエンドポイントを設定する
+  void setCacheFS(fs::FS &fs);      // 音声キャッシュの保存先のファイルシステムを設定する（設定しなければPSRAMだけ使う）
   //HtmlStatus httpRequest(String url, String method="GET");  // httpでGETアクセスを行う
   HtmlStatus httpGetJson(String url, HttpMethod method, bool decodeJson=false, String postData="");  // Webサーバーにアクセスして、JSONをデコードする
   void speak(String text, bool waiting=true);              // テキストを喋る
@@ -136,11 +195,15 @@ public:
   void speakWebApiFast(String text);    // テキストを喋る WEB版VOICEVOX API（高速）
   void speakWebApiStream(String text);  // テキストを喋る WEB版VOICEVOX API（Stream）
   void speakRestApi(String text);       // テキストを喋る VOICEVOX REST-API
+  static uint8_t splitSentences(const String& text, String* out, uint8_t maxNum);  // テキストを文に分割する（。！？と改行の後で区切る）
+  void printSpeakStat(String title);    // 文単位パイプラインの計測結果をシリアルに出力する
+  void printStreamStat(String title);   // URLの音声の再生の計測結果をシリアルに出力する
+  void printAudioStat(String title);    // 再生タスクの計測結果をシリアルに出力する
   void playUrl(String url, AudioFormat format, bool post=false, char* data=nullptr); // 指定URLから音声ファイルをダウンロードして再生する
   void playUrlMP3(String url, bool post=false, char* data=nullptr) { playUrl(url, AudioFormat::mp3, post, data); }  // 〃 MP3
   void playUrlWAV(String url, bool post=false, char* data=nullptr) { playUrl(url, AudioFormat::wav, post, data); }  // 〃 WAV
   void playProgmem(const unsigned char* data, size_t size, AudioFormat audioformat);  // PROGMEMの音声ファイル再生する
-  void playAudio(AudioFileSourceBuffer *buff);  // 再生開始
+  void playAudio(AudioFileSource *src);  // 再生開始
   void stopAudio();           // 再生停止（再生の停止とメモリ開放）
   void startAutoPlay();     // 自動音声再生を開始する
   void stopAutoPlay();      // 自動音声再生を終了する
@@ -155,14 +218,47 @@ public:
   static void StatusCallback(void *cbData, int code, const char *string);
   static String URLEncode(const char* msg);
   void debugUrlPrint(String title, String url, int16_t code, String memo="", String html="");  // シリアルコンソールにデバッグ情報を出力する
+  bool isRestApiUrl(const String& url);  // REST-APIのURLか？（connの接続を使う）
 
   // デバッグ。後で消す
   void debug_free_memory(String str);
 
+  // 文単位パイプラインの処理（合成タスクから呼ばれる）
+  bool _synthLoop();          // 文を順番に合成して受信する（再生を開始したらtrueを返す）
+  bool _synthSegment(uint8_t no, uint16_t vowelEnd, bool& started);  // 1つの文を合成して受信する。最初の文なら再生を開始する
+  bool _playCached(uint8_t no, int16_t slot, uint32_t offset, bool& started);  // キャッシュの音声を文の音声データにする。最初の文なら再生を開始する
+  String _cacheParams();      // キャッシュのキーにする合成パラメーター
+  void _applyParams();        // audio_queryの結果に合成パラメーターを設定する
+  bool _readWavHeader(Stream* stream, uint32_t& remain, uint32_t& dataSize);  // WAVのヘッダーを読んで形式を確かめる
+  bool _setWavFormat(const uint8_t* fmt);  // 再生用のWAVヘッダーを作る（最初の文）、以降の文は同じ形式か確かめる
+  void _releaseSegments();    // 文ごとの音声データを解放する
+  uint16_t _parseVowels(uint16_t index, uint32_t offset);  // audio_queryの結果からリップシンク用データを作る（indexから書き込み、次の位置を返す）
+  void _advanceVowel(unsigned long pastms);  // 再生位置pastms(ms)までの母音に進める（再生タスクから呼ばれる）
+
 // private:
 //   TaskHandle_t handleAudioOutputLoop;
 }; //class
 
+// 文ごとの音声を1つのWAVとして途切れなく読み出すAudioFileSource
+// ヘッダーはVoicevoxTTS::wavHeader、以降は各文のPCMデータを順番に返す。次の文が届いていなければ届くまで待つ
+class AudioFileSourceSegments : public AudioFileSource {
+ private:
+  VoicevoxTTS *vvtts;
+  uint32_t _pos = 0;      // 全体の読み出し位置
+  uint8_t _seg = 0;       // 読み出し中の文
+  uint32_t _segPos = 0;   // 〃 の読み出し位置
+ public:
+  explicit AudioFileSourceSegments(VoicevoxTTS *vvtts) : vvtts{vvtts} {}
+  virtual ~AudioFileSourceSegments() override {}
+  virtual uint32_t read(void *data, uint32_t len) override;
+  virtual bool seek(int32_t pos, int dir) override { return false; }
+  virtual bool close() override { return true; }
+  virtual bool isOpen() override { return true; }
+  virtual uint32_t getSize() override { return 0; }
+  virtual uint32_t getPos() override { return _pos; }
+  uint32_t getPlayedMs();   // 読み出した音声の長さ(ms)
+};
+
 // from M5Stack-Avatar (https://github.com/meganetaaan/m5stack-avatar)
 class DriveContextTTS {
  private:
@@ -27,10 +27,11 @@ void WebInterface::setMainValues(int charmax, int charno, char** charnames, char
 }
 
 // Webサーバーの初期設定を行う
-void WebInterface::webSetup(voicevox_tts::VoicevoxTTS* p1, chat_gpt::ChatGPT* p2) {
+void WebInterface::webSetup(voicevox_tts::VoicevoxTTS* p1, chat_gpt::ChatGPT* p2, zundavatar::Zundavatar* p3) {
   // クラスのポインターを受け取る
   if (p1 != nullptr) ttsPtr = p1;
   if (p2 != nullptr) gptPtr = p2;
+  if (p3 != nullptr) avatarPtr = p3;
 
   // Webサーバーの設定
   server.on("/", [this]() { handleRoot(); });
@@ -40,6 +41,9 @@ void WebInterface::webSetup(voicevox_tts::VoicevoxTTS* p1, chat_gpt::ChatGPT* p2
   server.on("/api/volume", [this]() { apiVolume(); });
   server.on("/api/exmessage", [this]() { apiExmessage(); });
   server.on("/api/singlemode", [this]() { apiSingleMode(); });
+  server.on("/api/profile", [this]() { apiProfile(); });
+  server.on("/api/tts", [this]() { apiTts(); });
+  server.on("/api/character", [this]() { apiCharacter(); });
   server.on("/inline", [this](){
     server.send(200, "text/plain", "this works as well");
   });
@@ -249,6 +253,137 @@ void WebInterface::apiSingleMode() {
   }
 }
 
+// API: アバターの描画時間の計測結果 PATH=/api/profile（?reset=1で計測結果をクリアする）
+// 区間ごとに frames,min,avg,p95,p99,max(us) とヒストグラム（0us,1us,2-3us,4-7us...のビンごとのフレーム数）を返す
+void WebInterface::apiProfile() {
+  using namespace zundavatar;
+  DynamicJsonDocument json(12288);
+  String responseData;
+  if (avatarPtr == nullptr) {
+    server.send(404, "text/html", "{\"message\":\"avatar not found\"}");
+    return;
+  }
+  json["success"] = 1;
+  json["enabled"] = RenderProfiler::enabled;
+  json["frames"] = avatarPtr->profiler.frames();
+  JsonObject stages = json.createNestedObject("stages");
+  JsonObject layers = json.createNestedObject("layers");
+  ProfileSummary sum;
+  for (uint8_t s=0; s<profileStageNum; s++) {
+    if (!avatarPtr->profileSummary(s, &sum)) continue;   // 描画タスクが書き込んでいる途中の値は読まない
+    JsonObject o;
+    if (s < ProfLayer0) {
+      o = stages.createNestedObject(profileStageName(s));
+    } else {
+      o = layers.createNestedObject(avatarPtr->_tableNames[s - ProfLayer0]);
+    }
+    o["frames"] = sum.frames;
+    o["min"] = sum.minUs;
+    o["avg"] = sum.avgUs;
+    o["p95"] = sum.p95Us;
+    o["p99"] = sum.p99Us;
+    o["max"] = sum.maxUs;
+    JsonArray hist = o.createNestedArray("hist");
+    for (int i=0; i<profileHistBins; i++) hist.add(sum.hist[i]);
+  }
+  serializeJson(json, responseData);
+  if (server.arg("reset") == "1") avatarPtr->resetProfile();
+  server.send(200, "application/json", responseData);
+}
+
+// API: 音声合成の計測結果 PATH=/api/tts（?reset=1でキャッシュと接続の計測結果をクリアする）
+// 最後に喋った文の計測結果と、音声キャッシュのヒット数・追い出し数・使用量、REST-APIの接続数・使い回した数、
+// URLの音声の最後の再生でためた量・バッファーが空になって止まった回数、再生タスクのループ回数・CPU時間を返す
+void WebInterface::apiTts() {
+  using namespace voicevox_tts;
+  DynamicJsonDocument json(2048);
+  String responseData;
+  if (ttsPtr == nullptr) {
+    server.send(404, "text/html", "{\"message\":\"tts not found\"}");
+    return;
+  }
+  SpeakStat& st = ttsPtr->speakStat;
+  json["success"] = 1;
+  JsonObject speak = json.createNestedObject("speak");
+  speak["segments"] = st.segments;
+  speak["failed"] = st.failed;
+  speak["cached"] = st.cacheHits;
+  speak["firstAudioMs"] = st.firstAudioMs;
+  speak["queryMs"] = st.queryMs;
+  speak["synthMs"] = st.synthMs;
+  speak["audioMs"] = st.audioMs;
+  speak["stalls"] = st.stalls;
+  speak["stallMs"] = st.stallMs;
+  VoicevoxCache& cache = ttsPtr->cache;
+  JsonObject c = json.createNestedObject("cache");
+  c["enabled"] = ttsPtr->useCache;
+  c["ramHits"] = cache.stat.ramHits;
+  c["fsHits"] = cache.stat.fsHits;
+  c["misses"] = cache.stat.misses;
+  c["ramEvictions"] = cache.stat.ramEvictions;
+  c["fsEvictions"] = cache.stat.fsEvictions;
+  c["fsWrites"] = cache.stat.fsWrites;
+  c["fsErrors"] = cache.stat.fsErrors;
+  c["ramEntries"] = cache.ramEntries();
+  c["ramBytes"] = cache.ramBytes();
+  c["fsEntries"] = cache.fsEntries();
+  c["fsBytes"] = cache.fsBytes();
+  ConnStat& cs = ttsPtr->conn.stat;
+  JsonObject conn = json.createNestedObject("conn");
+  conn["keepAlive"] = ttsPtr->conn.keepAlive;
+  conn["requests"] = cs.requests;
+  conn["opened"] = cs.opened;
+  conn["reused"] = cs.reused;
+  conn["retries"] = cs.retries;
+  conn["expired"] = cs.expired;
+  conn["failed"] = cs.failed;
+  JitterStat& js = ttsPtr->streamStat;
+  JsonObject stream = json.createNestedObject("stream");
+  stream["bitrate"] = js.bitrate;
+  stream["throughput"] = js.throughput;
+  stream["netThroughput"] = ttsPtr->netThroughput;
+  stream["marginMs"] = js.marginMs;
+  stream["nextMarginMs"] = ttsPtr->jitterMarginMs;
+  stream["prefillBytes"] = js.prefillBytes;
+  stream["prefillMs"] = js.prefillMs;
+  stream["underruns"] = js.underruns;
+  stream["underrunMs"] = js.underrunMs;
+  stream["minFill"] = js.minFill;
+  stream["avgFill"] = js.avgFill;
+  stream["bytes"] = js.bytes;
+  JsonArray hist = stream.createNestedArray("fillHist");
+  for (int i=0; i<jitterHistBins; i++) hist.add(js.fillHist[i]);
+  AudioLoopStat& as = ttsPtr->audioStat;
+  JsonObject audio = json.createNestedObject("audio");
+  audio["loops"] = as.loops;
+  audio["loopHz"] = (as.elapsedMs > 0) ? (uint32_t)((uint64_t)as.loops * 1000 / as.elapsedMs) : 0;
+  audio["buffers"] = as.buffers;
+  audio["busyAvgUs"] = (as.loops > 0) ? (uint32_t)(as.busyUs / as.loops) : 0;
+  audio["busyMaxUs"] = as.maxBusyUs;
+  audio["cpuPercent"] = (as.elapsedMs > 0) ? (uint32_t)(as.busyUs / 10 / as.elapsedMs) : 0;
+  audio["waitMs"] = (uint32_t)(as.waitUs / 1000);
+  audio["idleYields"] = as.idleYields;
+  audio["elapsedMs"] = as.elapsedMs;
+  serializeJson(json, responseData);
+  if (server.arg("reset") == "1") {
+    cache.stat = TtsCacheStat();
+    ttsPtr->conn.stat = ConnStat();
+  }
+  server.send(200, "application/json", responseData);
+}
+
+// API: キャラクターの切り替え PATH=/api/character?no=N（/character<N>.zcb を読み込んで切り替える）
+void WebInterface::apiCharacter() {
+  int no = server.hasArg("no") ? server.arg("no").toInt() : -1;
+  sp("## character change! "+String(no));
+  if (no >= 0 && no < characterMaxNum) {
+    notice.changeCharacter = no;
+    server.send(200, "text/html", "{\"message\":\"character change accepted\"}");
+  } else {
+    server.send(400, "text/html", "{\"message\":\"character error\"}");
+  }
+}
+
 // デバッグ用
 String WebInterface::tf(bool b) {
   return (b) ? "true" : "false";
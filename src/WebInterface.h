@@ -16,6 +16,7 @@
 //#include "CharacterConfig.h"
 #include "VoicevoxTTS.h"
 #include "ChatGPT.h"
+#include "Zundavatar.h"
 
 // デバッグに便利なマクロ定義 --------
 #define sp(x) Serial.println(x)
@@ -31,6 +32,7 @@ struct Notice {   // 外部からのリクエストを保存しておく変数
   bool newExmessage = false;    // Webから送信されたメッセージの有無
   String newExmessageText = ""; // Webから送信されたメッセージのtext
   int singleModeChange = -1;    // シングルモードの変更
+  int changeCharacter = -1;     // 切り替えるキャラクター番号（キャラクターバンドルを読み込む）
 };
 
 struct FriendStatus {
@@ -46,6 +48,7 @@ public:
   TaskHandle_t xLoopHandle = nullptr;
   voicevox_tts::VoicevoxTTS* ttsPtr = nullptr;
   chat_gpt::ChatGPT* gptPtr = nullptr;
+  zundavatar::Zundavatar* avatarPtr = nullptr;
   Notice notice;
 
   // メインと同じ変数名で使用する変数
@@ -59,7 +62,7 @@ public:
 
   // メンバ関数
   void setMainValues(int charmax, int charno, char** charnames, char** hostnames);  // キャラクター情報を本クラスに与える
-  void webSetup(voicevox_tts::VoicevoxTTS* p1=nullptr, chat_gpt::ChatGPT* p2=nullptr);    // Webサーバーの初期設定を行う、各クラスのポインタを渡す
+  void webSetup(voicevox_tts::VoicevoxTTS* p1=nullptr, chat_gpt::ChatGPT* p2=nullptr, zundavatar::Zundavatar* p3=nullptr);    // Webサーバーの初期設定を行う、各クラスのポインタを渡す
   //static void webLoop0(void* _this);     // Webサーバーのループ処理
   void webLoop();     // Webサーバーのループ処理
   String tf(bool b);
@@ -74,6 +77,9 @@ public:
   void apiVolume();       // API ボリューム
   void apiExmessage();    // API 外部からの会話用メッセージ
   void apiSingleMode();   // API シングルモード
+  void apiProfile();      // API アバターの描画時間の計測結果
+  void apiTts();          // API 音声合成の計測結果
+  void apiCharacter();    // API キャラクターの切り替え
 
 }; //class
 
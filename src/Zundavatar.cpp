@@ -9,6 +9,15 @@
 #include "Zundavatar.h"
 namespace zundavatar {
 
+// 描画時間の計測（ZUNDAVATAR_PROFILE=0のときは何も残らない）
+#if ZUNDAVATAR_PROFILE
+#define PROF_BEGIN(t) uint32_t t = micros()
+#define PROF_END(stage, t) profiler.add(stage, micros() - (t))
+#else
+#define PROF_BEGIN(t)
+#define PROF_END(stage, t)
+#endif
+
 DriveContext::DriveContext(Zundavatar *avatar) : avatar{avatar} {}
 Zundavatar *DriveContext::getZundavatar() { return avatar; }
 
@@ -22,8 +31,10 @@ Zundavatar::Zundavatar() {
   for (int i=0; i<tableNum; i++) {
     _tableNames[i] = "";
     _imgTables[i] = nullptr;
+    _imgOffsets[i] = nullptr;
     items[i] = -1;
   }
+  _drawMutex = xSemaphoreCreateMutex();
 }
 
 // 2つの画像の座標を元にオフセット位置を求める
@@ -37,8 +48,7 @@ XYaddress Zundavatar::img_get_offset(ImageInfo base, ImageInfo target) {
 // 部位名からテーブル番号を求める
 uint16_t Zundavatar::name2table(String name) {
   uint16_t tbl = -1;
-  for (int i=0; i<tableNum; i++) {
-    if (_tableNames[i] == "") break;
+  for (int i=0; i<_tableCount; i++) {
     if (name == _tableNames[i]) {
     tbl = i;
     break;
@@ -49,12 +59,13 @@ uint16_t Zundavatar::name2table(String name) {
 
 // 部位名・インデックス番号から画像番号を求める（インデックス番号省略時はitems[]を参照）
 uint16_t Zundavatar::nameidx2no(String name, int16_t idxOrDefault) {
-  uint16_t tbl, idx, no = -1;
+  int16_t tbl, idx;
+  uint16_t no = -1;
   if (name != "") {
     tbl = name2table(name);
     if (tbl != -1) {
       idx = (idxOrDefault >= 0) ? idxOrDefault : items[tbl];
-      no = _imgTables[tbl][idx];
+      if (idx != -1) no = _imgTables[tbl][idx];
 //spf("%s %d %d (%d) %d\n", name,tbl,idx,idxOrDefault, no);
     }
   }
@@ -68,20 +79,199 @@ void Zundavatar::setImageData(const ImageInfo* imgInfo, String* tableNames, uint
   for (int i=0; i<len; i++) {
     if (i >= tableNum) break;
     _tableNames[i] = tableNames[i];
-    spf("setTableData: %s\n", _tableNames[i]);
+    spf("setTableData: %s\n", _tableNames[i].c_str());
+    _imgTables[i] = imgTables[i];
+    _imgOffsets[i] = nullptr;
+  }
+  _initTables((len < tableNum) ? len : tableNum);
+}
+
+// 画像データとテーブル情報を登録する（画像変換ツールが出力した部位ID順の一覧と相対位置の表を使う）
+void Zundavatar::setImageData(const ImageInfo* imgInfo, const char* const* tableNames, uint16_t* const* imgTables, size_t len, const XYaddress* const* offsets) {
+  _imgInfo = imgInfo;
+  transparentDefault = _imgInfo[0].transparent; // 画像番号0の透明色をデフォルトの透明色とする
+  for (size_t i=0; i<len; i++) {
+    if (i >= tableNum) break;
+    _tableNames[i] = tableNames[i];
+    spf("setTableData: %s\n", _tableNames[i].c_str());
     _imgTables[i] = imgTables[i];
+    _imgOffsets[i] = (offsets != nullptr) ? offsets[i] : nullptr;
   }
+  _initTables((len < tableNum) ? len : tableNum);
 }
 
-// 指定部位に表示する画像を登録する
+// 登録された部位の数と体のテーブル番号を求めておく
+void Zundavatar::_initTables(uint16_t len) {
+  clearDecodeCache();  // 画像番号が変わるので展開済みの画像は使えない
+  clearBoyonCache();   // キャラクターを切り替えた場合は、変形・下地キャッシュも前の画像のものなので捨てる
+  for (int i=0; i<underlayMax; i++) underlays[i].valid = false;
+  for (int i=0; i<tableNum; i++) items[i] = -1;  // 表示中の画像も前の画像の番号なので、部位を登録し直すこと
+  clearMouthTiles();
+  _mouthPending = false;
+  _mouthShownIdx = -1;
+  _tableCount = len;
+  _bodyTbl = name2table(defaultBaseBodyName);
+  for (int i=len; i<tableNum; i++) {
+    _tableNames[i] = "";
+    _imgTables[i] = nullptr;
+    _imgOffsets[i] = nullptr;
+  }
+}
+
+// 指定部位に表示する画像を登録する（変化した範囲は再描画範囲に登録される、描画タスク実行中はキュー経由）
 void Zundavatar::changeParts(String name, int16_t idx) {
-  uint16_t tbl = name2table(name);
+  int16_t tbl = name2table(name);
   if (tbl == -1) return;
+  changeParts(PartId(tbl), idx);
+}
+
+// 指定部位に表示する画像を登録する（部位ID版、文字列の比較もメモリ確保もしない）
+void Zundavatar::changeParts(PartId part, int16_t idx) {
+  if (part.tbl >= _tableCount) return;
+  if (_renderTask != nullptr && !_onRenderTask()) {
+    _postRender({ RenderCmdType::Parts, part.tbl, idx, 0 }, portMAX_DELAY);  // 部位の変更は捨てられないので空くまで待つ
+  } else {
+    _changePartsNow(part.tbl, idx);
+  }
+}
+
+// 部位の画像を変更する（描画タスクまたは描画タスク無しの場合）
+void Zundavatar::_changePartsNow(int16_t tbl, int16_t idx) {
+  if (tbl == autoLipsyncTbl) _flushMouth();  // 口タイルで描画するはずだった口の変更は、再描画範囲に登録し直す
+  int16_t oldidx = items[tbl];
+  if (oldidx == idx) return;
   items[tbl] = idx;
-  // 自動まばたき実行中はまばたき設定も同時に変える
-  //if (autoBlink && name == autoBlinkName) {
-  //  autoBlinkIdx_open = idx;
-  //}
+
+  // 変化した範囲を再描画範囲に登録する（体が変わった場合は全体）
+  if (_bodyNo() == -1 || tbl == _bodyTbl) {
+    markDirtyAll();
+  } else {
+    if (oldidx != -1) markDirty(_partRect(tbl, oldidx));
+    if (idx != -1) markDirty(_partRect(tbl, idx));
+  }
+}
+
+// 表示中の体の画像番号を求める
+int16_t Zundavatar::_bodyNo() {
+  if (_bodyTbl == -1 || items[_bodyTbl] == -1) return -1;
+  return _imgTables[_bodyTbl][items[_bodyTbl]];
+}
+
+// 部位の画像の体からの相対位置を求める（相対位置の表があればそれを使う）
+XYaddress Zundavatar::_partOffset(int16_t tbl, int16_t idx) {
+  int16_t bodyIdx = items[_bodyTbl];
+  if (_imgOffsets[tbl] != nullptr && _imgOffsets[_bodyTbl] != nullptr) {
+    XYaddress o = _imgOffsets[tbl][idx];
+    XYaddress b = _imgOffsets[_bodyTbl][bodyIdx];
+    return { (int16_t)(o.x - b.x), (int16_t)(o.y - b.y) };
+  }
+  return img_get_offset(_imgInfo[_imgTables[_bodyTbl][bodyIdx]], _imgInfo[_imgTables[tbl][idx]]);
+}
+
+// 各部位の画像番号と配置先（キャンバス上の座標）を求めておく
+void Zundavatar::_buildDrawList(XYaddress org) {
+  for (int16_t tbl=0; tbl<_tableCount; tbl++) {
+    int16_t idx = items[tbl];
+    if (idx == -1) {
+      _drawList[tbl].no = -1;
+      continue;
+    }
+    XYWHaddress r = _partRect(tbl, idx);
+    _drawList[tbl].no = _imgTables[tbl][idx];
+    _drawList[tbl].rect = { (int16_t)(r.x + org.x), (int16_t)(r.y + org.y), r.w, r.h };
+  }
+}
+
+// 画像の範囲を求める（体の左上基準の座標）
+XYWHaddress Zundavatar::_partRect(int16_t tbl, int16_t idx) {
+  XYaddress ofs = _partOffset(tbl, idx);
+  int16_t no = _imgTables[tbl][idx];
+  return { ofs.x, ofs.y, (int16_t)_imgInfo[no].width, (int16_t)_imgInfo[no].height };
+}
+
+// 再描画範囲を登録する（体の左上基準の座標、重なる範囲は統合する）
+void Zundavatar::markDirty(XYWHaddress rect) {
+  if (rect.w <= 0 || rect.h <= 0) return;
+  portENTER_CRITICAL(&_dirtyMux);
+  _addDirtyRect(rect);
+  portEXIT_CRITICAL(&_dirtyMux);
+}
+
+// 全体を再描画範囲にする
+void Zundavatar::markDirtyAll() {
+  portENTER_CRITICAL(&_dirtyMux);
+  _dirtyFull = true;
+  _dirtyNum = 0;
+  portEXIT_CRITICAL(&_dirtyMux);
+}
+
+// 2つの範囲を両方含む範囲を求める
+static XYWHaddress unionRect(XYWHaddress a, XYWHaddress b) {
+  int16_t x1 = (a.x < b.x) ? a.x : b.x;
+  int16_t y1 = (a.y < b.y) ? a.y : b.y;
+  int16_t x2 = (a.x + a.w > b.x + b.w) ? a.x + a.w : b.x + b.w;
+  int16_t y2 = (a.y + a.h > b.y + b.h) ? a.y + a.h : b.y + b.h;
+  return { x1, y1, (int16_t)(x2 - x1), (int16_t)(y2 - y1) };
+}
+
+// 2つの範囲が重なっているか
+static bool overlapRect(XYWHaddress a, XYWHaddress b) {
+  return a.x < b.x + b.w && b.x < a.x + a.w && a.y < b.y + b.h && b.y < a.y + a.h;
+}
+
+// 2つの範囲が重なる部分を求める（重ならない場合は幅・高さが0）
+static XYWHaddress intersectRect(XYWHaddress a, XYWHaddress b) {
+  int16_t x1 = (a.x > b.x) ? a.x : b.x;
+  int16_t y1 = (a.y > b.y) ? a.y : b.y;
+  int16_t x2 = (a.x + a.w < b.x + b.w) ? a.x + a.w : b.x + b.w;
+  int16_t y2 = (a.y + a.h < b.y + b.h) ? a.y + a.h : b.y + b.h;
+  if (x1 >= x2 || y1 >= y2) return { x1, y1, 0, 0 };
+  return { x1, y1, (int16_t)(x2 - x1), (int16_t)(y2 - y1) };
+}
+
+// 再描画範囲を登録する（排他処理は呼び出し元で行う）
+void Zundavatar::_addDirtyRect(XYWHaddress rect) {
+  int i, best = -1;
+  int32_t waste, bestWaste = INT32_MAX;
+  if (_dirtyFull) return;
+
+  // 重なる範囲、または統合しても無駄が少ない範囲があれば統合し、統合後の範囲で調べ直す
+  for (i=0; i<_dirtyNum; i++) {
+    XYWHaddress u = unionRect(rect, _dirtyRects[i]);
+    waste = (int32_t)u.w * u.h - (int32_t)rect.w * rect.h - (int32_t)_dirtyRects[i].w * _dirtyRects[i].h;
+    if (overlapRect(rect, _dirtyRects[i]) || waste <= dirtyMergeSlack) {
+      rect = u;
+      _dirtyRects[i] = _dirtyRects[--_dirtyNum];
+      i = -1;
+    }
+  }
+  if (_dirtyNum < dirtyRectMax) {
+    _dirtyRects[_dirtyNum++] = rect;
+    return;
+  }
+  // 登録数の上限を超えた場合は、統合したときの無駄が一番少ない範囲とまとめる
+  for (i=0; i<_dirtyNum; i++) {
+    XYWHaddress u = unionRect(rect, _dirtyRects[i]);
+    waste = (int32_t)u.w * u.h - (int32_t)_dirtyRects[i].w * _dirtyRects[i].h;
+    if (waste < bestWaste) {
+      bestWaste = waste;
+      best = i;
+    }
+  }
+  _dirtyRects[best] = unionRect(rect, _dirtyRects[best]);
+}
+
+// 再描画範囲を取り出してクリアする
+uint16_t Zundavatar::_takeDirtyRects(XYWHaddress* rects, bool* full) {
+  uint16_t num;
+  portENTER_CRITICAL(&_dirtyMux);
+  num = _dirtyNum;
+  *full = _dirtyFull;
+  for (int i=0; i<num; i++) rects[i] = _dirtyRects[i];
+  _dirtyNum = 0;
+  _dirtyFull = false;
+  portEXIT_CRITICAL(&_dirtyMux);
+  return num;
 }
 
 // PSRAMを使う
@@ -95,101 +285,921 @@ void Zundavatar::debugtable() {
   }
 }
 
-// アバターを合成してキャンバスに出力する
-void Zundavatar::_makeAvater(LovyanGFX* dst, int16_t x, int16_t y, unsigned short bgColor, XYWHaddress* trim) {
+// 合成用のキャンバスを確保する（足りない場合だけ確保し直す）
+bool Zundavatar::allocCanvas(uint16_t w, uint16_t h) {
+  if (canvas_body.getBuffer() != nullptr && w <= canvasWidth && h <= canvasHeight) return true;
+  // 確保し直す場合は、今までで一番大きいサイズに合わせる（何度も確保し直さないように）
+  if (w < canvasWidth) w = canvasWidth;
+  if (h < canvasHeight) h = canvasHeight;
+  freeCanvas();
+  canvas_body.setPsram(usePsram);
+  canvas_body.setColorDepth(16);
+  if (canvas_body.createSprite(w, h) == nullptr) {
+    spf("Zundavatar: canvas alloc failed (%d x %d)\n", w, h);
+    return false;
+  }
+  canvasWidth = w;
+  canvasHeight = h;
+  return true;
+}
+
+// 合成用のキャンバスを解放する
+void Zundavatar::freeCanvas() {
+  _freePresentBuffers();
+  canvas_body.deleteSprite();
+  canvas_body2.deleteSprite();
+  canvasWidth = 0;
+  canvasHeight = 0;
+}
+
+// フレーム時間の計測結果をクリアする
+void Zundavatar::resetFrameStat() {
+  frameStat = FrameStat();
+}
+
+// フレーム時間の計測結果をシリアルに出力する
+void Zundavatar::printFrameStat(String title) {
+  uint32_t avg = (frameStat.frames > 0) ? frameStat.totalUs / frameStat.frames : 0;
+  uint32_t avgpx = (frameStat.frames > 0) ? frameStat.pixels / frameStat.frames : 0;
+  spf("## %s : frames=%u avg=%uus max=%uus pixels/frame=%u\n", title.c_str(), frameStat.frames, avg, frameStat.maxUs, avgpx);
+  if (frameStat.frames > 0) {
+    spf("   render=%uus push=%uus (fence wait=%uus) overlap=%uus\n", frameStat.renderUs / frameStat.frames,
+        frameStat.pushUs / frameStat.frames, frameStat.waitUs / frameStat.frames, frameStat.overlapUs / frameStat.frames);
+  }
+  if (frameStat.cacheHits + frameStat.cacheMisses > 0) {
+    spf("   boyon cache : hits=%u misses=%u used=%u bytes\n", frameStat.cacheHits, frameStat.cacheMisses, _boyonBytes);
+  }
+  if (frameStat.decodeHits + frameStat.decodeMisses > 0) {
+    spf("   decode cache : hits=%u misses=%u used=%u bytes\n", frameStat.decodeHits, frameStat.decodeMisses, _decodeBytes);
+  }
+  if (frameStat.mouthTileHits + frameStat.mouthTileBuilds > 0) {
+    spf("   mouth tiles  : hits=%u builds=%u\n", frameStat.mouthTileHits, frameStat.mouthTileBuilds);
+  }
+}
+
+// 出力先の指定範囲だけにキャンバスを貼り付ける
+void Zundavatar::_pushClipped(M5Canvas* src, LovyanGFX* dst, int16_t x, int16_t y, XYWHaddress clip, unsigned short transparent) {
+  int32_t cx, cy, cw, ch;
+  dst->getClipRect(&cx, &cy, &cw, &ch);
+  // 元々のクリップ範囲と重なる部分だけにする
+  int32_t x1 = (clip.x > cx) ? clip.x : cx;
+  int32_t y1 = (clip.y > cy) ? clip.y : cy;
+  int32_t x2 = (clip.x + clip.w < cx + cw) ? clip.x + clip.w : cx + cw;
+  int32_t y2 = (clip.y + clip.h < cy + ch) ? clip.y + clip.h : cy + ch;
+  if (x1 >= x2 || y1 >= y2) return;
+  dst->setClipRect(x1, y1, x2 - x1, y2 - y1);
+  src->pushSprite(dst, x, y, transparent);
+  dst->setClipRect(cx, cy, cw, ch);
+}
+
+// キャンバス上の範囲を物理座標（バッファ上の位置）に変換する
+XYWHaddress Zundavatar::_physRect(XYWHaddress rect) {
+  if (mirrorImage) rect.x = _layoutW - rect.x - rect.w;  // 左右反転時も体の範囲はバッファの左端から並ぶ（キャンバスは回転させない）
+  return rect;
+}
+
+// キャンバスとバッファの間で範囲をコピーする（物理座標）
+void Zundavatar::_copyCanvasRect(uint16_t* buf, XYWHaddress bufRect, XYWHaddress rect, bool toCanvas) {
+  uint16_t* cbuf = (uint16_t*)canvas_body.getBuffer();
+  size_t len = rect.w * sizeof(uint16_t);
+  for (int y=0; y<rect.h; y++) {
+    uint16_t* cp = cbuf + (rect.y + y) * canvasWidth + rect.x;
+    uint16_t* bp = buf + (rect.y - bufRect.y + y) * bufRect.w + (rect.x - bufRect.x);
+    if (toCanvas) memcpy(cp, bp, len);
+    else memcpy(bp, cp, len);
+  }
+}
+
+// 背景画像の短冊の範囲（出力先の座標）
+static XYWHaddress stripRect(const ImageInfo& img, XYaddress pos) {
+  return { (int16_t)(pos.x + img.posX), (int16_t)(pos.y + img.posY), (int16_t)img.width, (int16_t)img.height };
+}
+
+// このフレームで背景画像を使うかと、その位置を決める（背景色が透明色の場合は透過して出力するので使わない）
+void Zundavatar::_setBackgroundPos(int16_t x, int16_t y, unsigned short bgColor, unsigned short transparent) {
+  _bgUse = backgroundNum > 0 && bgColor != transparent;
+  _bgPos = _bgUse ? XYaddress{ x, y } : XYaddress{ 0, 0 };
+}
+
+// キャンバスの範囲（物理座標）を背景で埋める（背景画像の短冊が重なる部分はコピー、無い部分は背景色）
+void Zundavatar::_fillBackground(M5Canvas* canvas, XYWHaddress rect, unsigned short bgColor) {
+  if (!_bgUse) {
+    canvas->fillRect(rect.x, rect.y, rect.w, rect.h, bgColor);
+    return;
+  }
+  XYWHaddress dr = { (int16_t)(rect.x + _bgPos.x), (int16_t)(rect.y + _bgPos.y), rect.w, rect.h };  // 出力先の座標
+  uint32_t covered = 0;
+  for (int i=0; i<backgroundNum; i++) {
+    if (backgroundInfo[i].data == nullptr) continue;
+    XYWHaddress r = intersectRect(dr, stripRect(backgroundInfo[i], backgroundPos));
+    covered += (uint32_t)r.w * r.h;
+  }
+  if (covered < (uint32_t)rect.w * rect.h) canvas->fillRect(rect.x, rect.y, rect.w, rect.h, bgColor);  // 短冊は重ならないので、足りなければ隙間がある
+  uint16_t* cbuf = (uint16_t*)canvas->getBuffer();
+  int32_t stride = canvas->width();
+  for (int i=0; i<backgroundNum && covered>0; i++) {
+    const ImageInfo& img = backgroundInfo[i];
+    if (img.data == nullptr) continue;
+    XYWHaddress sr = stripRect(img, backgroundPos);
+    XYWHaddress r = intersectRect(dr, sr);
+    size_t len = r.w * sizeof(uint16_t);
+    for (int y=0; y<r.h; y++) {
+      memcpy(cbuf + (r.y - _bgPos.y + y) * stride + (r.x - _bgPos.x), img.data + (r.y - sr.y + y) * img.width + (r.x - sr.x), len);
+    }
+  }
+}
+
+// 出力先の範囲に背景を描く（背景画像の短冊が重なる部分は短冊を貼り、無い部分は背景色で塗る）
+void Zundavatar::_restoreBackground(LovyanGFX* dst, XYWHaddress rect, unsigned short bgColor) {
+  if (rect.w <= 0 || rect.h <= 0) return;
+  uint32_t covered = 0;
+  for (int i=0; i<backgroundNum; i++) {
+    if (backgroundInfo[i].data == nullptr) continue;
+    XYWHaddress r = intersectRect(rect, stripRect(backgroundInfo[i], backgroundPos));
+    covered += (uint32_t)r.w * r.h;
+  }
+  if (covered < (uint32_t)rect.w * rect.h) dst->fillRect(rect.x, rect.y, rect.w, rect.h, bgColor);
+  if (covered == 0) return;
+  int32_t cx, cy, cw, ch;
+  dst->getClipRect(&cx, &cy, &cw, &ch);
+  XYWHaddress clip = intersectRect(rect, { (int16_t)cx, (int16_t)cy, (int16_t)cw, (int16_t)ch });
+  for (int i=0; i<backgroundNum; i++) {
+    const ImageInfo& img = backgroundInfo[i];
+    if (img.data == nullptr) continue;
+    XYWHaddress sr = stripRect(img, backgroundPos);
+    XYWHaddress r = intersectRect(clip, sr);
+    if (r.w == 0) continue;
+    dst->setClipRect(r.x, r.y, r.w, r.h);  // 短冊の必要な部分だけを転送する
+    dst->pushImage(sr.x, sr.y, sr.w, sr.h, (const lgfx::swap565_t*)img.data);
+  }
+  dst->setClipRect(cx, cy, cw, ch);
+}
+
+// 移動・大きさの変更で空いた範囲に背景を描き直す（前回の範囲から今回の範囲を除いた、上・下・左・右の最大4つ）
+void Zundavatar::_restoreVacated(LovyanGFX* dst, unsigned short bgColor) {
+  XYWHaddress now = { (int16_t)drawX, (int16_t)drawY, (int16_t)_layoutW, (int16_t)_layoutH };
+  XYWHaddress old = _shownRect;
+  _shownRect = now;
+  if (old.w == 0 || (old.x == now.x && old.y == now.y && old.w == now.w && old.h == now.h)) return;
+  int16_t body_no = _bodyNo();
+  if (body_no == -1 || bgColor == _imgInfo[body_no].transparent) return;  // 透過して出力している場合は下の内容が分からない
+  XYWHaddress in = intersectRect(old, now);
+  if (in.w == 0) {
+    _restoreBackground(dst, old, bgColor);
+    return;
+  }
+  int16_t ox2 = old.x + old.w, oy2 = old.y + old.h;
+  int16_t ix2 = in.x + in.w, iy2 = in.y + in.h;
+  _restoreBackground(dst, { old.x, old.y, old.w, (int16_t)(in.y - old.y) }, bgColor);
+  _restoreBackground(dst, { old.x, iy2, old.w, (int16_t)(oy2 - iy2) }, bgColor);
+  _restoreBackground(dst, { old.x, in.y, (int16_t)(in.x - old.x), in.h }, bgColor);
+  _restoreBackground(dst, { ix2, in.y, (int16_t)(ox2 - ix2), in.h }, bgColor);
+}
+
+// 下地キャッシュが現在の状態と一致しているか（キャッシュ範囲にかからない部位の変化は無視する）
+bool Zundavatar::_underlayMatch(UnderlayCache* u, XYaddress org, unsigned short bgColor) {
+  if (!u->valid || u->keyBgColor != bgColor || u->keyMirror != mirrorImage) return false;
+  if (u->keyOrg.x != org.x || u->keyOrg.y != org.y) return false;
+  if (u->keyBgPos.x != _bgPos.x || u->keyBgPos.y != _bgPos.y) return false;
+  XYWHaddress ua = _physRect(u->rect);
+  for (int tbl=0; tbl<u->tbl; tbl++) {
+    if (u->keyItems[tbl] == items[tbl]) continue;
+    if (u->keyItems[tbl] == -1 || items[tbl] == -1) return false;
+    XYWHaddress r1 = _partRect(tbl, u->keyItems[tbl]);
+    XYWHaddress r2 = _partRect(tbl, items[tbl]);
+    r1.x += org.x; r1.y += org.y;
+    r2.x += org.x; r2.y += org.y;
+    if (overlapRect(ua, r1) || overlapRect(ua, r2)) return false;
+  }
+  return true;
+}
+
+// 指定範囲の合成に使える下地キャッシュを探す（必要なら範囲を広げる）
+UnderlayCache* Zundavatar::_findUnderlay(XYWHaddress area) {
   int i;
-  int16_t tbl, idx, no;
-  uint16_t idxno, bdw, bdh;
+  UnderlayCache* u;
+  UnderlayCache* grow = nullptr;
+  XYWHaddress pa = _physRect(area);
+
+  // 範囲を含む下地キャッシュがあれば、一番上の部位のものを使う
+  UnderlayCache* found = nullptr;
+  for (i=0; i<underlayMax; i++) {
+    u = &underlays[i];
+    if (u->tbl == -1 || u->buf == nullptr) continue;
+    if (pa.x < u->rect.x || pa.y < u->rect.y || pa.x + pa.w > u->rect.x + u->rect.w || pa.y + pa.h > u->rect.y + u->rect.h) continue;
+    if (found == nullptr || u->tbl > found->tbl) found = u;
+  }
+  if (found != nullptr) return found;
+
+  // 無ければ、範囲内に表示されている動く部位のうち一番下のものの下地キャッシュを広げる
+  for (i=0; i<underlayMax; i++) {
+    u = &underlays[i];
+    if (u->tbl == -1 || _drawList[u->tbl].no == -1) continue;
+    XYWHaddress part = _drawList[u->tbl].rect;
+    if (!overlapRect(area, part)) continue;
+    if (grow == nullptr || u->tbl < grow->tbl) grow = u;
+  }
+  if (grow == nullptr) return nullptr;
+  XYWHaddress rect = (grow->buf == nullptr) ? pa : unionRect(grow->rect, pa);
+  if ((uint32_t)rect.w * rect.h > underlayMaxPixels) return nullptr;
+  uint16_t* buf = usePsram ? (uint16_t*)heap_caps_malloc(rect.w * rect.h * sizeof(uint16_t), MALLOC_CAP_SPIRAM)
+                           : (uint16_t*)malloc(rect.w * rect.h * sizeof(uint16_t));
+  if (buf == nullptr) return nullptr;
+  if (grow->buf != nullptr) free(grow->buf);
+  grow->buf = buf;
+  grow->rect = rect;
+  grow->valid = false;
+  return grow;
+}
+
+// キャンバスに画像を1枚重ねる（範囲外はクリップされる）
+void Zundavatar::_blitImage(int16_t no, XYaddress pos, XYWHaddress area, unsigned short transparentLE) {
+  const ImageInfo& img = _imgInfo[no];
+  // キャンバスのバッファに直接書き込む（物理座標で指定する）
+  uint16_t* buf = (uint16_t*)canvas_body.getBuffer();
+  XYWHaddress pa = _physRect(area);
+  XYWHaddress pi = _physRect({ pos.x, pos.y, (int16_t)img.width, (int16_t)img.height });
+  if (img.span != nullptr && (useSpanImage || (img.data == nullptr && img.index == nullptr))) {
+    blitSpan(buf, canvasWidth, pi.x, pi.y, img.span, img.spanRows, img.width, img.height,
+             pa.x, pa.y, pa.w, pa.h, mirrorImage);
+  } else if (img.index != nullptr && (useIndexedImage || img.data == nullptr)) {
+    blitIndexed(buf, canvasWidth, pi.x, pi.y, img.index, img.palette, img.width, img.height,
+                pa.x, pa.y, pa.w, pa.h, mirrorImage);
+  } else {
+    const uint16_t* data = img.data;
+    if (img.packed != nullptr && (usePackedImage || data == nullptr)) data = _decodeImage(no);
+    if (data == nullptr) return;  // 展開できなかった
+    blitKey(buf, canvasWidth, pi.x, pi.y, data, img.width, img.height, transparentLE,
+            pa.x, pa.y, pa.w, pa.h, mirrorImage);
+  }
+}
+
+// キャンバスの指定範囲に指定したテーブルの部位を重ねる
+void Zundavatar::_composeLayers(XYWHaddress area, int16_t tblFrom, int16_t tblTo, unsigned short transparentLE) {
+  if (tblTo > _tableCount) tblTo = _tableCount;
+  for (int16_t tbl=tblFrom; tbl<tblTo; tbl++) {
+    const DrawItem& item = _drawList[tbl];
+    if (item.no == -1 || !overlapRect(area, item.rect)) continue;
+    // キャンバスに画像をコピーする（範囲外はクリップされる）
+    PROF_BEGIN(pt);
+    _blitImage(item.no, { item.rect.x, item.rect.y }, area, transparentLE);
+    PROF_END(ProfLayer0 + tbl, pt);
+    PROF_END(ProfBlit, pt);
+  }
+}
+
+// キャンバスの指定範囲に部位を重ねて合成する
+void Zundavatar::_composeArea(XYWHaddress area, XYaddress org, unsigned short bgColor, unsigned short transparentLE) {
+  int16_t tblFrom = 0;
+  XYWHaddress upper = area;
+  UnderlayCache* u = useUnderlayCache ? _findUnderlay(area) : nullptr;
+
+  if (u != nullptr) {
+    if (!_underlayMatch(u, org, bgColor)) {
+      // 下地キャッシュを作り直す：キャッシュ範囲全体に動く部位より下だけを合成して保存する
+      XYWHaddress ua = _physRect(u->rect);  // 物理座標→キャンバス上の座標（反転は対称なので同じ変換）
+      upper = ua; // キャンバスの内容がずれないように、残りの部位もキャッシュ範囲全体に重ねる
+      PROF_BEGIN(pt);
+      _fillBackground(&canvas_body, u->rect, bgColor);
+      PROF_END(ProfFill, pt);
+      _composeLayers(ua, 0, u->tbl, transparentLE);
+      _copyCanvasRect(u->buf, u->rect, u->rect, false);
+      for (int tbl=0; tbl<u->tbl; tbl++) u->keyItems[tbl] = items[tbl];
+      u->keyBgColor = bgColor;
+      u->keyMirror = mirrorImage;
+      u->keyOrg = org;
+      u->keyBgPos = _bgPos;
+      u->valid = true;
+    } else {
+      // 下地キャッシュから範囲をコピーする
+      PROF_BEGIN(pt);
+      _copyCanvasRect(u->buf, u->rect, _physRect(area), true);
+      PROF_END(ProfFill, pt);
+    }
+    tblFrom = u->tbl;
+  } else {
+    XYWHaddress pa = _physRect(area);
+    PROF_BEGIN(pt);
+    _fillBackground(&canvas_body, pa, bgColor);
+    PROF_END(ProfFill, pt);
+  }
+
+  // 残りの部位を重ねる
+  _composeLayers(upper, tblFrom, _tableCount, transparentLE);
+}
+
+// 指定部位の下地キャッシュを有効にする（まばたき・リップシンクの設定時に自動で有効になる）
+bool Zundavatar::enableUnderlay(String name) {
+  int16_t tbl = name2table(name);
+  if (tbl == -1) return false;
+  for (int i=0; i<underlayMax; i++) {
+    if (underlays[i].tbl == tbl) return true;
+  }
+  for (int i=0; i<underlayMax; i++) {
+    if (underlays[i].tbl == -1) {
+      underlays[i].tbl = tbl;
+      underlays[i].valid = false;
+      return true;
+    }
+  }
+  return false;
+}
+
+// 下地キャッシュを全て解放する
+void Zundavatar::clearUnderlay() {
+  for (int i=0; i<underlayMax; i++) {
+    if (underlays[i].buf != nullptr) free(underlays[i].buf);
+    underlays[i] = UnderlayCache();
+  }
+}
+
+// 口タイルを解放する
+void Zundavatar::clearMouthTiles() {
+  if (mouthTiles.buf != nullptr) free(mouthTiles.buf);
+  mouthTiles = MouthTiles();
+}
+
+// 背景画像を設定する（短冊は重ならないように並べること。numが0なら背景色に戻す）
+// 画面全体の背景は描かないので、設定した後にdrawBackground()を呼ぶ
+void Zundavatar::setBackground(const ImageInfo* info, uint16_t num, int16_t x, int16_t y) {
+  xSemaphoreTake(_drawMutex, portMAX_DELAY);  // 描画中なら終わるまで待つ
+  backgroundInfo = info;
+  backgroundNum = (info != nullptr) ? num : 0;
+  backgroundPos = { x, y };
+  clearBoyonCache();  // 前の背景が入っているキャッシュは使えない
+  for (int i=0; i<underlayMax; i++) underlays[i].valid = false;
+  mouthTiles.valid = false;
+  xSemaphoreGive(_drawMutex);
+  markDirtyAll();
+}
+
+// 出力先全体に背景を描いて、アバターを描き直す（背景画像が無ければ背景色で塗る）
+void Zundavatar::drawBackground() {
+  if (drawDisplay == nullptr) return;
+  xSemaphoreTake(_drawMutex, portMAX_DELAY);
+  _restoreBackground(drawDisplay, { 0, 0, (int16_t)drawDisplay->width(), (int16_t)drawDisplay->height() }, drawBackgroundColor);
+  _shownRect = { 0, 0, 0, 0 };
+  xSemaphoreGive(_drawMutex);
+  drawAvatar();
+}
+
+// リップシンクの口を変更する（描画タスクまたは描画タスク無しの場合）
+// 口タイルを使う場合は再描画範囲に登録せず、描画のときに口タイルを転送する（使えなかったらそのときに再描画範囲に登録する）
+void Zundavatar::_changeMouthNow(int16_t idx) {
+  int16_t tbl = autoLipsyncTbl;
+  if (!useMouthTiles || idx == -1 || _bodyNo() == -1) {
+    _changePartsNow(tbl, idx);
+    return;
+  }
+  if (items[tbl] == idx) return;
+  if (!_mouthPending) _mouthShownIdx = items[tbl];
+  items[tbl] = idx;
+  _mouthPending = true;
+}
+
+// 口タイルで描画しない場合に、前の口と今の口の範囲を再描画範囲に登録する
+void Zundavatar::_flushMouth() {
+  if (!_mouthPending) return;
+  _mouthPending = false;
+  int16_t tbl = autoLipsyncTbl;
+  if (_mouthShownIdx != -1) markDirty(_partRect(tbl, _mouthShownIdx));
+  if (items[tbl] != -1) markDirty(_partRect(tbl, items[tbl]));
+}
+
+// 今の状態で口タイルが使えるようにする（一致しなければ作り直す）
+bool Zundavatar::_prepareMouthTiles(int16_t x, int16_t y, unsigned short bgColor) {
+  int16_t body_no = _bodyNo();
+  if (!useMouthTiles || !reuseCanvas || body_no == -1) return false;
+  if (autoLipsyncTbl < 0 || autoLipsyncTbl >= _tableCount) return false;
+  if (scaleBodyCanvasX != 1.0 || scaleBodyCanvasY != 1.0) return false;  // 変形中は全体を描画するので使わない
+  if (bgColor == _imgInfo[body_no].transparent) return false;  // 背景を透過する場合は不透明な画像にできない
+  _setBackgroundPos(x, y, bgColor, _imgInfo[body_no].transparent);  // 背景画像を使う場合は出力先の位置の背景を入れる
+  uint16_t w = _imgInfo[body_no].width, h = _imgInfo[body_no].height;
+  XYaddress org = { 0, 0 };
+  if (expandCanvas) {
+    w += expandCanvasInfo.w;
+    h += expandCanvasInfo.h;
+    org = { expandCanvasInfo.x, expandCanvasInfo.y };
+  }
+  if (_mouthTilesMatch(org, w, h, bgColor)) return true;
+  return _buildMouthTiles(org, w, h, bgColor);
+}
+
+// 口タイルが現在の状態と一致しているか（タイルの範囲にかからない部位の変化は無視する）
+bool Zundavatar::_mouthTilesMatch(XYaddress org, uint16_t w, uint16_t h, unsigned short bgColor) {
+  MouthTiles& t = mouthTiles;
+  if (!t.valid || t.keyBgColor != bgColor || t.keyMirror != mirrorImage) return false;
+  if (t.keyOrg.x != org.x || t.keyOrg.y != org.y || t.keyW != w || t.keyH != h) return false;
+  if (t.keyBgPos.x != _bgPos.x || t.keyBgPos.y != _bgPos.y) return false;
+  for (int i=0; i<6; i++) {
+    if (t.keyIdxs[i] != autoLipsyncIdxs[i]) return false;
+  }
+  if (t.keyItems[_bodyTbl] != items[_bodyTbl]) return false;  // 体が変わると全ての部位の位置が変わる
+  XYWHaddress ta = _physRect(t.rect);
+  for (int tbl=0; tbl<_tableCount; tbl++) {
+    if (tbl == autoLipsyncTbl || t.keyItems[tbl] == items[tbl]) continue;
+    if (t.keyItems[tbl] == -1 || items[tbl] == -1) return false;
+    XYWHaddress r1 = _partRect(tbl, t.keyItems[tbl]);
+    XYWHaddress r2 = _partRect(tbl, items[tbl]);
+    r1.x += org.x; r1.y += org.y;
+    r2.x += org.x; r2.y += org.y;
+    if (overlapRect(ta, r1) || overlapRect(ta, r2)) return false;
+  }
+  return true;
+}
+
+// 口タイルを作る（リップシンクの6つの口の形ごとに、口の範囲を合成してコピーしておく）
+bool Zundavatar::_buildMouthTiles(XYaddress org, uint16_t w, uint16_t h, unsigned short bgColor) {
+  MouthTiles& t = mouthTiles;
+  int16_t tbl = autoLipsyncTbl;
+  t.valid = false;
+
+  // タイルの範囲：全ての口の画像を含む範囲（キャンバスの範囲内）
+  int16_t x1 = w, y1 = h, x2 = 0, y2 = 0;
+  for (int i=0; i<6; i++) {
+    int16_t idx = autoLipsyncIdxs[i];
+    if (idx < 0) continue;
+    XYWHaddress r = _partRect(tbl, idx);
+    if (r.x + org.x < x1) x1 = r.x + org.x;
+    if (r.y + org.y < y1) y1 = r.y + org.y;
+    if (r.x + org.x + r.w > x2) x2 = r.x + org.x + r.w;
+    if (r.y + org.y + r.h > y2) y2 = r.y + org.y + r.h;
+  }
+  if (x1 < 0) x1 = 0;
+  if (y1 < 0) y1 = 0;
+  if (x2 > w) x2 = w;
+  if (y2 > h) y2 = h;
+  if (x1 >= x2 || y1 >= y2) return false;
+  XYWHaddress area = { x1, y1, (int16_t)(x2 - x1), (int16_t)(y2 - y1) };
+  uint32_t pixels = (uint32_t)area.w * area.h;
+  if (pixels > mouthTileMaxPixels) return false;
+
+  // タイル6枚分のメモリを確保する（足りない場合だけ確保し直す）
+  uint32_t bytes = pixels * 6 * sizeof(uint16_t);
+  if (t.bytes < bytes) {
+    if (t.buf != nullptr) free(t.buf);
+    t.buf = usePsram ? (uint16_t*)heap_caps_malloc(bytes, MALLOC_CAP_SPIRAM) : (uint16_t*)malloc(bytes);
+    t.bytes = (t.buf != nullptr) ? bytes : 0;
+    if (t.buf == nullptr) return false;
+  }
+  if (!allocCanvas(w, h)) return false;
+  _layoutW = w;
+  _layoutH = h;
+
+  // 口の形ごとに、キャンバスに合成してタイルにコピーする（キャンバスは作業用なので内容が変わっても構わない）
+  unsigned short transparent = _imgInfo[_bodyNo()].transparent;
+  unsigned short transparentLE = (transparent & 0xFF) << 8 | (transparent & 0xFF00) >> 8;
+  XYWHaddress pa = _physRect(area);
+  int16_t saved = items[tbl];
+  canvas_body.startWrite();
+  for (int i=0; i<6; i++) {
+    items[tbl] = autoLipsyncIdxs[i];
+    _buildDrawList(org);
+    _composeArea(area, org, bgColor, transparentLE);
+    _copyCanvasRect(t.buf + pixels * i, pa, pa, false);
+  }
+  canvas_body.endWrite();
+  items[tbl] = saved;
+  _buildDrawList(org);
+
+  t.rect = pa;
+  for (int i=0; i<6; i++) t.keyIdxs[i] = autoLipsyncIdxs[i];
+  for (int i=0; i<tableNumZundavatar; i++) t.keyItems[i] = (i < _tableCount) ? items[i] : -1;
+  t.keyBgColor = bgColor;
+  t.keyMirror = mirrorImage;
+  t.keyOrg = org;
+  t.keyBgPos = _bgPos;
+  t.keyW = w;
+  t.keyH = h;
+  t.valid = true;
+  frameStat.mouthTileBuilds ++;
+  return true;
+}
+
+// 今の口の口タイルを出力先に転送する（合成も透明色の判定もしない、1回の転送だけ）
+bool Zundavatar::_presentMouthTile(LovyanGFX* dst, int16_t x, int16_t y, unsigned short bgColor) {
+  unsigned long stams = micros();
+  if (!_prepareMouthTiles(x, y, bgColor)) return false;
+  int16_t k = -1;
+  for (int i=0; i<6; i++) {
+    if (mouthTiles.keyIdxs[i] == items[autoLipsyncTbl]) k = i;
+  }
+  if (k == -1) return false;  // リップシンクの口ではない
+  const XYWHaddress& r = mouthTiles.rect;
+  uint32_t pt = micros();
+  dst->pushImage(x + r.x, y + r.y, r.w, r.h, (const lgfx::swap565_t*)(mouthTiles.buf + (uint32_t)r.w * r.h * k));
+  uint32_t pushUs = micros() - pt;
+
+  // フレーム時間を記録する（合成はしていないのでピクセル数は0）
+  uint32_t us = micros() - stams;
+  frameStat.frames ++;
+  frameStat.totalUs += us;
+  frameStat.lastUs = us;
+  if (us > frameStat.maxUs) frameStat.maxUs = us;
+  frameStat.lastPixels = 0;
+  frameStat.pushUs += pushUs;
+  frameStat.mouthTileHits ++;
+  profiler.add(ProfPush, pushUs);
+  profiler.add(ProfFrame, us);
+  profiler.endFrame();
+  return true;
+}
+
+// DMA転送用のバッファを確保する（内蔵RAMに2つ、キャンバスの幅×presentBandLines行）
+bool Zundavatar::_allocPresentBuffers() {
+  uint32_t bytes = (uint32_t)canvasWidth * presentBandLines * sizeof(uint16_t);
+  if (_presentBuf[0] != nullptr && _presentBytes >= bytes) return true;
+  _freePresentBuffers();
+  for (int i=0; i<2; i++) {
+    _presentBuf[i] = (uint16_t*)heap_caps_malloc(bytes, MALLOC_CAP_DMA);
+    if (_presentBuf[i] == nullptr) {
+      _freePresentBuffers();
+      return false;
+    }
+  }
+  _presentBytes = bytes;
+  return true;
+}
+
+// DMA転送用のバッファを解放する
+void Zundavatar::_freePresentBuffers() {
+  for (int i=0; i<2; i++) {
+    if (_presentBuf[i] != nullptr) heap_caps_free(_presentBuf[i]);
+    _presentBuf[i] = nullptr;
+    _presentBusy[i] = false;
+  }
+  _presentBytes = 0;
+}
+
+// 合成した範囲を出力先に貼り付ける（左右反転時は範囲も反転する）
+void Zundavatar::_presentArea(M5Canvas* src, LovyanGFX* dst, int16_t x, int16_t y, XYWHaddress area, unsigned short transparent, bool dma) {
+  unsigned long tm = micros();
+  XYWHaddress clip = _physRect(area);
+  clip.x += x;
+  clip.y += y;
+  if (dma) {
+    _pushDMA(src, dst, x, y, clip);
+  } else {
+    _pushClipped(src, dst, x, y, clip, transparent);
+  }
+  _presentStat.pushUs += micros() - tm;
+}
+
+// 出力先の指定範囲だけにキャンバスをDMAで転送する
+// キャンバスの内容を数行ずつ転送用バッファにコピーしてDMAで送る。2つのバッファを交互に使い、片方を転送している間にもう片方を用意する。
+// LovyanGFXはDMA転送を1つずつ順番に行う（次の転送は前の転送が終わってから始まる）ので、次の転送を始めた時点で前のバッファは空いている。
+void Zundavatar::_pushDMA(M5Canvas* src, LovyanGFX* dst, int16_t x, int16_t y, XYWHaddress clip) {
+  int32_t cx, cy, cw, ch;
+  dst->getClipRect(&cx, &cy, &cw, &ch);
+  int32_t x1 = (clip.x > cx) ? clip.x : cx;
+  int32_t y1 = (clip.y > cy) ? clip.y : cy;
+  int32_t x2 = (clip.x + clip.w < cx + cw) ? clip.x + clip.w : cx + cw;
+  int32_t y2 = (clip.y + clip.h < cy + ch) ? clip.y + clip.h : cy + ch;
+  if (x1 >= x2 || y1 >= y2) return;
+  const uint16_t* sbuf = (const uint16_t*)src->getBuffer();
+  int32_t stride = src->width();
+  int32_t w = x2 - x1;
+  size_t len = w * sizeof(uint16_t);
+  for (int32_t by=y1; by<y2; by+=presentBandLines) {
+    int32_t bh = (y2 - by < presentBandLines) ? y2 - by : presentBandLines;
+    uint8_t b = _presentIdx;
+    // フェンス：このバッファがまだ転送中なら終わるまで待つ
+    if (_presentBusy[b]) {
+      unsigned long tw = micros();
+      dst->waitDMA();
+      _presentBusy[0] = _presentBusy[1] = false;
+      _presentStat.waitUs += micros() - tw;
+    }
+    // キャンバス→転送用バッファ（前のバッファの転送中ならその時間は重なっている）
+    unsigned long tc = micros();
+    bool busy = dst->dmaBusy();
+    uint16_t* d = _presentBuf[b];
+    const uint16_t* s = sbuf + (by - y) * stride + (x1 - x);
+    for (int32_t j=0; j<bh; j++) memcpy(d + j * w, s + j * stride, len);
+    if (busy) _presentStat.overlapUs += micros() - tc;
+    dst->pushImageDMA(x1, by, w, bh, (const lgfx::swap565_t*)d);
+    _presentBusy[b] = true;
+    _presentBusy[b ^ 1] = false;  // 新しい転送が始まったので、もう片方の転送は終わっている
+    _presentIdx = b ^ 1;
+  }
+}
+
+// 変形キャッシュを全て解放する
+void Zundavatar::clearBoyonCache() {
+  for (int i=0; i<boyonCacheMax; i++) {
+    if (boyonCaches[i].buf != nullptr) free(boyonCaches[i].buf);
+    boyonCaches[i] = BoyonCache();
+  }
+  _boyonBytes = 0;
+}
+
+// 変形キャッシュが現在の状態と一致しているか
+bool Zundavatar::_boyonMatch(BoyonCache* c, XYaddress org, unsigned short bgColor) {
+  if (c->buf == nullptr) return false;
+  if (c->keyScaleX != scaleBodyCanvasX || c->keyScaleY != scaleBodyCanvasY) return false;
+  if (c->keyBgColor != bgColor || c->keyMirror != mirrorImage || c->keyAntiAliases != useAntiAliases) return false;
+  if (c->keyOrg.x != org.x || c->keyOrg.y != org.y || c->keyW != _layoutW || c->keyH != _layoutH) return false;
+  if (c->keyBgPos.x != _bgPos.x || c->keyBgPos.y != _bgPos.y) return false;
+  for (int tbl=0; tbl<tableNum; tbl++) {
+    if (c->keyItems[tbl] != items[tbl]) return false;
+  }
+  return true;
+}
+
+// 現在の状態の変形キャッシュを探す
+BoyonCache* Zundavatar::_findBoyon(XYaddress org, unsigned short bgColor) {
+  for (int i=0; i<boyonCacheMax; i++) {
+    if (_boyonMatch(&boyonCaches[i], org, bgColor)) {
+      boyonCaches[i].stamp = ++_boyonStamp;
+      return &boyonCaches[i];
+    }
+  }
+  return nullptr;
+}
+
+// 変形後のキャンバスを変形キャッシュに登録する（メモリの上限を超える場合は使われていないものから捨てる）
+void Zundavatar::_storeBoyon(XYaddress org, unsigned short bgColor) {
+  uint32_t bytes = (uint32_t)_layoutW * _layoutH * sizeof(uint16_t);
+  if (bytes > boyonCacheMaxBytes) return;
+  BoyonCache* c = nullptr;
+  for (;;) {
+    // 空きを探す、無ければ一番古いものを捨てる
+    BoyonCache* oldest = nullptr;
+    c = nullptr;
+    for (int i=0; i<boyonCacheMax; i++) {
+      if (boyonCaches[i].buf == nullptr) {
+        if (c == nullptr) c = &boyonCaches[i];
+      } else if (oldest == nullptr || boyonCaches[i].stamp < oldest->stamp) {
+        oldest = &boyonCaches[i];
+      }
+    }
+    if (c != nullptr && _boyonBytes + bytes <= boyonCacheMaxBytes) break;
+    if (oldest == nullptr) return;
+    _boyonBytes -= oldest->bytes;
+    free(oldest->buf);
+    *oldest = BoyonCache();
+  }
+  c->buf = (uint16_t*)(usePsram ? heap_caps_malloc(bytes, MALLOC_CAP_SPIRAM) : malloc(bytes));
+  if (c->buf == nullptr) return;
+  c->bytes = bytes;
+  _boyonBytes += bytes;
+  c->stamp = ++_boyonStamp;
+  c->keyScaleX = scaleBodyCanvasX;
+  c->keyScaleY = scaleBodyCanvasY;
+  c->keyBgColor = bgColor;
+  c->keyMirror = mirrorImage;
+  c->keyAntiAliases = useAntiAliases;
+  c->keyOrg = org;
+  c->keyBgPos = _bgPos;
+  c->keyW = _layoutW;
+  c->keyH = _layoutH;
+  for (int tbl=0; tbl<tableNumZundavatar; tbl++) c->keyItems[tbl] = (tbl < tableNum) ? items[tbl] : -1;
+  _copyBoyon(c, false);
+}
+
+// 展開キャッシュを全て解放する
+void Zundavatar::clearDecodeCache() {
+  for (int i=0; i<decodeCacheMax; i++) {
+    if (decodeCaches[i].buf != nullptr) free(decodeCaches[i].buf);
+    decodeCaches[i] = DecodeCache();
+  }
+  _decodeBytes = 0;
+}
+
+// 展開キャッシュから捨てたくない画像か（表示中の部位と、まばたき・リップシンクで切り替える画像）
+bool Zundavatar::_decodePinned(int16_t no) {
+  for (int tbl=0; tbl<_tableCount; tbl++) {
+    if (_drawList[tbl].no == no) return true;
+  }
+  if (autoBlinkTbl != -1) {
+    if (no == _imgTables[autoBlinkTbl][autoBlinkIdx_open] || no == _imgTables[autoBlinkTbl][autoBlinkIdx_close]) return true;
+  }
+  if (autoLipsyncTbl != -1) {
+    for (int i=0; i<6; i++) {
+      if (autoLipsyncIdxs[i] >= 0 && no == _imgTables[autoLipsyncTbl][autoLipsyncIdxs[i]]) return true;
+    }
+  }
+  return false;
+}
+
+// 圧縮形式の画像を展開キャッシュから取り出す（無ければ展開する。メモリの上限を超える場合は使われていないものから捨てる）
+const uint16_t* Zundavatar::_decodeImage(int16_t no) {
+  for (int i=0; i<decodeCacheMax; i++) {
+    if (decodeCaches[i].no == no) {
+      decodeCaches[i].stamp = ++_decodeStamp;
+      frameStat.decodeHits ++;
+      return decodeCaches[i].buf;
+    }
+  }
+  const ImageInfo& img = _imgInfo[no];
+  uint32_t bytes = (uint32_t)img.width * img.height * sizeof(uint16_t);
+  if (bytes > decodeCacheMaxBytes) return nullptr;
+  DecodeCache* c = nullptr;
+  for (;;) {
+    // 空きを探す、無ければ一番古いものを捨てる（表示中などの画像は、他に捨てるものが無いときだけ捨てる）
+    DecodeCache* oldest = nullptr;
+    DecodeCache* oldestPinned = nullptr;
+    c = nullptr;
+    for (int i=0; i<decodeCacheMax; i++) {
+      DecodeCache* e = &decodeCaches[i];
+      if (e->buf == nullptr) {
+        if (c == nullptr) c = e;
+      } else if (_decodePinned(e->no)) {
+        if (oldestPinned == nullptr || e->stamp < oldestPinned->stamp) oldestPinned = e;
+      } else if (oldest == nullptr || e->stamp < oldest->stamp) {
+        oldest = e;
+      }
+    }
+    if (c != nullptr && _decodeBytes + bytes <= decodeCacheMaxBytes) break;
+    if (oldest == nullptr) oldest = oldestPinned;
+    if (oldest == nullptr) return nullptr;
+    _decodeBytes -= oldest->bytes;
+    free(oldest->buf);
+    *oldest = DecodeCache();
+  }
+  PROF_BEGIN(pt);
+  c->buf = (uint16_t*)(usePsram ? heap_caps_malloc(bytes, MALLOC_CAP_SPIRAM) : malloc(bytes));
+  if (c->buf == nullptr) return nullptr;
+  if (!unpackImage(img.packed, img.packedSize, c->buf, (uint32_t)img.width * img.height, (uint16_t)(img.transparent << 8 | img.transparent >> 8))) {
+    spf("decode error: image %d\n", no);
+    free(c->buf);
+    c->buf = nullptr;
+    return nullptr;
+  }
+  PROF_END(ProfDecode, pt);
+  c->no = no;
+  c->bytes = bytes;
+  _decodeBytes += bytes;
+  c->stamp = ++_decodeStamp;
+  frameStat.decodeMisses ++;
+  return c->buf;
+}
+
+// 変形キャッシュと作業用キャンバスの間でコピーする（作業用キャンバスは反転なしなので体の範囲は左端にある）
+void Zundavatar::_copyBoyon(BoyonCache* c, bool toCanvas) {
+  uint16_t* cbuf = (uint16_t*)canvas_body2.getBuffer();
+  int32_t stride = canvas_body2.width();
+  size_t len = c->keyW * sizeof(uint16_t);
+  for (int y=0; y<c->keyH; y++) {
+    if (toCanvas) memcpy(cbuf + y * stride, c->buf + y * c->keyW, len);
+    else memcpy(c->buf + y * c->keyW, cbuf + y * stride, len);
+  }
+}
+
+// アバターを合成してキャンバスに出力する（trimは複数指定可）
+void Zundavatar::_makeAvater(LovyanGFX* dst, int16_t x, int16_t y, unsigned short bgColor, XYWHaddress* trim, uint16_t trimNum) {
+  int i;
+  uint16_t bdw, bdh, areaNum = 0;
   unsigned short transparent, transparentLE;
-  XYaddress ofs, out = {x, y}; 
+  XYaddress org = {0, 0};
+  XYWHaddress areas[dirtyRectMax];
+  uint32_t pixels = 0;
+  unsigned long stams = micros();
 
   // 基準となる体のテーブル番号・インデックス番号・画像番号を求める
-  int16_t body_no = nameidx2no("body"); //（第2引数省略時はitems[]を参照）
+  int16_t body_no = _bodyNo();
   if (body_no == -1) return;
 
   // 透明色を求める
   transparent = _imgInfo[body_no].transparent;
   transparentLE = (transparent & 0xFF) << 8 | (transparent & 0xFF00) >> 8;
 
-  // キャンバスを作成する
-  canvas_body.setPsram(usePsram);
-  canvas_body.setColorDepth(16);
-  canvas_body.setRotation(mirrorImage ? rotateMirrorOn : rotateMirrorOff);
-  if (trim == nullptr) {
-    bdw = _imgInfo[body_no].width;
-    bdh = _imgInfo[body_no].height;
-    if (expandCanvas) {  // キャンバスのサイズを拡張した場合
-      bdw += expandCanvasInfo.w;
-      bdh += expandCanvasInfo.h;
-    }
-  } else {  // トリムモードの場合は指定されたサイズのキャンバスにする
-    bdw = trim->w;
-    bdh = trim->h;
-  }
-  canvas_body.createSprite(bdw, bdh);
-  canvas_body.startWrite();
-  canvas_body.fillSprite(bgColor);
-
-  // 部位順に画像を重ねていく
-  for (tbl=0; tbl<tableNum; tbl++) {
-    if (_tableNames[tbl] == "") break;
-    idx = items[tbl];
-    if (idx == -1) continue;
-
-    // 配置先座標のオフセット値を求める
-    no = _imgTables[tbl][idx];
-    ofs = img_get_offset(_imgInfo[body_no], _imgInfo[no]);
-    if (trim == nullptr) {
-      if (expandCanvas) {  // キャンバスのサイズを拡張した場合
-        ofs.x += expandCanvasInfo.x;
-        ofs.y += expandCanvasInfo.y;
-      }
-    } else {  // トリムモードの場合は出力先座標を調整する
-      ofs.x -= trim->x;
-      ofs.y -= trim->y;
+  // 体のキャンバス上の大きさと位置を求める
+  bdw = _imgInfo[body_no].width;
+  bdh = _imgInfo[body_no].height;
+  if (expandCanvas) {  // キャンバスのサイズを拡張した場合
+    bdw += expandCanvasInfo.w;
+    bdh += expandCanvasInfo.h;
+    org.x = expandCanvasInfo.x;
+    org.y = expandCanvasInfo.y;
+  }
+
+  // 各部位の画像番号と配置先を求めておく（合成中は文字列の比較や座標の計算をしない）
+  _buildDrawList(org);
+
+  // キャンバスを用意する（一度確保したキャンバスを使い回す）
+  if (!allocCanvas(bdw, bdh)) return;
+  _layoutW = bdw;
+  _layoutH = bdh;
+
+  // 合成する範囲を決める（トリムモードの場合は指定された範囲だけ、変形ありの場合は全体）
+  if (trim != nullptr && scaleBodyCanvasX == 1.0 && scaleBodyCanvasY == 1.0) {
+    for (i=0; i<trimNum && areaNum<dirtyRectMax; i++) {
+      int16_t x1 = trim[i].x + org.x, y1 = trim[i].y + org.y;
+      int16_t x2 = x1 + trim[i].w, y2 = y1 + trim[i].h;
+      if (x1 < 0) x1 = 0;
+      if (y1 < 0) y1 = 0;
+      if (x2 > bdw) x2 = bdw;
+      if (y2 > bdh) y2 = bdh;
+      if (x1 < x2 && y1 < y2) areas[areaNum++] = { x1, y1, (int16_t)(x2 - x1), (int16_t)(y2 - y1) };
     }
+  } else {
+    areas[areaNum++] = { 0, 0, (int16_t)bdw, (int16_t)bdh };
+  }
 
-    // キャンバスに画像をコピーする
-    canvas_body.pushImage(ofs.x, ofs.y, _imgInfo[no].width, _imgInfo[no].height, _imgInfo[no].data, transparentLE);
+  // 変形ありの場合は作業用のキャンバスを使う canvas_body --> canvas_body2 --> dst
+  bool scaled = (scaleBodyCanvasX != 1.0 || scaleBodyCanvasY != 1.0);
+  BoyonCache* cached = nullptr;
+
+  // 背景画像を使う場合、変形ありなら体だけを透明色の上に合成して変形し、背景は変形後のキャンバスに入れる（背景は変形させない）
+  _setBackgroundPos(x, y, bgColor, transparent);
+  bool bgImage = _bgUse;
+  unsigned short fillColor = bgColor;
+  if (scaled && bgImage) {
+    _bgUse = false;
+    fillColor = transparent;
+  }
+  if (scaled) {
+    if (canvas_body2.getBuffer() == nullptr) {
+      canvas_body2.setPsram(usePsram);
+      canvas_body2.setColorDepth(16);
+      canvas_body2.createSprite(canvasWidth, canvasHeight);
+    }
+    // 同じ変形・同じ部位の組み合わせを作ったことがあれば、変形キャッシュから取り出す
+    if (useBoyonCache && canvas_body2.getBuffer() != nullptr) {
+      cached = _findBoyon(org, bgColor);
+      if (cached != nullptr) {
+        _copyBoyon(cached, true);
+        frameStat.cacheHits ++;
+      } else {
+        frameStat.cacheMisses ++;
+      }
+    }
   }
 
-  // 出力
-  if (trim != nullptr) {  // トリムモードの場合は出力先座標を調整する
-    out.x += trim->x;
-    out.y += trim->y;
-    if (expandCanvas) {  // キャンバスのサイズを拡張した場合
-      out.x += expandCanvasInfo.x;
-      out.y += expandCanvasInfo.y;
+  // DMAで転送するか（背景色が透明色の場合は透過が必要なのでpushSpriteを使う）
+  M5Canvas* src = scaled ? &canvas_body2 : &canvas_body;
+  bool dma = useDmaPresent && bgColor != transparent && src->getBuffer() != nullptr && _allocPresentBuffers();
+  uint32_t renderUs = 0, tm;
+  _presentStat = PresentStat();
+  if (dma) dst->startWrite();
+
+  // 合成して、範囲ごとに出力する（DMAの場合は前の範囲を転送している間に次の範囲を合成する）
+  for (i=0; i<areaNum; i++) {
+    if (cached == nullptr) {
+      tm = micros();
+      bool busy = dma && dst->dmaBusy();
+      canvas_body.startWrite();
+      _composeArea(areas[i], org, fillColor, transparentLE);
+      canvas_body.endWrite();
+      pixels += (uint32_t)areas[i].w * areas[i].h;
+      tm = micros() - tm;
+      renderUs += tm;
+      if (busy) _presentStat.overlapUs += tm;
     }
+    if (scaled) continue;  // 変形ありの場合は全体を合成してから変形する（範囲は全体の1つだけ）
+    _presentArea(src, dst, x, y, areas[i], transparent, dma);
   }
-  if (scaleBodyCanvasX == 1.0 && scaleBodyCanvasY == 1.0) {
-    // 変形なしの場合はそのまま貼り付け
-    canvas_body.pushSprite(dst, out.x, out.y, transparent);
-    delay(1);
-  } else {
-    // 変形ありの場合は作業用のキャンバスを作る canvas_body --> canvas_body2 --> dst
-    canvas_body2.setPsram(usePsram);
-    canvas_body2.setColorDepth(16);
-    canvas_body2.createSprite(bdw, bdh);
-    canvas_body2.startWrite();
-    canvas_body2.fillSprite(bgColor);
-    uint16_t x2 = canvas_body.width() / 2.0;
-    uint16_t y2 = canvas_body.height();
-    canvas_body.setPivot(x2, y2);  // 下/中央が基準点
-    if (useAntiAliases) {
-      canvas_body.pushRotateZoomWithAA(&canvas_body2, x2,y2, 0, scaleBodyCanvasX, scaleBodyCanvasY, transparent);
-    } else {
-      canvas_body.pushRotateZoom(&canvas_body2, x2,y2, 0, scaleBodyCanvasX, scaleBodyCanvasY, transparent);
+  if (scaled) {
+    if (cached == nullptr) {
+      tm = micros();
+      canvas_body2.setClipRect(0, 0, bdw, bdh);
+      canvas_body2.startWrite();
+      _bgUse = bgImage;
+      _fillBackground(&canvas_body2, { 0, 0, (int16_t)bdw, (int16_t)bdh }, bgColor);
+      float x2 = bdw / 2.0;
+      float y2 = bdh;
+      canvas_body.setPivot(x2, y2);  // 下/中央が基準点
+      if (useAntiAliases) {
+        canvas_body.pushRotateZoomWithAA(&canvas_body2, x2,y2, 0, scaleBodyCanvasX, scaleBodyCanvasY, transparent);
+      } else {
+        canvas_body.pushRotateZoom(&canvas_body2, x2,y2, 0, scaleBodyCanvasX, scaleBodyCanvasY, transparent);
+      }
+      canvas_body2.endWrite();
+      canvas_body2.clearClipRect();
+      PROF_END(ProfZoom, tm);
+      if (useBoyonCache && canvas_body2.getBuffer() != nullptr) _storeBoyon(org, bgColor);
+      renderUs += micros() - tm;
     }
-    delay(1);
-    canvas_body2.pushSprite(dst, out.x, out.y, transparent);
-    delay(1);
-    canvas_body2.endWrite();
-    canvas_body2.deleteSprite();
+    for (i=0; i<areaNum; i++) _presentArea(src, dst, x, y, areas[i], transparent, dma);
   }
 
-  canvas_body.endWrite();
-  canvas_body.deleteSprite();
+  // 最後の転送の完了を待つ（次のフレームで転送用バッファを書き換えても大丈夫なように）
+  if (dma) {
+    tm = micros();
+    dst->waitDMA();
+    dst->endWrite();
+    _presentStat.pushUs += micros() - tm;
+  }
+
+  // フレーム時間と合成し直したピクセル数を記録する
+  uint32_t us = micros() - stams;
+  frameStat.frames ++;
+  frameStat.totalUs += us;
+  frameStat.lastUs = us;
+  if (us > frameStat.maxUs) frameStat.maxUs = us;
+  frameStat.pixels += pixels;
+  frameStat.lastPixels = pixels;
+  frameStat.renderUs += renderUs;
+  frameStat.pushUs += _presentStat.pushUs;
+  frameStat.overlapUs += _presentStat.overlapUs;
+  frameStat.waitUs += _presentStat.waitUs;
+  profiler.add(ProfPush, _presentStat.pushUs);
+  profiler.add(ProfFrame, us);
+  profiler.endFrame();
+
+  // 旧方式の場合は毎回解放する
+  if (!reuseCanvas) freeCanvas();
 }
 
 // アバターの出力先を設定する
@@ -199,44 +1209,400 @@ void Zundavatar::setDrawDisplay(LovyanGFX* display, uint16_t x, uint16_t y, unsi
   drawX = x;
   drawY = y;
   drawBackgroundColor = bgColor;
+  _shownRect = { 0, 0, 0, 0 };  // 新しい出力先にはまだ何も描いていない
   if (usePsram && heap_caps_get_free_size(MALLOC_CAP_SPIRAM) == 0) {
     usePsram = false;  // PSRAMが無い場合はPSRAMを使わない
   }
 }
 
 // アバターの出力先の座標を変更する
+// 位置が変わったら次の描画は全体になり、前の位置の空いた範囲には背景を描き直す
 void Zundavatar::changeDrawPosition(uint16_t x, uint16_t y) {
+  if (x != drawX || y != drawY) markDirtyAll();
   drawX = x;
   drawY = y;
 }
 
 // アバターを生成して出力する（全体表示を行う）
+// 描画タスク実行中はキューに入れるだけで、drawWaitはキューが一杯のときに空くまで待つかどうか
 void Zundavatar::drawAvatar(bool drawWait) {
-  int loop = 0;
-  while (nowDrawing && drawWait) { // 排他処理：描画中なら待機する。ただし100msまで
-    delay(1);
-    if (++loop > 100) break;
-  }
-  if (!nowDrawing) {
-    nowDrawing = true;
-    makeAvater(drawDisplay, drawX, drawY, drawBackgroundColor);
-    nowDrawing = false;
+  if (_renderTask != nullptr && !_onRenderTask()) {
+    if (!_postRender({ RenderCmdType::PresentFull, 0, 0, 0 }, drawWait ? pdMS_TO_TICKS(100) : 0)) {
+      markDirtyAll();  // 描画できなかった場合は次回の描画で全体を描画する
+    }
+  } else {
+    _drawNow(true, drawWait ? pdMS_TO_TICKS(100) : 0);
   }
 }
 
 // アバターを生成して指定した範囲だけを出力する（一部分だけの書き換え用途）
 void Zundavatar::drawAvatarTrim(int16_t x, int16_t y, uint16_t w, uint16_t h, bool drawWait) {
-  int loop = 0;
-  while (nowDrawing && drawWait) { // 排他処理：描画中なら待機する。ただし100msまで
-    delay(1);
-    if (++loop > 100) break;
+  markDirty({ x, y, (int16_t)w, (int16_t)h });
+  drawAvatarDirty(drawWait);
+}
+
+// 再描画範囲に登録された部分だけをまとめて出力する
+void Zundavatar::drawAvatarDirty(bool drawWait) {
+  if (_renderTask != nullptr && !_onRenderTask()) {
+    _postRender({ RenderCmdType::Present, 0, 0, 0 }, drawWait ? pdMS_TO_TICKS(100) : 0);  // 入れられなくても再描画範囲は残る
+  } else {
+    _drawNow(false, drawWait ? pdMS_TO_TICKS(100) : 0);
+  }
+}
+
+// 今すぐ描画する（描画中なら待つ、待てなければ次回に回す）
+void Zundavatar::_drawNow(bool full, TickType_t wait) {
+  uint16_t num;
+  bool dirtyFull;
+  XYWHaddress rects[dirtyRectMax];
+  PROF_BEGIN(pt);
+  if (xSemaphoreTake(_drawMutex, wait) != pdTRUE) {
+    if (full) markDirtyAll();  // 描画できなかった場合は次回の描画で全体を描画する（部分の場合は再描画範囲が残っている）
+    return;
+  }
+  PROF_END(ProfLockWait, pt);
+  nowDrawing = true;
+  // リップシンクの口の変更は口タイルを転送するだけにする（使えない場合は再描画範囲として合成し直す）
+  if (_mouthPending) {
+    if (full || _dirtyFull || !_presentMouthTile(drawDisplay, drawX, drawY, drawBackgroundColor)) _flushMouth();
+    _mouthPending = false;
+  }
+  num = _takeDirtyRects(rects, &dirtyFull);
+  if (full || dirtyFull) {
+    makeAvater(drawDisplay, drawX, drawY, drawBackgroundColor);
+    _restoreVacated(drawDisplay, drawBackgroundColor);
+  } else if (num > 0) {
+    _makeAvater(drawDisplay, drawX, drawY, drawBackgroundColor, rects, num);
+  }
+  if (autoLipsyncTbl >= 0 && autoLipsyncTbl < _tableCount) _mouthShownIdx = items[autoLipsyncTbl];
+  // 表情が変わったら、次の口の変更に備えて口タイルを作っておく（リップシンク中の最初の口の変更で作らないように）
+  if (_mouthTilesStale) {
+    _mouthTilesStale = false;
+    _prepareMouthTiles(drawX, drawY, drawBackgroundColor);
   }
-  if (!nowDrawing) {
-    XYWHaddress trim = { x, y, w, h };
-    nowDrawing = true;
-    makeAvaterTrim(drawDisplay, drawX, drawY, drawBackgroundColor, &trim);
-    nowDrawing = false;
+  nowDrawing = false;
+  xSemaphoreGive(_drawMutex);
+}
+
+// 描画タスクにコマンドを送る
+bool Zundavatar::_postRender(RenderCmd cmd, TickType_t wait) {
+  cmd.us = micros();
+  if (xQueueSend(_renderQueue, &cmd, wait) == pdTRUE) return true;
+  renderStat.dropped ++;
+  return false;
+}
+
+// 描画タスクの処理本体
+// キューに溜まっているコマンドをまとめて取り出し、部位の変更を全部反映してから1回だけ描画する
+// クリップの再生中は次のキーフレームの時刻までだけ待ち、キーフレームを反映して描画する
+// フレームクロックを使う場合は、次のフレームの時刻まで描画せずにコマンドを反映し続け、時刻になったら最新の状態を1回だけ描画する。
+// 描画が次のフレームの時刻を過ぎたら、過ぎたフレームは溜めずに飛ばして（数えておき）、その次の時刻に合わせる
+void Zundavatar::_renderLoop() {
+  RenderCmd cmd;
+  bool stop = false;
+  bool pending = false, pendingFull = false;  // 描画待ちのフレームがある
+  uint32_t nextFrameUs = micros();  // 次のフレームの時刻(us)
+  TickType_t wait = portMAX_DELAY;
+  while (!stop) {
+    bool present = false, full = false;
+    uint32_t num = 0, oldest = 0, presents = 0;
+    uint64_t sumUs = 0;
+    if (xQueueReceive(_renderQueue, &cmd, wait) == pdTRUE) {
+      uint32_t depth = uxQueueMessagesWaiting(_renderQueue) + 1;
+      if (depth > renderStat.maxDepth) renderStat.maxDepth = depth;
+      oldest = cmd.us;
+      do {
+        num ++;
+        sumUs += cmd.us;
+        if (cmd.type != RenderCmdType::Parts && cmd.type != RenderCmdType::StopRender && cmd.type != RenderCmdType::Tick) presents ++;
+        if (cmd.type == RenderCmdType::Parts) _changePartsNow(cmd.tbl, cmd.idx);
+        else if (cmd.type == RenderCmdType::Present) present = true;
+        else if (cmd.type == RenderCmdType::PresentFull) present = full = true;
+        else if (cmd.type == RenderCmdType::StopRender) stop = true;
+        else if (cmd.type == RenderCmdType::ApplyExpression) {
+          _applyExpressionNow(cmd.idx);
+          present = true;
+        }
+        else if (cmd.type == RenderCmdType::Mouth) {
+          _changeMouthNow(cmd.idx);
+          present = true;
+        }
+      } while (xQueueReceive(_renderQueue, &cmd, 0) == pdTRUE);
+    }
+    // クリップのキーフレームを反映する（見た目が変わったら描画する）
+    bool changed = false;
+    uint32_t due = tickClips(clipClock(), &changed);
+    if (changed) present = true;
+    wait = (due == UINT32_MAX) ? portMAX_DELAY : pdMS_TO_TICKS(due);
+    if (due > 0 && wait == 0) wait = 1;   // 1tickより近いキーフレームも1tickは待つ（待たずに回り続けないように）
+
+    // 描画待ちのフレームに加える（待っていなかった場合、前のフレームの時刻を過ぎていれば今を次のフレームの時刻にする）
+    uint32_t now = micros();
+    if (present) {
+      if (presents == 0) presents = 1;  // クリップのキーフレーム
+      renderStat.coalesced += pending ? presents : presents - 1;
+      if (!pending && (int32_t)(now - nextFrameUs) > 0) nextFrameUs = now;
+      pending = true;
+      pendingFull |= full;
+    }
+    uint32_t period = (frameRateHz > 0) ? 1000000 / frameRateHz : 0;
+    if (pending && period > 0 && (int32_t)(nextFrameUs - now) > 0) {
+      // まだフレームの時刻になっていない：時刻まで待つ（その間に来たコマンドも反映する）
+      TickType_t untilFrame = pdMS_TO_TICKS((nextFrameUs - now + 999) / 1000);
+      if (untilFrame < wait) wait = untilFrame;
+    } else if (pending) {
+      uint32_t late = now - nextFrameUs;
+      if (period > 0 && late > renderStat.maxLateUs) renderStat.maxLateUs = late;
+      _drawNow(pendingFull, portMAX_DELAY);
+      renderStat.frames ++;
+      pending = pendingFull = false;
+      // 次のフレームの時刻を決める（描画が長引いて過ぎてしまったフレームは飛ばす）
+      nextFrameUs += period;
+      uint32_t end = micros();
+      while (period > 0 && (int32_t)(end - nextFrameUs) >= 0) {
+        nextFrameUs += period;
+        renderStat.missedFrames ++;
+      }
+    }
+    if (num == 0) continue;
+    // 計測：キューに入れてから描画が終わるまでの時間（フレームの時刻まで待っている場合は、待ち始めるまでの時間）
+    now = micros();
+    renderStat.commands += num;
+    renderStat.batches ++;
+    renderStat.totalLatencyUs += (uint64_t)now * num - sumUs;
+    if (now - oldest > renderStat.maxLatencyUs) renderStat.maxLatencyUs = now - oldest;
   }
+
+  // 終了する。終了の直前にキューに入ったコマンドも処理して描画し終えてから、最後に_renderTaskを消す
+  // （以降は呼び出し元で直接描画される。この後でキューに入ったコマンドはstopRenderTask()が処理する）
+  _drainRender(pending, pendingFull);
+  _renderTask = nullptr;
+}
+
+// キューに残っているコマンドを全部反映して、必要なら描画する（描画タスクの終了時用）
+void Zundavatar::_drainRender(bool present, bool full) {
+  RenderCmd cmd;
+  while (xQueueReceive(_renderQueue, &cmd, 0) == pdTRUE) {
+    if (cmd.type == RenderCmdType::Parts) _changePartsNow(cmd.tbl, cmd.idx);
+    else if (cmd.type == RenderCmdType::Present) present = true;
+    else if (cmd.type == RenderCmdType::PresentFull) present = full = true;
+    else if (cmd.type == RenderCmdType::ApplyExpression) {
+      _applyExpressionNow(cmd.idx);
+      present = true;
+    }
+    else if (cmd.type == RenderCmdType::Mouth) {
+      _changeMouthNow(cmd.idx);
+      present = true;
+    }
+  }
+  if (present) _drawNow(full, portMAX_DELAY);
+}
+
+// タスク処理：描画
+void taskRenderLoop(void *args) {
+  DriveContext *ctx = reinterpret_cast<DriveContext *>(args);
+  Zundavatar *avatar = ctx->getZundavatar();
+  avatar->_renderLoop();
+  delete ctx;
+  vTaskDelete(NULL);
+}
+
+// 描画タスクを開始する（以降の部位の変更と描画はすべて描画タスクが行う）
+void Zundavatar::startRenderTask() {
+  if (_renderTask != nullptr) return;
+  if (_renderQueue == nullptr) _renderQueue = xQueueCreate(renderQueueLen, sizeof(RenderCmd));
+  if (_renderQueue == nullptr) return;
+  DriveContext *ctx = new DriveContext(this);
+  TaskHandle_t handle = nullptr;
+  xTaskCreateUniversal(
+    taskRenderLoop,   // Function to implement the task
+    "taskRenderLoop", // Name of the task
+    4096,             // Stack size in words
+    ctx,              // Task input parameter
+    3,                // Priority of the task
+    &handle,          // Task handle.
+    CONFIG_ARDUINO_RUNNING_CORE);
+  _renderTask = handle;
+}
+
+// 描画タスクを終了する（キューに残っているコマンドを処理して描画し終えるまで待つ）
+// 描画タスクが最後にキューを空にした後で、他のタスクが入れたコマンドはここで処理する
+void Zundavatar::stopRenderTask() {
+  if (_renderTask == nullptr || _onRenderTask()) return;
+  _postRender({ RenderCmdType::StopRender, 0, 0, 0 }, portMAX_DELAY);
+  while (_renderTask != nullptr) vTaskDelay(1);
+  _drainRender(false, false);
+}
+
+// 描画タスクの計測結果をクリアする
+void Zundavatar::resetRenderStat() {
+  renderStat = RenderQueueStat();
+}
+
+// 区間ごとの描画時間の計測結果をクリアする
+// 計測結果は描画中（_drawMutexを持っている間）に書き込まれるので、描画が終わるまで待ってからクリアする
+void Zundavatar::resetProfile() {
+  xSemaphoreTake(_drawMutex, portMAX_DELAY);
+  profiler.reset();
+  xSemaphoreGive(_drawMutex);
+}
+
+// 区間の計測結果を求める（描画中なら終わるまで待つ、記録が無ければfalse）
+bool Zundavatar::profileSummary(uint8_t stage, ProfileSummary* out) {
+  xSemaphoreTake(_drawMutex, portMAX_DELAY);
+  bool ok = profiler.summary(stage, out);
+  xSemaphoreGive(_drawMutex);
+  return ok;
+}
+
+// 描画タスクの計測結果をシリアルに出力する
+void Zundavatar::printRenderStat(String title) {
+  uint32_t avg = (renderStat.commands > 0) ? (uint32_t)(renderStat.totalLatencyUs / renderStat.commands) : 0;
+  spf("## %s : commands=%u batches=%u frames=%u maxDepth=%u latency avg=%uus max=%uus dropped=%u\n", title.c_str(),
+      renderStat.commands, renderStat.batches, renderStat.frames, renderStat.maxDepth, avg, renderStat.maxLatencyUs, renderStat.dropped);
+  spf("   frame clock %uHz : coalesced=%u missed=%u late max=%uus\n", frameRateHz, renderStat.coalesced, renderStat.missedFrames, renderStat.maxLateUs);
+}
+
+// クリップを再生する（durationMsで止める、0は最後まで）。戻り値は再生番号（0は空きが無い）
+// キーフレームの反映は描画タスクが行う（描画タスクを使わない場合は呼び出し元でtickClips()を呼ぶ）
+uint32_t Zundavatar::playClip(const Clip* clip, uint32_t durationMs) {
+  if (clip == nullptr || clip->num == 0) return 0;
+  uint16_t channels = 0;
+  for (int i=0; i<clip->num; i++) channels |= _clipChannel(clip->keys[i]);
+  uint32_t now = clipClock();
+  uint32_t id = 0;
+  portENTER_CRITICAL(&_clipMux);
+  for (int i=0; i<clipPlayerMax; i++) {
+    ClipPlayer& p = _clips[i];
+    if (p.clip != nullptr) continue;
+    p.clip = clip;
+    p.id = id = ++_clipId;
+    p.startMs = p.cycleStart = now;
+    p.durationMs = durationMs;
+    p.next = 0;
+    p.channels = channels;
+    break;
+  }
+  portEXIT_CRITICAL(&_clipMux);
+  if (id != 0 && _renderTask != nullptr && !_onRenderTask()) {
+    _postRender({ RenderCmdType::Tick, 0, 0, 0 }, 0);  // 待っている描画タスクを起こす
+  }
+  return id;
+}
+
+// クリップの再生を止める（変更済みの部位はそのまま）
+void Zundavatar::stopClip(uint32_t id) {
+  portENTER_CRITICAL(&_clipMux);
+  for (int i=0; i<clipPlayerMax; i++) {
+    if (_clips[i].clip != nullptr && _clips[i].id == id) _clips[i].clip = nullptr;
+  }
+  portEXIT_CRITICAL(&_clipMux);
+}
+
+// 全てのクリップの再生を止める
+void Zundavatar::stopAllClips() {
+  portENTER_CRITICAL(&_clipMux);
+  for (int i=0; i<clipPlayerMax; i++) _clips[i].clip = nullptr;
+  portEXIT_CRITICAL(&_clipMux);
+}
+
+// クリップが再生中か
+bool Zundavatar::isClipPlaying(uint32_t id) {
+  bool playing = false;
+  portENTER_CRITICAL(&_clipMux);
+  for (int i=0; i<clipPlayerMax; i++) {
+    if (_clips[i].clip != nullptr && _clips[i].id == id) playing = true;
+  }
+  portEXIT_CRITICAL(&_clipMux);
+  return playing;
+}
+
+// キーフレームが動かすもののビットを求める（部位はテーブル番号のビット、スケール・サーボはその後ろ）
+uint16_t Zundavatar::_clipChannel(const ClipKey& k) {
+  if (k.type == ClipKeyType::KeyPart) return 1 << k.tbl;
+  if (k.type == ClipKeyType::KeyScale) return 1 << tableNumZundavatar;
+  return 1 << (tableNumZundavatar + 1);
+}
+
+// そのクリップが今それを動かしてよいか（同じものを動かしている中で優先度が一番高く、後から始めたもの）
+bool Zundavatar::_clipOwns(const ClipPlayer& p, uint16_t bit) {
+  for (int i=0; i<clipPlayerMax; i++) {
+    const ClipPlayer& q = _clips[i];
+    if (q.clip == nullptr || &q == &p || !(q.channels & bit)) continue;
+    if (q.clip->priority > p.clip->priority) return false;
+    if (q.clip->priority == p.clip->priority && q.id > p.id) return false;
+  }
+  return true;
+}
+
+// 時刻nowMsまでのキーフレームを反映する。戻り値は次の反映までの時間(ms)、再生中のクリップが無ければUINT32_MAX
+// 時刻は引数で渡すので、同じ時刻の列を与えれば同じ結果になる。changedには見た目が変わったかを返す
+uint32_t Zundavatar::tickClips(uint32_t nowMs, bool* changed) {
+  ClipKey apply[clipApplyMax];  // 反映するキーフレーム（排他処理の外で反映する）
+  uint16_t applyNum = 0;
+  uint32_t due = UINT32_MAX;
+
+  portENTER_CRITICAL(&_clipMux);
+  for (int i=0; i<clipPlayerMax; i++) {
+    ClipPlayer& p = _clips[i];
+    if (p.clip == nullptr) continue;
+    const Clip* c = p.clip;
+    // 再生する時間が過ぎたら止める
+    if (p.durationMs != 0 && nowMs - p.startMs >= p.durationMs) {
+      p.clip = nullptr;
+      continue;
+    }
+    // 大きく遅れた場合は、途中の周を飛ばして直前の周の終わりから再開する
+    if (c->loop && c->lengthMs > 0 && nowMs - p.cycleStart >= 2 * (uint32_t)c->lengthMs) {
+      p.cycleStart += ((nowMs - p.cycleStart) / c->lengthMs - 1) * c->lengthMs;
+      p.next = c->num;
+    }
+    // 時刻が来たキーフレームを順に取り出す
+    while (applyNum < clipApplyMax) {
+      if (p.next < c->num) {
+        const ClipKey& k = c->keys[p.next];
+        if (nowMs - p.cycleStart < k.ms) break;
+        if (_clipOwns(p, _clipChannel(k))) apply[applyNum++] = k;  // 優先度の高いクリップが動かしているものは飛ばす
+        p.next ++;
+      } else if (nowMs - p.cycleStart < c->lengthMs) {
+        break;
+      } else if (c->loop && c->lengthMs > 0) {
+        p.cycleStart += c->lengthMs;
+        p.next = 0;
+      } else {
+        p.clip = nullptr;  // ループしないクリップは最後まで来たら終わり
+        break;
+      }
+    }
+    if (p.clip == nullptr) continue;
+    // 次に反映する時刻までの時間
+    uint32_t t;
+    if (applyNum >= clipApplyMax) t = 0;
+    else if (p.next < c->num) t = p.cycleStart + c->keys[p.next].ms - nowMs;
+    else t = p.cycleStart + c->lengthMs - nowMs;
+    if (p.durationMs != 0 && p.startMs + p.durationMs - nowMs < t) t = p.startMs + p.durationMs - nowMs;
+    if (t < due) due = t;
+  }
+  portEXIT_CRITICAL(&_clipMux);
+
+  // 取り出したキーフレームを反映する
+  bool visual = false;
+  for (int i=0; i<applyNum; i++) {
+    const ClipKey& k = apply[i];
+    if (k.type == ClipKeyType::KeyPart) {
+      changeParts(PartId(k.tbl), k.idx);
+      visual = true;
+    } else if (k.type == ClipKeyType::KeyScale) {
+      scaleBodyCanvasX = k.x;
+      scaleBodyCanvasY = k.y;
+      markDirtyAll();
+      visual = true;
+    } else if (k.type == ClipKeyType::KeyServo) {
+      if (clipServo != nullptr) clipServo(k.x, k.y);
+    }
+  }
+  if (changed != nullptr) *changed = visual;
+  return due;
 }
 
 // 描画エリアの拡張
@@ -254,8 +1620,10 @@ void Zundavatar::clearEnpandCanvas() {
 // 自動まばたきの設定
 void Zundavatar::setBlink(String name, int16_t idxOpen, int16_t idxClose) {
   autoBlinkName = name;
+  autoBlinkTbl = name2table(name);
   autoBlinkIdx_open = idxOpen;
   autoBlinkIdx_close = idxClose;
+  enableUnderlay(name);   // まばたきする部位の下地をキャッシュする
   //changeParts(name, idxOpen);
 }
 
@@ -264,30 +1632,11 @@ void taskBlinkLoop(void *args) {
   DriveContext *ctx = reinterpret_cast<DriveContext *>(args);
   Zundavatar *avatar = ctx->getZundavatar();
   unsigned long nextms = 0;
-  int16_t body_no, eye_tbl, eye_no, x, y, nowidx;
-  uint16_t w, h, px, pz;
-  XYaddress ofs;
-
-  if (avatar->name2table(avatar->autoBlinkName) != -1) {
-    // 描画範囲を決める
-    eye_no = avatar->nameidx2no(avatar->autoBlinkName, avatar->autoBlinkIdx_open);
-    body_no = avatar->nameidx2no(avatar->defaultBaseBodyName); // 基準となる体のテーブル番号・インデックス番号・画像番号を求める
-    if (body_no == -1) return;
-    ofs = avatar->img_get_offset(avatar->_imgInfo[body_no], avatar->_imgInfo[eye_no]);
-    x = ofs.x;
-    y = ofs.y;
-    w = avatar->_imgInfo[eye_no].width;
-    h = avatar->_imgInfo[eye_no].height;
-
-    // 自動まばたき開始
-    while (avatar->autoBlink) {
-      // 左右反転時は座標を調整する
-      if (avatar->mirrorImage) {
-        px = avatar->_imgInfo[eye_no].posX - avatar->_imgInfo[body_no].posX;
-        pz = avatar->_imgInfo[body_no].width - avatar->_imgInfo[eye_no].width - px;
-        x = x - pz - px;  // 間違いのはずがなぜか正しく動く??よくわからんがヨシ！
-      }
+  int16_t nowidx;
 
+  if (avatar->autoBlinkTbl != -1) {
+    // 自動まばたき開始（描画範囲はchangeParts()で登録される）
+    while (avatar->autoBlink) {
       // 閉じる
       nowidx = avatar->autoBlinkIdx_open;
       nextms = millis() + avatar->blink_wait1 + random(0, avatar->blink_wait2);
@@ -295,15 +1644,15 @@ void taskBlinkLoop(void *args) {
         if (!avatar->autoBlink) break;
         // 待機中に自動まばたきの目が変わったら即座に反映させる
         if (nowidx != avatar->autoBlinkIdx_open) {
-          avatar->changeParts(avatar->autoBlinkName, avatar->autoBlinkIdx_open); // 開く
-          avatar->drawAvatarTrim(x, y, w, h, true);  // 変更部分だけを描画する、排他処理あり
+          avatar->changeParts(PartId(avatar->autoBlinkTbl), avatar->autoBlinkIdx_open); // 開く
+          avatar->drawAvatarDirty(true);  // 変更部分だけを描画する、排他処理あり
           nowidx = avatar->autoBlinkIdx_open;
         }
         vTaskDelay(pdMS_TO_TICKS(5));
       }
       if (!avatar->autoBlink) break;
-      avatar->changeParts(avatar->autoBlinkName, avatar->autoBlinkIdx_close); // 閉じる
-      avatar->drawAvatarTrim(x, y, w, h, true);  // 変更部分だけを描画する、排他処理あり
+      avatar->changeParts(PartId(avatar->autoBlinkTbl), avatar->autoBlinkIdx_close); // 閉じる
+      avatar->drawAvatarDirty(true);  // 変更部分だけを描画する、排他処理あり
       // 開く
       nextms = millis() + avatar->blink_wait3;
       while (nextms > millis()) {
@@ -311,18 +1660,20 @@ void taskBlinkLoop(void *args) {
         vTaskDelay(pdMS_TO_TICKS(5));
       }
       if (!avatar->autoBlink) break;
-      avatar->changeParts(avatar->autoBlinkName, avatar->autoBlinkIdx_open); // 開く
-      avatar->drawAvatarTrim(x, y, w, h, true);  // 変更部分だけを描画する、排他処理あり
+      avatar->changeParts(PartId(avatar->autoBlinkTbl), avatar->autoBlinkIdx_open); // 開く
+      avatar->drawAvatarDirty(true);  // 変更部分だけを描画する、排他処理あり
     }
   }
+  delete ctx;
+  avatar->blinkTask = nullptr;
   vTaskDelete(NULL);
 }
 
 // 自動まばたきを開始する
 void Zundavatar::startAutoBlink() {
-  DriveContext *ctx = new DriveContext(this);
-  if (!autoBlink && name2table(autoBlinkName) != -1) {
+  if (!autoBlink && blinkTask == nullptr && autoBlinkTbl != -1) {
     // タスクを作成する
+    DriveContext *ctx = new DriveContext(this);
     autoBlink = true;
     xTaskCreateUniversal(
       taskBlinkLoop,  // Function to implement the task
@@ -330,23 +1681,25 @@ void Zundavatar::startAutoBlink() {
       2048,           // Stack size in words
       ctx,            // Task input parameter
       3,              // Priority of the task
-      NULL,           // Task handle.
+      (TaskHandle_t*)&blinkTask,  // Task handle.（タスクが動き出す前に設定される）
       CONFIG_ARDUINO_RUNNING_CORE);
   }
 }
 
-// 自動まばたきを終了する
+// 自動まばたきを終了する（タスクが終了するまで待つ。終了後は画像データを入れ替えてもよい）
 void Zundavatar::stopAutoBlink() {
-  if (autoBlink) {
-    // タスクを削除する（実際はタスク内で処理）
-    autoBlink = false;
-  }
+  // タスクを削除する（実際はタスク内で処理）
+  autoBlink = false;
+  while (blinkTask != nullptr) vTaskDelay(1);
 }
 
 // リップシンクの設定
 void Zundavatar::setLipsync(String name, int16_t aa, int16_t ii, int16_t uu, int16_t ee, int16_t oo, int16_t nn) {
-  if (name2table(name) != -1) {
+  int16_t tbl = name2table(name);
+  if (tbl != -1) {
     autoLipsyncName = name;
+    autoLipsyncTbl = tbl;
+    enableUnderlay(name);   // リップシンクする部位の下地をキャッシュする
     autoLipsyncIdxs[0] = aa;
     autoLipsyncIdxs[1] = ii;
     autoLipsyncIdxs[2] = uu;
@@ -358,41 +1711,126 @@ void Zundavatar::setLipsync(String name, int16_t aa, int16_t ii, int16_t uu, int
   }
 }
 
+// 表情セットを作成する（同じ名前があれば作り直す）。戻り値は表情セットの番号（-1は空きが無い）
+// 作成直後は何も変更しない表情セットなので、setExpressionParts()などで変更する内容を加えていく
+int16_t Zundavatar::createExpression(String name) {
+  int16_t no = _expressionNo(name);
+  if (no == -1) {
+    for (int i=0; i<expressionMax; i++) {
+      if (expressions[i].name == "") {
+        no = i;
+        break;
+      }
+    }
+  }
+  if (no == -1) return -1;
+  ExpressionSet& e = expressions[no];
+  e.name = name;
+  for (int i=0; i<tableNumZundavatar; i++) e.items[i] = -2;
+  e.blinkOpen = e.blinkClose = -2;
+  for (int i=0; i<6; i++) e.lipsyncIdxs[i] = -2;
+  return no;
+}
+
+// 表情セットの番号を求める
+int16_t Zundavatar::_expressionNo(String expr) {
+  if (expr == "") return -1;
+  for (int i=0; i<expressionMax; i++) {
+    if (expressions[i].name == expr) return i;
+  }
+  return -1;
+}
+
+// 表情セットに部位のインデックス番号を設定する
+void Zundavatar::setExpressionParts(String expr, String name, int16_t idx) {
+  int16_t no = _expressionNo(expr);
+  uint16_t tbl = name2table(name);
+  if (no == -1 || tbl >= _tableCount) return;
+  expressions[no].items[tbl] = idx;
+}
+
+// 表情セットにまばたきの設定を加える（まばたきの部位はsetBlink()で設定したもの）
+void Zundavatar::setExpressionBlink(String expr, int16_t idxOpen, int16_t idxClose) {
+  int16_t no = _expressionNo(expr);
+  if (no == -1) return;
+  expressions[no].blinkOpen = idxOpen;
+  expressions[no].blinkClose = idxClose;
+}
+
+// 表情セットにリップシンクの設定を加える（リップシンクの部位はsetLipsync()で設定したもの）
+void Zundavatar::setExpressionLipsync(String expr, int16_t aa, int16_t ii, int16_t uu, int16_t ee, int16_t oo, int16_t nn) {
+  int16_t no = _expressionNo(expr);
+  if (no == -1) return;
+  int16_t* idxs = expressions[no].lipsyncIdxs;
+  idxs[0] = aa;
+  idxs[1] = ii;
+  idxs[2] = uu;
+  idxs[3] = ee;
+  idxs[4] = oo;
+  idxs[5] = nn;
+}
+
+// 表情セットを反映する（まとめて切り替えて、変わった範囲を1回だけ描画する）
+// 描画タスク実行中は1つのコマンドで送るので、途中でまばたき・リップシンクの変更が割り込んで中途半端な表情が描画されることはない
+bool Zundavatar::apllyExpression(String expr) {
+  int16_t no = _expressionNo(expr);
+  if (no == -1) return false;
+  if (_renderTask != nullptr && !_onRenderTask()) {
+    _postRender({ RenderCmdType::ApplyExpression, 0, no, 0 }, portMAX_DELAY);  // 表情の変更は捨てられないので空くまで待つ
+  } else {
+    _applyExpressionNow(no);
+    _drawNow(false, pdMS_TO_TICKS(100));
+  }
+  return true;
+}
+
+// 表情セットを反映する（描画タスクまたは描画タスク無しの場合）
+void Zundavatar::_applyExpressionNow(int16_t no) {
+  const ExpressionSet& e = expressions[no];
+  for (int tbl=0; tbl<_tableCount; tbl++) {
+    if (e.items[tbl] != -2) _changePartsNow(tbl, e.items[tbl]);
+  }
+  // まばたき：目の指定が無ければ開いた目にする（まばたきタスクが後から別に描き直さないように）
+  if (e.blinkOpen != -2) {
+    autoBlinkIdx_open = e.blinkOpen;
+    autoBlinkIdx_close = e.blinkClose;
+    if (autoBlinkTbl >= 0 && autoBlinkTbl < _tableCount && e.items[autoBlinkTbl] == -2) _changePartsNow(autoBlinkTbl, e.blinkOpen);
+  }
+  // リップシンク：次に母音が変わったときから新しい口になる
+  if (e.lipsyncIdxs[0] != -2) {
+    for (int i=0; i<6; i++) autoLipsyncIdxs[i] = e.lipsyncIdxs[i];
+  }
+  _mouthTilesStale = autoLipsync;  // 描画の後に口タイルを作り直す
+}
+
 // リップシンクの母音と自動的に口を閉じるまでの時間を設定する（設定すると即反映される）
 void Zundavatar::setLipsyncVowel(Vowel vowel, int16_t lipWaitTmp) {
   autoLipsyncNowVowel = vowel;
   if (lipWaitTmp > 0) lip_waittmp = lipWaitTmp;
 }
 
+// リップシンクの口を変更して描画する（口タイルが使えれば転送1回だけで描画する、描画タスク実行中はキュー経由）
+void Zundavatar::changeMouth(int16_t idx) {
+  if (autoLipsyncTbl < 0 || autoLipsyncTbl >= _tableCount) return;
+  if (_renderTask != nullptr && !_onRenderTask()) {
+    _postRender({ RenderCmdType::Mouth, autoLipsyncTbl, idx, 0 }, portMAX_DELAY);  // 口の変更は捨てられないので空くまで待つ
+  } else {
+    _changeMouthNow(idx);
+    _drawNow(false, pdMS_TO_TICKS(100));
+  }
+}
+
 // タスク処理：リップシンク
 void taskLipsyncLoop(void *args) {
   DriveContext *ctx = reinterpret_cast<DriveContext *>(args);
   Zundavatar *avatar = ctx->getZundavatar();
   unsigned long nextms = 0;
-  int16_t body_no, mouth_tbl, mouth_no, x, y, idx;
-  uint16_t w, h, px, pz;
-  XYaddress ofs;
+  int16_t idx;
   Vowel lastLip = Vowel::null;
 
-  if (avatar->name2table(avatar->autoLipsyncName) != -1) {
-    // 描画範囲を決める
-    mouth_no = avatar->nameidx2no(avatar->autoLipsyncName, avatar->autoLipsyncIdxs[0]);
-    body_no = avatar->nameidx2no(avatar->defaultBaseBodyName); // 基準となる体のテーブル番号・インデックス番号・画像番号を求める
-    if (body_no == -1) return;
-    ofs = avatar->img_get_offset(avatar->_imgInfo[body_no], avatar->_imgInfo[mouth_no]);
-    x = ofs.x;
-    y = ofs.y;
-    w = avatar->_imgInfo[mouth_no].width;
-    h = avatar->_imgInfo[mouth_no].height;
-
-    // リップシンク開始
+  if (avatar->autoLipsyncTbl != -1) {
+    // リップシンク開始（描画範囲はchangeParts()で登録される）
     while (avatar->autoLipsync) {
-      // 左右反転時は座標を調整する
-      if (avatar->mirrorImage) {
-        px = avatar->_imgInfo[mouth_no].posX - avatar->_imgInfo[body_no].posX;
-        pz = avatar->_imgInfo[body_no].width - avatar->_imgInfo[mouth_no].width - px;
-        x = x - pz - px;  // 間違いのはずがなぜか正しく動く??よくわからんがヨシ！
-      }
       if (avatar->autoLipsyncNowVowel != lastLip) {
         // 指定した口の形を表示する
         if (avatar->autoLipsyncNowVowel == Vowel::a) idx = avatar->autoLipsyncIdxs[0];
@@ -403,8 +1841,7 @@ void taskLipsyncLoop(void *args) {
         else if (avatar->autoLipsyncNowVowel == Vowel::n) idx = avatar->autoLipsyncIdxs[5];
         else idx = -1;
         lastLip = avatar->autoLipsyncNowVowel;
-        avatar->changeParts(avatar->autoLipsyncName, idx);
-        avatar->drawAvatarTrim(x, y, w, h, true);  // 変更部分だけを描画する、排他処理あり
+        avatar->changeMouth(idx);  // 口タイルがあれば転送するだけ、排他処理あり
         if (avatar->lip_waittmp > 0) {
           nextms = millis() + avatar->lip_waittmp;
           avatar->lip_waittmp = 0;
@@ -416,21 +1853,22 @@ void taskLipsyncLoop(void *args) {
         avatar->autoLipsyncNowVowel = Vowel::n;
         idx = avatar->autoLipsyncIdxs[5];
         lastLip = Vowel::n;
-        avatar->changeParts(avatar->autoLipsyncName, idx);
-        avatar->drawAvatarTrim(x, y, w, h, true);  // 変更部分だけを描画する、排他処理あり
+        avatar->changeMouth(idx);  // 口タイルがあれば転送するだけ、排他処理あり
         nextms = 0;
       }
       vTaskDelay(pdMS_TO_TICKS(5));
     }
   }
+  delete ctx;
+  avatar->lipsyncTask = nullptr;
   vTaskDelete(NULL);
 }
 
 // リップシンクを開始する
 void Zundavatar::startAutoLipsync() {
-  DriveContext *ctx = new DriveContext(this);
-  if (!autoLipsync && name2table(autoLipsyncName) != -1) {
+  if (!autoLipsync && lipsyncTask == nullptr && autoLipsyncTbl != -1) {
     // タスクを作成する
+    DriveContext *ctx = new DriveContext(this);
     autoLipsync = true;
     xTaskCreateUniversal(
       taskLipsyncLoop,  // Function to implement the task
@@ -438,17 +1876,16 @@ void Zundavatar::startAutoLipsync() {
       2048,             // Stack size in words
       ctx,              // Task input parameter
       2,                // Priority of the task
-      NULL,             // Task handle.
+      (TaskHandle_t*)&lipsyncTask,  // Task handle.（タスクが動き出す前に設定される）
       CONFIG_ARDUINO_RUNNING_CORE);
   }
 }
 
-// リップシンクを終了する
+// リップシンクを終了する（タスクが終了するまで待つ。終了後は画像データを入れ替えてもよい）
 void Zundavatar::stopAutoLipsync() {
-  if (autoLipsync) {
-    // タスクを削除する（実際はタスク内で処理）
-    autoLipsync = false;
-  }
+  // タスクを削除する（実際はタスク内で処理）
+  autoLipsync = false;
+  while (lipsyncTask != nullptr) vTaskDelay(1);
 }
 
 
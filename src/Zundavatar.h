@@ -8,6 +8,9 @@
 */
 #pragma once
 #include <M5GFX.h>
+#include "ZundavatarBlit.h"
+#include "ZundavatarCodec.h"
+#include "ZundavatarProfile.h"
 
 // デバッグに便利なマクロ定義 --------
 #define sp(x) Serial.println(x)
@@ -18,6 +21,15 @@ namespace zundavatar {
 
 // 定数
 static constexpr uint16_t tableNumZundavatar = 10;  // 登録可能な部位の種類の上限
+static_assert(tableNumZundavatar <= profileLayerMax, "profileLayerMax must cover every table");
+static constexpr uint16_t dirtyRectMax = 8;         // 再描画範囲の登録数の上限
+static constexpr uint16_t underlayMax = 2;          // 下地キャッシュを作れる部位の数の上限
+static constexpr uint16_t boyonCacheMax = 8;        // 変形キャッシュの登録数の上限
+static constexpr uint16_t decodeCacheMax = 32;      // 展開キャッシュの登録数の上限
+static constexpr uint16_t renderQueueLen = 32;      // 描画タスクのコマンドキューの長さ
+static constexpr uint16_t expressionMax = 8;        // 登録できる表情セットの数の上限
+static constexpr uint16_t clipPlayerMax = 4;        // 同時に再生できるクリップの数の上限
+static constexpr uint16_t clipApplyMax = 16;        // 1回の更新で反映するキーフレームの数の上限（残りは続けて反映する）
 
 // 構造体など
 struct ImageInfo {  // 画像データの構造体
@@ -28,9 +40,143 @@ struct ImageInfo {  // 画像データの構造体
   const uint16_t posX;
   const uint16_t posY;
   const unsigned short transparent;
+  const uint16_t* span;       // スパン形式の画像データ（無い場合はnullptr）
+  const uint32_t* spanRows;   // スパン形式の各行の開始位置
+  const uint8_t* index;       // パレット形式の画像データ（1ピクセル1バイト、0は透明。無い場合はnullptr）
+  const uint16_t* palette;    // パレット形式の色の表（256色、バイトスワップ済み。キャラクターごとに共通）
+  const uint8_t* packed;      // 圧縮形式の画像データ（初めて使うときに展開キャッシュに展開する。無い場合はnullptr）
+  const uint32_t packedSize;  // 圧縮形式の画像データのバイト数
 };
 struct XYaddress { int16_t x; int16_t y; };
 struct XYWHaddress { int16_t x; int16_t y; int16_t w; int16_t h; };
+struct PartId {  // 部位ID（テーブル番号）。画像変換ツールが部位ごとに定数として出力する（例 imgPart::Mouth）
+  uint8_t tbl;
+  constexpr explicit PartId(uint8_t t) : tbl(t) {}
+};
+struct DrawItem {  // 合成する部位の画像番号と配置先
+  int16_t no = -1;          // 画像番号（-1は表示しない）
+  XYWHaddress rect = { 0, 0, 0, 0 };  // キャンバス上の範囲
+};
+struct FrameStat {  // フレーム時間の計測結果
+  uint32_t frames = 0;    // 描画したフレーム数
+  uint32_t totalUs = 0;   // 合計時間(us)
+  uint32_t maxUs = 0;     // 最大時間(us)
+  uint32_t lastUs = 0;    // 直前のフレームの時間(us)
+  uint32_t pixels = 0;    // 合成し直したピクセル数の合計
+  uint32_t lastPixels = 0;  // 直前のフレームで合成し直したピクセル数
+  uint32_t renderUs = 0;    // 合成・変形にかかった時間の合計(us)
+  uint32_t pushUs = 0;      // 出力先への転送にかかった時間の合計(us)
+  uint32_t waitUs = 0;      // うち、転送用バッファの空きを待った時間の合計(us)
+  uint32_t overlapUs = 0;   // DMA転送中に並行して合成・コピーしていた時間の合計(us)
+  uint32_t cacheHits = 0;   // 変形キャッシュが使えた回数
+  uint32_t cacheMisses = 0; // 変形キャッシュが無くて合成した回数
+  uint32_t decodeHits = 0;    // 展開キャッシュが使えた回数
+  uint32_t decodeMisses = 0;  // 圧縮形式の画像を展開した回数
+  uint32_t mouthTileHits = 0;   // リップシンクを口タイルの転送だけで描画した回数
+  uint32_t mouthTileBuilds = 0; // 口タイルを作り直した回数
+};
+struct UnderlayCache {  // 下地キャッシュ（動く部位より下の部位だけを合成済みの画像）
+  int16_t tbl = -1;         // 動く部位のテーブル番号（これより下の部位が合成済み）
+  XYWHaddress rect = { 0, 0, 0, 0 };  // キャッシュする範囲（キャンバスの物理座標）
+  uint16_t* buf = nullptr;  // 合成済みの画像
+  bool valid = false;       // キャッシュが有効
+  int16_t keyItems[tableNumZundavatar]; // 作成時の下の部位のインデックス番号
+  unsigned short keyBgColor = 0;        // 作成時の背景色
+  bool keyMirror = false;               // 作成時の左右反転
+  XYaddress keyOrg = { 0, 0 };          // 作成時のキャンバス上の体の位置
+  XYaddress keyBgPos = { 0, 0 };        // 作成時の背景画像上の位置（背景画像を使わない場合は0,0）
+};
+struct MouthTiles {  // 口タイル（リップシンクの口の形ごとに、口の範囲を背景と全ての部位まで合成した不透明な画像）
+  XYWHaddress rect = { 0, 0, 0, 0 };  // タイルの範囲（キャンバスの物理座標、リップシンクの口の画像を全て含む）
+  uint16_t* buf = nullptr;  // 合成済みの画像（口の形の順に6枚並べる）
+  uint32_t bytes = 0;       // 確保済みのバイト数
+  bool valid = false;       // タイルが有効
+  int16_t keyIdxs[6];       // 作成時の口のインデックス番号（あ,い,う,え,お,ん）
+  int16_t keyItems[tableNumZundavatar]; // 作成時の各部位のインデックス番号（口は見ない）
+  unsigned short keyBgColor = 0;        // 作成時の背景色
+  bool keyMirror = false;               // 作成時の左右反転
+  XYaddress keyOrg = { 0, 0 };          // 作成時のキャンバス上の体の位置
+  XYaddress keyBgPos = { 0, 0 };        // 作成時の背景画像上の位置（背景画像を使わない場合は0,0）
+  uint16_t keyW = 0, keyH = 0;          // 作成時のキャンバスの大きさ
+};
+enum RenderCmdType : uint8_t { Parts, Present, PresentFull, StopRender, Tick, ApplyExpression, Mouth };  // 描画タスクへのコマンドの種類（Tickはクリップの更新、Mouthはリップシンクの口の変更と描画）
+struct RenderCmd {  // 描画タスクへのコマンド
+  RenderCmdType type;
+  int16_t tbl;    // Parts：テーブル番号
+  int16_t idx;    // Parts：インデックス番号、ApplyExpression：表情セットの番号
+  uint32_t us;    // キューに入れた時刻(us)
+};
+struct RenderQueueStat {  // 描画タスクの計測結果
+  uint32_t commands = 0;    // 処理したコマンド数
+  uint32_t batches = 0;     // まとめて処理した回数
+  uint32_t frames = 0;      // 描画したフレーム数
+  uint32_t maxDepth = 0;    // キューに溜まっていたコマンド数の最大
+  uint64_t totalLatencyUs = 0;  // キューに入れてから処理が終わるまでの時間の合計(us)
+  uint32_t maxLatencyUs = 0;    // 〃 最大(us)
+  uint32_t dropped = 0;     // キューが一杯で入れられなかった描画コマンドの数
+  uint32_t coalesced = 0;   // 描画待ちのフレームにまとめた描画の要求の数（途中の状態は描画しない）
+  uint32_t missedFrames = 0;  // 描画が間に合わずに飛ばしたフレームの時刻の数
+  uint32_t maxLateUs = 0;   // フレームの時刻から描画を始めるまでの遅れの最大(us)
+};
+struct PresentStat {  // 1フレーム分の転送時間の計測用
+  uint32_t pushUs = 0;
+  uint32_t waitUs = 0;
+  uint32_t overlapUs = 0;
+};
+struct BoyonCache {  // 変形キャッシュ（ボヨンなどで変形させた後の画像）
+  uint16_t* buf = nullptr;  // 変形済みの画像（体の範囲だけ）
+  uint32_t bytes = 0;       // 画像のバイト数
+  uint32_t stamp = 0;       // 最後に使った順番（小さいものから捨てる）
+  float keyScaleX = 1.0;    // 作成時の横方向の倍率
+  float keyScaleY = 1.0;    // 作成時の縦方向の倍率
+  int16_t keyItems[tableNumZundavatar]; // 作成時の各部位のインデックス番号
+  unsigned short keyBgColor = 0;        // 作成時の背景色
+  bool keyMirror = false;               // 作成時の左右反転
+  bool keyAntiAliases = false;          // 作成時のアンチエイリアス
+  XYaddress keyOrg = { 0, 0 };          // 作成時のキャンバス上の体の位置
+  XYaddress keyBgPos = { 0, 0 };        // 作成時の背景画像上の位置（背景画像を使わない場合は0,0）
+  uint16_t keyW = 0, keyH = 0;          // 作成時の体の範囲の大きさ
+};
+struct DecodeCache {  // 展開キャッシュ（圧縮形式の画像を展開したもの）
+  int16_t no = -1;          // 画像番号（-1は空き）
+  uint16_t* buf = nullptr;  // 展開した画像（バイトスワップ済み）
+  uint32_t bytes = 0;       // 画像のバイト数
+  uint32_t stamp = 0;       // 最後に使った順番（小さいものから捨てる）
+};
+struct ExpressionSet {  // 表情セット（部位のインデックス番号と、まばたき・リップシンクの設定をまとめて切り替える）
+  String name = "";                   // 表情セットの名前（空は未使用）
+  int16_t items[tableNumZundavatar];  // 部位ごとのインデックス番号（-2は変更しない）
+  int16_t blinkOpen = -2;             // まばたき：開いた目のインデックス番号（-2は変更しない）
+  int16_t blinkClose = -2;            // まばたき：閉じた目のインデックス番号
+  int16_t lipsyncIdxs[6];             // リップシンク：口のインデックス番号（あ,い,う,え,お,ん）（[0]が-2は変更しない）
+};
+enum ClipKeyType : uint8_t { KeyPart, KeyScale, KeyServo };  // キーフレームで変更するもの
+struct ClipKey {  // キーフレーム（クリップの周の開始からms後に、部位・スケール・サーボのどれかを変更する）
+  uint16_t ms;        // 周の開始からの時刻(ms)
+  ClipKeyType type;
+  int16_t tbl;        // KeyPart：テーブル番号
+  int16_t idx;        // KeyPart：インデックス番号
+  float x, y;         // KeyScale：倍率、KeyServo：頭の位置(-1.0～1.0)
+  static ClipKey part(uint16_t ms, PartId p, int16_t idx) { return { ms, KeyPart, p.tbl, idx, 0, 0 }; }
+  static ClipKey scale(uint16_t ms, float x, float y) { return { ms, KeyScale, -1, 0, x, y }; }
+  static ClipKey servo(uint16_t ms, float x, float y) { return { ms, KeyServo, -1, 0, x, y }; }
+};
+struct Clip {  // クリップ（時刻順に並べたキーフレームの列）
+  const ClipKey* keys;
+  uint16_t num;         // キーフレームの数
+  uint16_t lengthMs;    // 1周の長さ(ms)（ループしない場合はこの時間で終わる）
+  bool loop;            // ループ再生する
+  uint8_t priority;     // 優先度（同じものを動かすクリップが重なったら、優先度が高い方・後から始めた方が勝つ）
+};
+struct ClipPlayer {  // 再生中のクリップの状態
+  const Clip* clip = nullptr;   // 再生中のクリップ（nullptrは空き）
+  uint32_t id = 0;          // 再生番号（playClip()の戻り値、後から始めたものほど大きい）
+  uint32_t startMs = 0;     // 再生を始めた時刻(ms)
+  uint32_t cycleStart = 0;  // 今の周の開始時刻(ms)
+  uint32_t durationMs = 0;  // 再生する時間(ms)（0は最後まで、ループの場合は止めるまで）
+  uint16_t next = 0;        // 次に反映するキーフレーム
+  uint16_t channels = 0;    // 動かすもののビット（部位はテーブル番号のビット、スケール・サーボはその後ろ）
+};
 enum Vowel : uint8_t { null, a, i, u, e, o, n };  // リップシンク用の母音
 
 //
@@ -43,6 +189,7 @@ public:
   uint16_t tableNum = tableNumZundavatar;   // 登録可能な部位の種類の上限
   String _tableNames[tableNumZundavatar];   // 部位の名前一覧
   uint16_t* _imgTables[tableNumZundavatar]; // その部位に対応する配列へのポインタ
+  const XYaddress* _imgOffsets[tableNumZundavatar]; // その部位の各画像の相対位置の表（無い場合はnullptr）
 
   /* テーブル変数の構成
   * _imgTables[ テーブル番号(tbl) ] = { 画像番号(no), 画像番号(no), 画像番号(no) }
@@ -52,15 +199,18 @@ public:
 
   // 表示するパーツに関する情報、動かすパーツの指定など
   int16_t items[tableNumZundavatar];    // 部位ごとの表示させるインデックス番号
-  M5Canvas canvas_body, canvas_body2;   // 一時利用するキャンバス
+  M5Canvas canvas_body, canvas_body2;   // 合成用のキャンバス（一度確保したら使い回す）
+  uint16_t canvasWidth = 0;     // 確保済みキャンバスの幅
+  uint16_t canvasHeight = 0;    // 確保済みキャンバスの高さ
+  bool reuseCanvas = true;      // キャンバスを使い回す（falseは毎フレーム確保・解放する旧方式、ベンチマーク用）
 
   bool expandCanvas = false;                        // 体のキャンバスサイズを変更する
   XYWHaddress expandCanvasInfo = { 0, 0, 0, 0 };    // 体のキャンバスサイズの変更内容
   bool usePsram = true;         // PSRAMを使う
   bool useAntiAliases = false;  // アンチエイリアスを使う
-  bool mirrorImage = false;     // 左右反転
-  uint16_t rotateMirrorOff = 0; // 左右反転なし時のsetRotation値
-  uint16_t rotateMirrorOn = 6;  // 左右反転あり時のsetRotation値
+  bool useSpanImage = true;     // スパン形式の画像データがあればそちらを使う
+  bool useIndexedImage = true;  // パレット形式の画像データがあればそちらを使う（スパン形式を使う場合はスパン形式が優先）
+  bool mirrorImage = false;     // 左右反転（画像を反転しながら合成する。キャンバスは回転させない）
   unsigned short transparentDefault = 0x0000; // デフォルトの透明色（実際は0x2000）
   float scaleBodyCanvasX = 1.0; // アバターの表示スケールX
   float scaleBodyCanvasY = 1.0; // アバターの表示スケールY
@@ -70,29 +220,75 @@ public:
   unsigned short drawBackgroundColor = 0x0000;  // 出力時の透明色
   String defaultBaseBodyName = "body";  // 基準となる体のテーブル名
 
-  //bool drawBackground = false;        // 背景を読み込む（未作成）
-  //const unsigned short* drawBackgroundImageData;  // 背景のデータ（未作成）
+  // 背景画像（背景色の代わりに、出力先の座標に置いた画像でアバターの背景を埋める。移動したときは空いた範囲だけ描き直す）
+  const ImageInfo* backgroundInfo = nullptr;  // 背景画像の短冊（画像変換ツール psdsplit_rgb565.py の出力。通常の形式の画像データだけ使う）
+  uint16_t backgroundNum = 0;                 // 短冊の数（0は背景画像なし）
+  XYaddress backgroundPos = { 0, 0 };         // 背景画像の出力先の座標（短冊はここからposX,posYの位置に置く）
 
   // 状態
   bool nowDrawing = false;        // 描画中はtrueになる
+  FrameStat frameStat;            // フレーム時間の計測結果
+  RenderQueueStat renderStat;     // 描画タスクの計測結果
+  RenderProfiler profiler;        // 区間ごとの描画時間の計測結果（ZUNDAVATAR_PROFILE=0では何もしない）
+
+  // フレームクロック（描画タスクは描画の要求を次のフレームの時刻まで溜めておき、1フレームに1回だけ描画する）
+  uint16_t frameRateHz = 30;      // フレームレート(Hz)（0は要求があり次第すぐに描画する）
+
+  // 再描画範囲（changeParts()で変化した部分を登録しておき、次の描画でまとめて描画する）
+  uint16_t dirtyMergeSlack = 512; // 統合すると増えるピクセル数がこれ以下なら、重なっていなくても統合する
+
+  // 下地キャッシュ（まばたき・リップシンクのときに下の部位を合成し直さないようにする）
+  bool useUnderlayCache = true;       // 下地キャッシュを使う
+  uint32_t underlayMaxPixels = 16384; // 下地キャッシュ1つあたりの最大ピクセル数
+  UnderlayCache underlays[underlayMax]; // 下地キャッシュ
+
+  // DMA転送（内蔵RAMの転送用バッファを2つ交互に使い、転送中に次の内容を用意する）
+  bool useDmaPresent = true;          // 出力にDMA転送を使う（背景色が透明色でない場合のみ）
+  uint16_t presentBandLines = 16;     // 1回に転送する行数
+
+  // 変形キャッシュ（ボヨンで同じ変形を繰り返すときに、合成と変形をやり直さないようにする）
+  bool useBoyonCache = true;          // 変形キャッシュを使う
+  uint32_t boyonCacheMaxBytes = 600*1024; // 変形キャッシュ全体で使うメモリの上限（超えたら古いものから捨てる）
+  BoyonCache boyonCaches[boyonCacheMax];  // 変形キャッシュ
+
+  // 展開キャッシュ（圧縮形式の画像は、初めて使うときに展開して使い回す。表示中の部位とまばたき・リップシンクの画像はなるべく捨てない）
+  bool usePackedImage = true;         // 圧縮形式の画像データがあればそちらを使う（スパン形式・パレット形式を使う場合はそちらが優先）
+  uint32_t decodeCacheMaxBytes = 512*1024;  // 展開キャッシュ全体で使うメモリの上限（超えたら使っていないものから捨てる。一番大きい画像より大きくすること）
+  DecodeCache decodeCaches[decodeCacheMax]; // 展開キャッシュ
+
+  // 口タイル（表情が変わったら、リップシンクの6つの口の形ごとに口の範囲を合成しておき、口の変更は1枚の不透明な画像の転送だけにする）
+  bool useMouthTiles = true;          // 口タイルを使う（背景色が透明色の場合と変形中は使わない）
+  uint32_t mouthTileMaxPixels = 8192; // 口タイル1枚あたりの最大ピクセル数
+  MouthTiles mouthTiles;              // 口タイル
 
   // 自動まばたき関連
   String autoBlinkName = "";      // 自動まばたきのテーブル名
+  int16_t autoBlinkTbl = -1;      // 自動まばたきのテーブル番号
   int16_t autoBlinkIdx_open = 0;  // 自動まばたき：目のインデックス番号 OPEN
   int16_t autoBlinkIdx_close = 0; // 自動まばたき：目のインデックス番号 CLOSE
   bool autoBlink = false;         // 自動まばたきの有効化
+  volatile TaskHandle_t blinkTask = nullptr;  // 自動まばたきのタスク（終了する時にタスク内でnullptrにする）
   uint16_t blink_wait1 = 2000;    // まばたきの間隔：固定分
   uint16_t blink_wait2 = 1000;    // まばたきの間隔：ランダム分
   uint16_t blink_wait3 = 150;     // まばたきの長さ
 
   // リップシンク関連
   String autoLipsyncName = "";    // リップシンクのテーブル名
+  int16_t autoLipsyncTbl = -1;    // リップシンクのテーブル番号
   int16_t autoLipsyncIdxs[6];     // リップシンク：口のインデックス番号（あ,い,う,え,お,ん）
   bool autoLipsync = false;       // リップシンクの有効化
+  volatile TaskHandle_t lipsyncTask = nullptr;  // リップシンクのタスク（終了する時にタスク内でnullptrにする）
   Vowel autoLipsyncNowVowel = Vowel::null;  // 現在表示中の母音
   uint16_t lip_wait = 150;        // 口を開けている時間
   uint16_t lip_waittmp = 0;       // 口を開けている時間（1回限り）
 
+  // 表情セット
+  ExpressionSet expressions[expressionMax]; // 登録された表情セット
+
+  // クリップ（キーフレームアニメーション）描画タスクがキーフレームの時刻に合わせて反映する
+  unsigned long (*clipClock)() = millis;  // クリップの時計（単調増加するms、テストでは差し替えられる）
+  void (*clipServo)(float x, float y) = nullptr;  // サーボのキーフレームで呼ぶ関数（描画タスクから呼ばれる）
+
   // メンバ関数 public:
   Zundavatar();
   ~Zundavatar() = default;
@@ -100,11 +296,36 @@ public:
   uint16_t name2table(String name);   // 部位名からテーブル番号を求める
   uint16_t nameidx2no(String name, int16_t idxOrDefault=-1);    // 部位名・インデックス番号から画像番号を求める（インデックス番号省略時はitems[]を参照）
   void setImageData(const ImageInfo* imgInfo, String* tableNames, uint16_t* imgTables[], size_t len); // 画像データとテーブル情報を登録する
-  void changeParts(String name, int16_t idx);   // 指定部位に表示する画像を登録する
+  void setImageData(const ImageInfo* imgInfo, const char* const* tableNames, uint16_t* const* imgTables, size_t len, const XYaddress* const* offsets=nullptr); // 〃 画像変換ツールが出力した一覧を使う
+  void changeParts(PartId part, int16_t idx);   // 指定部位に表示する画像を登録する（変化した範囲は再描画範囲に登録される、描画タスク実行中はキュー経由）
+  void changeParts(String name, int16_t idx);   // 〃 部位名で指定する
+  void markDirty(XYWHaddress rect); // 再描画範囲を登録する（体の左上基準の座標、重なる範囲は統合する）
+  void markDirtyAll();              // 全体を再描画範囲にする
+  bool enableUnderlay(String name); // 指定部位の下地キャッシュを有効にする（まばたき・リップシンクの設定時に自動で有効になる）
+  void clearUnderlay();             // 下地キャッシュを全て解放する
+  void clearBoyonCache();           // 変形キャッシュを全て解放する
+  void clearDecodeCache();          // 展開キャッシュを全て解放する
+  void clearMouthTiles();           // 口タイルを解放する
+  void setBackground(const ImageInfo* info, uint16_t num, int16_t x=0, int16_t y=0);  // 背景画像を設定する（numが0なら背景色に戻す。画面全体はdrawBackground()で描く）
+  void clearBackground() { setBackground(nullptr, 0); }  // 背景画像をやめて背景色に戻す
+  void drawBackground();            // 出力先全体に背景を描いて、アバターを描き直す
   void usePSRAM(bool psram);        // PSRAMを使う
+  bool allocCanvas(uint16_t w, uint16_t h);  // 合成用のキャンバスを確保する（足りない場合だけ確保し直す）
+  void freeCanvas();                // 合成用のキャンバスを解放する
+  void resetFrameStat();            // フレーム時間の計測結果をクリアする
+  void printFrameStat(String title);  // フレーム時間の計測結果をシリアルに出力する
   void debugtable();
-
-  void _makeAvater(   LovyanGFX* dst, int16_t x, int16_t y, unsigned short bgColor, XYWHaddress* trim=nullptr);   // アバターを合成してキャンバスに出力する
+  void startRenderTask();           // 描画タスクを開始する（以降の部位の変更と描画はすべて描画タスクが行う）
+  void stopRenderTask();            // 描画タスクを終了する（終了するまで待つ）
+  bool isRenderTaskRunning() { return _renderTask != nullptr; }  // 描画タスクが実行中か
+  void resetRenderStat();           // 描画タスクの計測結果をクリアする
+  void printRenderStat(String title); // 描画タスクの計測結果をシリアルに出力する
+  void resetProfile();              // 区間ごとの描画時間の計測結果をクリアする（描画中なら終わるまで待つ）
+  bool profileSummary(uint8_t stage, ProfileSummary* out);  // 区間の計測結果を求める（描画中なら終わるまで待つ、記録が無ければfalse）
+  void _renderLoop();               // 描画タスクの処理本体
+  void _drainRender(bool present, bool full);  // キューに残っているコマンドを全部反映して、必要なら描画する（描画タスクの終了時用）
+
+  void _makeAvater(   LovyanGFX* dst, int16_t x, int16_t y, unsigned short bgColor, XYWHaddress* trim=nullptr, uint16_t trimNum=1);   // アバターを合成してキャンバスに出力する（trimは複数指定可）
   void makeAvater(    LovyanGFX* dst, int16_t x, int16_t y) { _makeAvater(dst, x, y, transparentDefault, nullptr); };
   void makeAvater(    LovyanGFX* dst, int16_t x, int16_t y, unsigned short bgColor) { _makeAvater(dst, x, y, bgColor, nullptr); };
   void makeAvaterTrim(LovyanGFX* dst, int16_t x, int16_t y, unsigned short bgColor, XYWHaddress* trim) { _makeAvater(dst, x, y, bgColor, trim); };
@@ -114,20 +335,103 @@ public:
   void changeDrawPosition(uint16_t x, uint16_t y);  // アバターの出力先の座標を変更する
   void drawAvatar(bool drawWait=true);  // アバターを生成して出力する（全体表示を行う）
   void drawAvatarTrim(int16_t x, int16_t y, uint16_t w, uint16_t h, bool drawWait=true);  // アバターを生成して指定した範囲だけを出力する（一部分だけの書き換え用途）
+  void drawAvatarDirty(bool drawWait=true);  // 再描画範囲に登録された部分だけをまとめて出力する
   void setEnpandCanvas(int16_t x, int16_t y, uint16_t w, uint16_t h);   // 描画エリアの拡張
   void clearEnpandCanvas();   // 描画エリアの拡張をやめる
   void setBlink(String name, int16_t idxOpen, int16_t idxClose);  // 自動まばたきの設定
   void startAutoBlink();  // 自動まばたきを開始する
-  void stopAutoBlink();   // 自動まばたきを終了する
+  void stopAutoBlink();   // 自動まばたきを終了する（終了するまで待つ）
   void setLipsync(String name, int16_t nn, int16_t aa, int16_t ii, int16_t uu, int16_t ee, int16_t oo);  // リップシンクの設定
   void setLipsyncVowel(Vowel vowel, int16_t lipWaitTmp=0);  // リップシンクの母音と自動的に口を閉じるまでの時間を設定する（設定すると即反映される）
+  void changeMouth(int16_t idx);  // リップシンクの口を変更して描画する（口タイルが使えれば転送1回だけで描画する、描画タスク実行中はキュー経由）
   void startAutoLipsync();  // リップシンクを開始する
-  void stopAutoLipsync();   // リップシンクを終了する
-  void createExpression();  // 表情セットを作成する
-  void apllyExpression();   // 表情セットを反映する
+  void stopAutoLipsync();   // リップシンクを終了する（終了するまで待つ）
+  uint32_t playClip(const Clip* clip, uint32_t durationMs=0);  // クリップを再生する（durationMsで止める、0は最後まで）。戻り値は再生番号（0は空きが無い）
+  void stopClip(uint32_t id);       // クリップの再生を止める（変更済みの部位はそのまま）
+  void stopAllClips();              // 全てのクリップの再生を止める
+  bool isClipPlaying(uint32_t id);  // クリップが再生中か
+  uint32_t tickClips(uint32_t nowMs, bool* changed=nullptr);  // 時刻nowMsまでのキーフレームを反映する。戻り値は次の反映までの時間(ms)、再生中のクリップが無ければUINT32_MAX
+  int16_t createExpression(String name); // 表情セットを作成する（同じ名前があれば作り直す）。戻り値は表情セットの番号（-1は空きが無い）
+  void setExpressionParts(String expr, String name, int16_t idx);  // 表情セットに部位のインデックス番号を設定する
+  void setExpressionBlink(String expr, int16_t idxOpen, int16_t idxClose);  // 表情セットにまばたきの設定を加える
+  void setExpressionLipsync(String expr, int16_t aa, int16_t ii, int16_t uu, int16_t ee, int16_t oo, int16_t nn);  // 表情セットにリップシンクの設定を加える
+  bool apllyExpression(String expr);  // 表情セットを反映する（まとめて切り替えて、変わった範囲を1回だけ描画する）
 
 private:
   M5Canvas tmpcanvas;   // 一時利用するキャンバス
+  QueueHandle_t _renderQueue = nullptr;     // 描画タスクのコマンドキュー
+  volatile TaskHandle_t _renderTask = nullptr;  // 描画タスク（他のタスクからも参照する）
+  SemaphoreHandle_t _drawMutex = nullptr;   // キャンバスの排他処理（描画タスクを使わない場合用）
+  bool _postRender(RenderCmd cmd, TickType_t wait);  // 描画タスクにコマンドを送る
+  bool _onRenderTask() { return _renderTask != nullptr && xTaskGetCurrentTaskHandle() == _renderTask; }  // 描画タスクから呼ばれたか
+  void _changePartsNow(int16_t tbl, int16_t idx);  // 部位の画像を変更する（描画タスクまたは描画タスク無しの場合）
+  int16_t _expressionNo(String expr);           // 表情セットの番号を求める
+  void _applyExpressionNow(int16_t no);         // 表情セットを反映する（描画タスクまたは描画タスク無しの場合）
+  uint16_t _tableCount = 0;     // 登録された部位の数
+  int16_t _bodyTbl = -1;        // 体のテーブル番号
+  DrawItem _drawList[tableNumZundavatar];  // 各部位の画像番号と配置先（フレームの最初に求める）
+  void _initTables(uint16_t len);          // 登録された部位の数と体のテーブル番号を求めておく
+  int16_t _bodyNo();                       // 表示中の体の画像番号を求める
+  XYaddress _partOffset(int16_t tbl, int16_t idx);  // 部位の画像の体からの相対位置を求める
+  void _buildDrawList(XYaddress org);      // 各部位の画像番号と配置先を求めておく
+  void _drawNow(bool full, TickType_t wait);       // 今すぐ描画する（描画中なら待つ、待てなければ次回に回す）
+  XYWHaddress _dirtyRects[dirtyRectMax];  // 再描画範囲
+  uint16_t _dirtyNum = 0;       // 再描画範囲の登録数
+  bool _dirtyFull = false;      // 全体の再描画が必要
+  portMUX_TYPE _dirtyMux = portMUX_INITIALIZER_UNLOCKED;  // 再描画範囲の排他処理
+  ClipPlayer _clips[clipPlayerMax];  // 再生中のクリップ
+  uint32_t _clipId = 0;         // 最後に割り当てた再生番号
+  portMUX_TYPE _clipMux = portMUX_INITIALIZER_UNLOCKED;   // 再生中のクリップの排他処理
+  uint16_t _clipChannel(const ClipKey& k);  // キーフレームが動かすもののビットを求める
+  bool _clipOwns(const ClipPlayer& p, uint16_t bit);  // そのクリップが今それを動かしてよいか（排他処理は呼び出し元で行う）
+
+  void _pushClipped(M5Canvas* src, LovyanGFX* dst, int16_t x, int16_t y, XYWHaddress clip, unsigned short transparent);  // 出力先の指定範囲だけにキャンバスを貼り付ける
+  uint16_t _layoutW = 0, _layoutH = 0;  // 合成中のキャンバスの大きさ（体+拡張分）
+  void _composeArea(XYWHaddress area, XYaddress org, unsigned short bgColor, unsigned short transparentLE);  // キャンバスの指定範囲に部位を重ねて合成する
+  void _blitImage(int16_t no, XYaddress pos, XYWHaddress area, unsigned short transparentLE);  // キャンバスに画像を1枚重ねる（範囲外はクリップされる）
+  uint16_t* _presentBuf[2] = { nullptr, nullptr };  // DMA転送用のバッファ
+  bool _presentBusy[2] = { false, false };  // そのバッファが転送中（または転送待ち）
+  uint8_t _presentIdx = 0;      // 次に使う転送用バッファ
+  uint32_t _presentBytes = 0;   // 転送用バッファ1つのバイト数
+  PresentStat _presentStat;     // 今のフレームの転送時間
+  bool _allocPresentBuffers();  // DMA転送用のバッファを確保する
+  void _freePresentBuffers();   // DMA転送用のバッファを解放する
+  void _presentArea(M5Canvas* src, LovyanGFX* dst, int16_t x, int16_t y, XYWHaddress area, unsigned short transparent, bool dma);  // 合成した範囲を出力先に貼り付ける
+  void _pushDMA(M5Canvas* src, LovyanGFX* dst, int16_t x, int16_t y, XYWHaddress clip);  // 出力先の指定範囲だけにキャンバスをDMAで転送する
+  uint32_t _boyonStamp = 0;     // 変形キャッシュを使った順番のカウンタ
+  uint32_t _boyonBytes = 0;     // 変形キャッシュが使っているメモリの合計
+  bool _boyonMatch(BoyonCache* c, XYaddress org, unsigned short bgColor);  // 変形キャッシュが現在の状態と一致しているか
+  BoyonCache* _findBoyon(XYaddress org, unsigned short bgColor);   // 現在の状態の変形キャッシュを探す
+  void _storeBoyon(XYaddress org, unsigned short bgColor);         // 変形後のキャンバスを変形キャッシュに登録する
+  void _copyBoyon(BoyonCache* c, bool toCanvas);                   // 変形キャッシュと作業用キャンバスの間でコピーする
+  uint32_t _decodeStamp = 0;    // 展開キャッシュを使った順番のカウンタ
+  uint32_t _decodeBytes = 0;    // 展開キャッシュが使っているメモリの合計
+  const uint16_t* _decodeImage(int16_t no);  // 圧縮形式の画像を展開キャッシュから取り出す（無ければ展開する）
+  bool _decodePinned(int16_t no);            // 展開キャッシュから捨てたくない画像か（表示中・まばたき・リップシンク）
+  void _composeLayers(XYWHaddress area, int16_t tblFrom, int16_t tblTo, unsigned short transparentLE);  // キャンバスの指定範囲に指定したテーブルの部位を重ねる
+  bool _mouthPending = false;   // 口タイルで描画する口の変更がある（再描画範囲には登録していない）
+  int16_t _mouthShownIdx = -1;  // 出力先に表示されている口のインデックス番号
+  bool _mouthTilesStale = false;  // 表情が変わったので、次の描画の後に口タイルを作り直す
+  void _changeMouthNow(int16_t idx);  // リップシンクの口を変更する（描画タスクまたは描画タスク無しの場合）
+  void _flushMouth();           // 口タイルで描画しない場合に、前の口と今の口の範囲を再描画範囲に登録する
+  bool _prepareMouthTiles(int16_t x, int16_t y, unsigned short bgColor);  // 今の状態で口タイルが使えるようにする（一致しなければ作り直す）
+  bool _mouthTilesMatch(XYaddress org, uint16_t w, uint16_t h, unsigned short bgColor);  // 口タイルが現在の状態と一致しているか
+  bool _buildMouthTiles(XYaddress org, uint16_t w, uint16_t h, unsigned short bgColor);  // 口タイルを作る
+  bool _presentMouthTile(LovyanGFX* dst, int16_t x, int16_t y, unsigned short bgColor);  // 今の口の口タイルを出力先に転送する
+  UnderlayCache* _findUnderlay(XYWHaddress area);  // 指定範囲の合成に使える下地キャッシュを探す（必要なら範囲を広げる）
+  bool _underlayMatch(UnderlayCache* u, XYaddress org, unsigned short bgColor);  // 下地キャッシュが現在の状態と一致しているか
+  bool _bgUse = false;          // キャンバスの背景を背景画像で埋める（合成中のフレームの設定）
+  XYaddress _bgPos = { 0, 0 };  // キャンバスの左上の出力先の座標（背景画像を使わない場合は0,0、キャッシュの比較にも使う）
+  XYWHaddress _shownRect = { 0, 0, 0, 0 };  // 出力先に前回全体を描画した範囲（出力先の座標）
+  void _setBackgroundPos(int16_t x, int16_t y, unsigned short bgColor, unsigned short transparent);  // このフレームで背景画像を使うかと、その位置を決める
+  void _fillBackground(M5Canvas* canvas, XYWHaddress rect, unsigned short bgColor);  // キャンバスの範囲（物理座標）を背景で埋める
+  void _restoreBackground(LovyanGFX* dst, XYWHaddress rect, unsigned short bgColor);  // 出力先の範囲に背景を描く
+  void _restoreVacated(LovyanGFX* dst, unsigned short bgColor);  // 移動・大きさの変更で空いた範囲に背景を描き直す
+  XYWHaddress _physRect(XYWHaddress rect);  // キャンバス上の範囲を物理座標（バッファ上の位置）に変換する
+  void _copyCanvasRect(uint16_t* buf, XYWHaddress bufRect, XYWHaddress rect, bool toCanvas);  // キャンバスとバッファの間で範囲をコピーする（物理座標）
+  XYWHaddress _partRect(int16_t tbl, int16_t idx);  // 部位の画像の範囲を求める（体の左上基準の座標）
+  void _addDirtyRect(XYWHaddress rect);   // 再描画範囲を登録する（排他処理は呼び出し元で行う）
+  uint16_t _takeDirtyRects(XYWHaddress* rects, bool* full);  // 再描画範囲を取り出してクリアする
 
 };
 
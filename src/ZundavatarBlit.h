@@ -0,0 +1,270 @@
+/*
+  ZundavatarBlit.h
+  ズンダチャン　アバターの画像転送（キャンバスのバッファに直接書き込む）
+
+  Copyright (c) 2024 Kaz  (https://akibabara.com/blog/)
+  Released under the MIT license.
+  see https://opensource.org/licenses/MIT
+*/
+#pragma once
+#include <stdint.h>
+#include <string.h>
+#if defined(__SSE2__) && !defined(ZUNDAVATAR_BLIT_SCALAR)
+#include <emmintrin.h>
+#endif
+
+namespace zundavatar {
+
+/* 透明色の判定について
+*  画像データもキャンバスのバッファもバイトスワップ済みのRGB565なので、透明色(key)もバイトスワップした値
+*  (ImageInfo.transparentが0x0020ならkeyは0x2000) をそのまま比較する。
+*  通常は2ピクセル(32bit)ずつマスクを作って分岐なしで合成する。SSE2が使える環境(PC)では8ピクセルずつ。
+*  ZUNDAVATAR_BLIT_SCALAR を定義すると1ピクセルずつ比較する単純な実装になる。
+*
+*  パレット形式の画像は1ピクセル1バイトのインデックスで、インデックス0が透明。
+*  書き込むときに256色分の表(LUT、バイトスワップ済みのRGB565)で16bitに展開する。
+*/
+
+typedef uint32_t __attribute__((__may_alias__)) word_t;  // 16bitのバッファを32bitずつ読み書きするための型
+
+// 2ピクセル(32bit)のうち透明色でないピクセルの部分が0xFFFFになるマスクを作る
+inline uint32_t keyMask2(uint32_t v, uint32_t key2) {
+  uint32_t x = v ^ key2;  // 透明色のピクセルは0になる
+  uint32_t t = ((x & 0x7FFF7FFFu) + 0x7FFF7FFFu) | x;  // 0でないピクセルは最上位ビットが立つ（隣へ桁上がりはしない）
+  return ((t >> 15) & 0x00010001u) * 0xFFFFu;
+}
+
+// 1行分を透明色を除いて合成する（1ピクセルずつ、比較用）
+inline void blendKeyRowScalar(uint16_t* d, const uint16_t* s, int32_t n, uint16_t key) {
+  for (int32_t i=0; i<n; i++) {
+    if (s[i] != key) d[i] = s[i];
+  }
+}
+
+// 1行分を透明色を除いて合成する
+inline void blendKeyRow(uint16_t* d, const uint16_t* s, int32_t n, uint16_t key) {
+#ifdef ZUNDAVATAR_BLIT_SCALAR
+  blendKeyRowScalar(d, s, n, key);
+#else
+  int32_t i = 0;
+#if defined(__SSE2__)
+  const __m128i k = _mm_set1_epi16((short)key);
+  for (; i+8<=n; i+=8) {
+    __m128i v = _mm_loadu_si128((const __m128i*)(s + i));
+    __m128i o = _mm_loadu_si128((const __m128i*)(d + i));
+    __m128i m = _mm_cmpeq_epi16(v, k);  // 透明色のピクセルが0xFFFF
+    _mm_storeu_si128((__m128i*)(d + i), _mm_or_si128(_mm_and_si128(m, o), _mm_andnot_si128(m, v)));
+  }
+#endif
+  // 書き込み先を32bit境界に揃える
+  if (i < n && ((uintptr_t)(d + i) & 3)) {
+    if (s[i] != key) d[i] = s[i];
+    i++;
+  }
+  const uint32_t key2 = key * 0x00010001u;
+  uint32_t v, o, m;
+  if (((uintptr_t)(s + i) & 3) == 0) {
+    for (; i+2<=n; i+=2) {
+      v = *(const word_t*)(s + i);
+      o = *(word_t*)(d + i);
+      m = keyMask2(v, key2);
+      *(word_t*)(d + i) = (v & m) | (o & ~m);
+    }
+  } else {
+    // 読み込み元が32bit境界に無いときは16bitずつ読んで組み立てる
+    for (; i+2<=n; i+=2) {
+      v = s[i] | ((uint32_t)s[i + 1] << 16);
+      o = *(word_t*)(d + i);
+      m = keyMask2(v, key2);
+      *(word_t*)(d + i) = (v & m) | (o & ~m);
+    }
+  }
+  if (i < n && s[i] != key) d[i] = s[i];
+#endif
+}
+
+// 1行分を左右反転して透明色を除いて合成する（sは読み込み元の右端、d[j] = s[-j]）
+inline void blendKeyRowMirror(uint16_t* d, const uint16_t* s, int32_t n, uint16_t key) {
+  int32_t i = 0;
+#ifdef ZUNDAVATAR_BLIT_SCALAR
+  for (; i<n; i++) {
+    if (s[-i] != key) d[i] = s[-i];
+  }
+#else
+#if defined(__SSE2__)
+  const __m128i k = _mm_set1_epi16((short)key);
+  for (; i+8<=n; i+=8) {
+    __m128i v = _mm_loadu_si128((const __m128i*)(s - i - 7));
+    v = _mm_shuffle_epi32(v, _MM_SHUFFLE(0, 1, 2, 3));  // 8ピクセルの並びを逆にする
+    v = _mm_shufflelo_epi16(v, _MM_SHUFFLE(2, 3, 0, 1));
+    v = _mm_shufflehi_epi16(v, _MM_SHUFFLE(2, 3, 0, 1));
+    __m128i o = _mm_loadu_si128((const __m128i*)(d + i));
+    __m128i m = _mm_cmpeq_epi16(v, k);
+    _mm_storeu_si128((__m128i*)(d + i), _mm_or_si128(_mm_and_si128(m, o), _mm_andnot_si128(m, v)));
+  }
+#endif
+  if (i < n && ((uintptr_t)(d + i) & 3)) {
+    if (s[-i] != key) d[i] = s[-i];
+    i++;
+  }
+  const uint32_t key2 = key * 0x00010001u;
+  uint32_t v, o, m;
+  if (((uintptr_t)(s - i - 1) & 3) == 0) {
+    // 読み込み元も32bit境界に揃っていれば、32bitずつ読んで上下を入れ替える
+    for (; i+2<=n; i+=2) {
+      v = *(const word_t*)(s - i - 1);
+      v = (v >> 16) | (v << 16);
+      o = *(word_t*)(d + i);
+      m = keyMask2(v, key2);
+      *(word_t*)(d + i) = (v & m) | (o & ~m);
+    }
+  } else {
+    for (; i+2<=n; i+=2) {
+      v = s[-i] | ((uint32_t)s[-i - 1] << 16);
+      o = *(word_t*)(d + i);
+      m = keyMask2(v, key2);
+      *(word_t*)(d + i) = (v & m) | (o & ~m);
+    }
+  }
+  if (i < n && s[-i] != key) d[i] = s[-i];
+#endif
+}
+
+// 1行分を左右反転してコピーする（sは読み込み元の右端、d[j] = s[-j]）
+inline void copyRowMirror(uint16_t* d, const uint16_t* s, int32_t n) {
+  int32_t i = 0;
+#ifndef ZUNDAVATAR_BLIT_SCALAR
+  if (i < n && ((uintptr_t)(d + i) & 3)) {
+    d[i] = s[-i];
+    i++;
+  }
+  uint32_t v;
+  if (((uintptr_t)(s - i - 1) & 3) == 0) {
+    for (; i+2<=n; i+=2) {
+      v = *(const word_t*)(s - i - 1);
+      *(word_t*)(d + i) = (v >> 16) | (v << 16);
+    }
+  } else {
+    for (; i+2<=n; i+=2) {
+      *(word_t*)(d + i) = s[-i] | ((uint32_t)s[-i - 1] << 16);
+    }
+  }
+#endif
+  for (; i<n; i++) d[i] = s[-i];
+}
+
+// 1行分のパレット形式の画像を、インデックス0（透明）を除いて展開しながら合成する
+inline void blendIndexRow(uint16_t* d, const uint8_t* s, int32_t n, const uint16_t* lut) {
+  int32_t i = 0;
+#ifndef ZUNDAVATAR_BLIT_SCALAR
+  uint32_t v;
+  for (; i+4<=n; i+=4) {
+    memcpy(&v, s + i, 4);
+    if (v == 0) continue;  // 4ピクセルとも透明なら読み飛ばす
+    if (s[i])     d[i]     = lut[s[i]];
+    if (s[i + 1]) d[i + 1] = lut[s[i + 1]];
+    if (s[i + 2]) d[i + 2] = lut[s[i + 2]];
+    if (s[i + 3]) d[i + 3] = lut[s[i + 3]];
+  }
+#endif
+  for (; i<n; i++) {
+    if (s[i]) d[i] = lut[s[i]];
+  }
+}
+
+// 1行分のパレット形式の画像を左右反転して合成する（sは読み込み元の右端、d[j] = lut[s[-j]]）
+inline void blendIndexRowMirror(uint16_t* d, const uint8_t* s, int32_t n, const uint16_t* lut) {
+  int32_t i = 0;
+#ifndef ZUNDAVATAR_BLIT_SCALAR
+  uint32_t v;
+  for (; i+4<=n; i+=4) {
+    memcpy(&v, s - i - 3, 4);
+    if (v == 0) continue;
+    if (s[-i])     d[i]     = lut[s[-i]];
+    if (s[-i - 1]) d[i + 1] = lut[s[-i - 1]];
+    if (s[-i - 2]) d[i + 2] = lut[s[-i - 2]];
+    if (s[-i - 3]) d[i + 3] = lut[s[-i - 3]];
+  }
+#endif
+  for (; i<n; i++) {
+    if (s[-i]) d[i] = lut[s[-i]];
+  }
+}
+
+/* 座標はすべて書き込み先バッファの物理座標
+*  dst    : 書き込み先のバッファ（RGB565、バイトスワップ済み）
+*  stride : 書き込み先の1行のピクセル数
+*  dx, dy : 画像の左上を置く位置
+*  cx, cy, cw, ch : 書き込んでよい範囲（クリップ範囲）
+*  mirror : 左右反転して書き込む
+*/
+
+// スパン形式の画像を書き込む（透明部分は読み飛ばし、不透明なランだけをコピーする）
+inline void blitSpan(uint16_t* dst, int32_t stride, int32_t dx, int32_t dy,
+                     const uint16_t* span, const uint32_t* rows, int32_t w, int32_t h,
+                     int32_t cx, int32_t cy, int32_t cw, int32_t ch, bool mirror=false) {
+  int32_t y1 = (dy > cy) ? dy : cy;
+  int32_t y2 = (dy + h < cy + ch) ? dy + h : cy + ch;
+  // 画像上の列で見たクリップ範囲（左右反転時は反転させておく）
+  int32_t ix1 = mirror ? dx + w - (cx + cw) : cx - dx;
+  int32_t ix2 = mirror ? dx + w - cx : cx + cw - dx;
+  for (int32_t y=y1; y<y2; y++) {
+    const uint16_t* p = span + rows[y - dy];
+    uint16_t* line = dst + y * stride;
+    int32_t n = *p++;
+    int32_t x = 0;
+    while (n-- > 0) {
+      x += *p++;
+      int32_t len = *p++;
+      int32_t a = (x > ix1) ? x : ix1;
+      int32_t b = (x + len < ix2) ? x + len : ix2;
+      if (a < b) {
+        if (!mirror) {
+          memcpy(line + dx + a, p + (a - x), (b - a) * sizeof(uint16_t));
+        } else {
+          // 反転後の左端（画像上の列b-1）から順に書く
+          copyRowMirror(line + dx + w - b, p + (b - 1 - x), b - a);
+        }
+      }
+      p += len;
+      x += len;
+      if (x >= ix2) break;
+    }
+  }
+}
+
+// 通常の画像を透明色を除いて書き込む
+inline void blitKey(uint16_t* dst, int32_t stride, int32_t dx, int32_t dy,
+                    const uint16_t* src, int32_t w, int32_t h, uint16_t key,
+                    int32_t cx, int32_t cy, int32_t cw, int32_t ch, bool mirror=false) {
+  int32_t y1 = (dy > cy) ? dy : cy;
+  int32_t y2 = (dy + h < cy + ch) ? dy + h : cy + ch;
+  int32_t x1 = (dx > cx) ? dx : cx;
+  int32_t x2 = (dx + w < cx + cw) ? dx + w : cx + cw;
+  if (y1 >= y2 || x1 >= x2) return;
+  for (int32_t y=y1; y<y2; y++) {
+    const uint16_t* s = src + (y - dy) * w;
+    uint16_t* d = dst + y * stride + x1;
+    if (!mirror) blendKeyRow(d, s + (x1 - dx), x2 - x1, key);
+    else blendKeyRowMirror(d, s + (w - 1 - (x1 - dx)), x2 - x1, key);
+  }
+}
+
+// パレット形式の画像をLUTで展開しながら書き込む（インデックス0は透明）
+inline void blitIndexed(uint16_t* dst, int32_t stride, int32_t dx, int32_t dy,
+                        const uint8_t* src, const uint16_t* lut, int32_t w, int32_t h,
+                        int32_t cx, int32_t cy, int32_t cw, int32_t ch, bool mirror=false) {
+  int32_t y1 = (dy > cy) ? dy : cy;
+  int32_t y2 = (dy + h < cy + ch) ? dy + h : cy + ch;
+  int32_t x1 = (dx > cx) ? dx : cx;
+  int32_t x2 = (dx + w < cx + cw) ? dx + w : cx + cw;
+  if (y1 >= y2 || x1 >= x2) return;
+  for (int32_t y=y1; y<y2; y++) {
+    const uint8_t* s = src + (y - dy) * w;
+    uint16_t* d = dst + y * stride + x1;
+    if (!mirror) blendIndexRow(d, s + (x1 - dx), x2 - x1, lut);
+    else blendIndexRowMirror(d, s + (w - 1 - (x1 - dx)), x2 - x1, lut);
+  }
+}
+
+} // namespace zundavatar
@@ -0,0 +1,76 @@
+/*
+  ZundavatarCodec.h
+  ズンダチャン　圧縮形式の画像の展開（RGB565向けのQOI風の圧縮）
+
+  Copyright (c) 2024 Kaz  (https://akibabara.com/blog/)
+  Released under the MIT license.
+  see https://opensource.org/licenses/MIT
+*/
+#pragma once
+#include <stdint.h>
+
+namespace zundavatar {
+
+/* 圧縮形式について（画像変換ツールの encode_packed() と対になっている）
+*  ピクセルは左上から順に、1バイトの命令とそれに続くデータで表す。色はRGB565（スワップなし）で扱う。
+*    0x00-0x3F  透明色が n+1 個続く
+*    0x40-0x7F  直前の色が n+1 個続く
+*    0x80-0xBF  最近使った色の表（64色）の n 番目の色
+*    0xC0-0xDA  直前の色からR,G,Bをそれぞれ-1～+1した色（(dr+1)*9 + (dg+1)*3 + (db+1)）
+*    0xFF       続く2バイトの色（上位・下位の順）
+*  最近使った色の表には、不透明なピクセルを書くたびにその色を hash(色) の位置に入れる。
+*  直前の色・表は最初はすべて0。展開先はキャンバスと同じバイトスワップ済みの並びになる。
+*/
+
+static constexpr uint8_t packOpKey = 0x00;
+static constexpr uint8_t packOpRun = 0x40;
+static constexpr uint8_t packOpIndex = 0x80;
+static constexpr uint8_t packOpDiff = 0xC0;
+static constexpr uint8_t packOpDiffEnd = 0xDA;
+static constexpr uint8_t packOpRGB = 0xFF;
+
+// 最近使った色の表の位置
+inline uint8_t packHash(uint16_t c) {
+  return ((c >> 11) * 3 + ((c >> 5) & 0x3F) * 5 + (c & 0x1F) * 7) & 0x3F;
+}
+
+// srcBytesバイトの圧縮形式の画像をpixels個のピクセルに展開する（keyはバイトスワップ済みの透明色）。データが壊れている・足りなければfalse
+inline bool unpackImage(const uint8_t* src, uint32_t srcBytes, uint16_t* dst, uint32_t pixels, uint16_t key) {
+  const uint8_t* end = src + srcBytes;
+  uint16_t table[64] = { 0 };
+  uint16_t prev = 0;
+  uint32_t i = 0;
+  while (i < pixels) {
+    if (src >= end) return false;
+    uint8_t op = *src++;
+    if (op < packOpIndex) {
+      uint32_t n = (op & 0x3F) + 1;
+      if (n > pixels - i) return false;
+      uint16_t c = (op < packOpRun) ? key : (uint16_t)(prev << 8 | prev >> 8);
+      while (n-- > 0) dst[i++] = c;
+      continue;
+    }
+    uint16_t c;
+    if (op < packOpDiff) {
+      c = table[op & 0x3F];
+    } else if (op <= packOpDiffEnd) {
+      uint8_t d = op - packOpDiff;
+      uint16_t r = ((prev >> 11) + d / 9 - 1) & 0x1F;
+      uint16_t g = (((prev >> 5) & 0x3F) + (d / 3) % 3 - 1) & 0x3F;
+      uint16_t b = ((prev & 0x1F) + d % 3 - 1) & 0x1F;
+      c = (r << 11) | (g << 5) | b;
+    } else if (op == packOpRGB) {
+      if (end - src < 2) return false;
+      c = (uint16_t)(src[0] << 8 | src[1]);
+      src += 2;
+    } else {
+      return false;
+    }
+    table[packHash(c)] = c;
+    prev = c;
+    dst[i++] = (uint16_t)(c << 8 | c >> 8);
+  }
+  return true;
+}
+
+} // namespace zundavatar
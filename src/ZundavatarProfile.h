@@ -0,0 +1,160 @@
+/*
+  ZundavatarProfile.h
+  ズンダチャン　アバターの描画時間の計測（区間ごとの最小・平均・p95・p99とヒストグラム）
+
+  Copyright (c) 2024 Kaz  (https://akibabara.com/blog/)
+  Released under the MIT license.
+  see https://opensource.org/licenses/MIT
+*/
+#pragma once
+#include <stdint.h>
+#include <string.h>
+#include <algorithm>
+
+// ZUNDAVATAR_PROFILE を0にすると計測のコードはすべて無くなる（RenderProfilerは何もしないクラスになる）
+#ifndef ZUNDAVATAR_PROFILE
+#define ZUNDAVATAR_PROFILE 1
+#endif
+
+namespace zundavatar {
+
+/* 計測の仕組み
+*  描画中に add() で区間ごとの時間を足していき、フレームの最後に endFrame() でフレーム1回分の値として記録する。
+*  記録は区間ごとに直近 profileRingLen フレーム分のリングバッファと、リセットしてからの最小・最大・合計・ヒストグラム。
+*  メモリは最初から確保してあるので、計測中にメモリの確保はしない。p95・p99はリングバッファの値から求める（取り出すときだけ並べ替える）。
+*  add()より前のフレームの外で測った時間（描画の排他待ちなど）は、次のフレームの値になる。
+*/
+
+static constexpr uint16_t profileRingLen = 128;   // 区間ごとに保持する直近のフレーム数
+static constexpr uint16_t profileHistBins = 16;   // ヒストグラムのビンの数（0us, 1us, 2-3us, 4-7us ... 16ms以上）
+static constexpr uint16_t profileLayerMax = 10;   // 部位ごとに計測する部位の数の上限
+
+enum ProfileStage : uint8_t {  // 計測する区間（ProfLayer0 + テーブル番号 は部位ごとの画像転送）
+  ProfFill,     // 背景の塗りつぶし・下地キャッシュからのコピー
+  ProfBlit,     // 部位の画像転送（全部位の合計）
+  ProfZoom,     // 変形（ボヨン）
+  ProfPush,     // 出力先への転送
+  ProfLockWait, // 描画の排他待ち
+  ProfFrame,    // フレーム全体
+  ProfDecode,   // 圧縮形式の画像の展開（部位の画像転送の時間に含まれる）
+  ProfLayer0
+};
+static constexpr uint16_t profileStageNum = ProfLayer0 + profileLayerMax;
+
+struct ProfileSummary {  // 1区間の計測結果
+  uint32_t frames = 0;  // 記録したフレーム数
+  uint32_t minUs = 0;   // 最小(us)
+  uint32_t avgUs = 0;   // 平均(us)
+  uint32_t p95Us = 0;   // 直近のフレームの95パーセンタイル(us)
+  uint32_t p99Us = 0;   // 直近のフレームの99パーセンタイル(us)
+  uint32_t maxUs = 0;   // 最大(us)
+  uint32_t hist[profileHistBins];  // ヒストグラム（ビンごとのフレーム数）
+};
+
+// 区間の名前（部位ごとの区間は"layer"）
+inline const char* profileStageName(uint8_t stage) {
+  static const char* const names[] = { "fill", "blit", "zoom", "push", "lockWait", "frame", "decode" };
+  return (stage < ProfLayer0) ? names[stage] : "layer";
+}
+
+#if ZUNDAVATAR_PROFILE
+
+class RenderProfiler {
+public:
+  RenderProfiler() { reset(); }
+
+  // 今のフレームの区間に時間を足す
+  void add(uint8_t stage, uint32_t us) {
+    if (stage >= profileStageNum) return;
+    _acc[stage] += us;
+    _used |= (uint32_t)1 << stage;
+  }
+
+  // 今のフレームを記録する（そのフレームで使われた区間だけ）
+  void endFrame() {
+    for (uint16_t s=0; s<profileStageNum; s++) {
+      if (!(_used & ((uint32_t)1 << s))) continue;
+      Stage& st = _stages[s];
+      uint32_t us = _acc[s];
+      st.ring[st.pos] = (us > 0xFFFF) ? 0xFFFF : us;
+      st.pos = (st.pos + 1) % profileRingLen;
+      if (st.frames == 0 || us < st.minUs) st.minUs = us;
+      if (us > st.maxUs) st.maxUs = us;
+      st.sumUs += us;
+      st.frames ++;
+      st.hist[_bin(us)] ++;
+      _acc[s] = 0;
+    }
+    _used = 0;
+    _frames ++;
+  }
+
+  // 計測結果をクリアする
+  void reset() {
+    memset(_stages, 0, sizeof(_stages));
+    memset(_acc, 0, sizeof(_acc));
+    _used = 0;
+    _frames = 0;
+  }
+
+  // 区間の計測結果を求める（記録が無ければfalse）
+  bool summary(uint8_t stage, ProfileSummary* out) const {
+    if (stage >= profileStageNum || _stages[stage].frames == 0) return false;
+    const Stage& st = _stages[stage];
+    uint16_t tmp[profileRingLen];
+    uint16_t n = (st.frames < profileRingLen) ? st.frames : profileRingLen;
+    memcpy(tmp, st.ring, sizeof(tmp));
+    std::sort(tmp, tmp + n);  // 埋まっていない分は0なので、埋まった分だけを並べる（埋まるまではringの先頭から順に入る）
+    out->frames = st.frames;
+    out->minUs = st.minUs;
+    out->avgUs = (uint32_t)(st.sumUs / st.frames);
+    out->p95Us = tmp[(n - 1) * 95 / 100];
+    out->p99Us = tmp[(n - 1) * 99 / 100];
+    out->maxUs = st.maxUs;
+    memcpy(out->hist, st.hist, sizeof(out->hist));
+    return true;
+  }
+
+  uint32_t frames() const { return _frames; }  // 記録したフレーム数
+  static constexpr bool enabled = true;
+
+private:
+  struct Stage {
+    uint16_t ring[profileRingLen];  // 直近のフレームの値(us)（65535usで頭打ち）
+    uint16_t pos;           // 次に書き込む位置
+    uint32_t frames;        // 記録したフレーム数
+    uint32_t minUs, maxUs;  // 最小・最大(us)
+    uint64_t sumUs;         // 合計(us)
+    uint32_t hist[profileHistBins];  // ヒストグラム
+  };
+  Stage _stages[profileStageNum];
+  uint32_t _acc[profileStageNum];   // 今のフレームの区間ごとの時間
+  uint32_t _used;         // 今のフレームで使われた区間のビット
+  uint32_t _frames;       // 記録したフレーム数
+
+  // ヒストグラムのビン（値のビット数、最後のビンはそれ以上すべて）
+  static uint8_t _bin(uint32_t us) {
+    uint8_t b = 0;
+    while (us != 0 && b < profileHistBins - 1) {
+      us >>= 1;
+      b ++;
+    }
+    return b;
+  }
+};
+
+#else
+
+class RenderProfiler {  // 計測しない場合（何もしない）
+public:
+  void add(uint8_t, uint32_t) {}
+  void endFrame() {}
+  void reset() {}
+  bool summary(uint8_t, ProfileSummary*) const { return false; }
+  uint32_t frames() const { return 0; }
+  static constexpr bool enabled = false;
+};
+
+#endif
+
+} // namespace zundavatar
@@ -18,6 +18,8 @@
 #include "ServoChan.h"
 using namespace servo_chan;
 extern ServoChan servo;
+#include "Zundavatar.h"
+extern zundavatar::Zundavatar avatar;
 
 // ====================================================================================
 
@@ -100,6 +102,183 @@ void extend_servo_adjust() {
   M5.Lcd.fillScreen(TFT_WHITE);
 } 
 
+// 画像転送カーネルのベンチマーク（体・目・口の大きさの画像を、pushImage・1ピクセルずつ・32bitずつ・パレット形式の4通りで合成して比べる）
+void extend_blit_benchmark() {
+  const int sizes[][2] = { { 240, 240 }, { 80, 33 }, { 23, 19 } };
+  const char* names[] = { "body", "eye", "mouth" };
+  const uint16_t key = 0x2000;  // バイトスワップ済みの透明色
+  const int cw = 240, ch = 240;
+  int i, k, n, w, h;
+  unsigned long tm, t1, t2, t3, t4;
+
+  M5Canvas canvas;
+  canvas.setPsram(true);
+  canvas.setColorDepth(16);
+  if (canvas.createSprite(cw, ch) == nullptr) return;
+  uint16_t* dst = (uint16_t*)canvas.getBuffer();
+  uint16_t* src = (uint16_t*)heap_caps_malloc(cw * ch * sizeof(uint16_t), MALLOC_CAP_SPIRAM);
+  uint8_t* isrc = (uint8_t*)heap_caps_malloc(cw * ch, MALLOC_CAP_SPIRAM);
+  uint16_t lut[256];
+  if (src == nullptr || isrc == nullptr) {
+    if (src != nullptr) heap_caps_free(src);
+    if (isrc != nullptr) heap_caps_free(isrc);
+    canvas.deleteSprite();
+    return;
+  }
+  for (i=0; i<cw*ch; i++) src[i] = (i % 7 < 3) ? key : (uint16_t)(i * 31);  // 3/7が透明
+  for (i=0; i<cw*ch; i++) isrc[i] = (i % 7 < 3) ? 0 : 1 + (i % 255);         // パレット形式も同じ割合
+  for (i=0; i<256; i++) lut[i] = i * 31;
+
+  sp("Blit kernel benchmark (us per image):");
+  for (k=0; k<3; k++) {
+    w = sizes[k][0];
+    h = sizes[k][1];
+    n = (w * h > 10000) ? 20 : 200;
+    tm = micros();
+    for (i=0; i<n; i++) canvas.pushImage(0, 0, w, h, src, key);
+    t1 = micros() - tm;
+    tm = micros();
+    for (i=0; i<n; i++) {
+      for (int y=0; y<h; y++) zundavatar::blendKeyRowScalar(dst + y * cw, src + y * w, w, key);
+    }
+    t2 = micros() - tm;
+    tm = micros();
+    for (i=0; i<n; i++) zundavatar::blitKey(dst, cw, 0, 0, src, w, h, key, 0, 0, cw, ch);
+    t3 = micros() - tm;
+    tm = micros();
+    for (i=0; i<n; i++) zundavatar::blitIndexed(dst, cw, 0, 0, isrc, lut, w, h, 0, 0, cw, ch);
+    t4 = micros() - tm;
+    spf("  %-5s %3dx%-3d pushImage=%lu scalar=%lu word=%lu index=%lu\n", names[k], w, h, t1 / n, t2 / n, t3 / n, t4 / n);
+  }
+  heap_caps_free(src);
+  heap_caps_free(isrc);
+  canvas.deleteSprite();
+}
+
+// 左右反転の確認（反転なしの全体・反転ありの全体・反転ありのトリム描画を比べて、ずれていないか調べる）
+// 反転ありの全体は反転なしの全体を左右反転したものと一致し、反転ありのトリム描画後は反転ありの全体と一致するはず
+void extend_mirror_check() {
+  int16_t no = avatar.nameidx2no(avatar.defaultBaseBodyName, 0);
+  int32_t w = avatar._imgInfo[no].width;
+  int32_t h = avatar._imgInfo[no].height;
+  XYWHaddress eye = { 64, 71, 81, 33 };  // 目の範囲（ベンチマークと同じ）
+  bool spanSave = avatar.useSpanImage, underlaySave = avatar.useUnderlayCache, mirrorSave = avatar.mirrorImage;
+  M5Canvas ref, got;
+  ref.setPsram(true);
+  got.setPsram(true);
+  ref.setColorDepth(16);
+  got.setColorDepth(16);
+  if (ref.createSprite(w, h) == nullptr || got.createSprite(w, h) == nullptr) {
+    sp("  mirror check: canvas alloc failed");
+    return;
+  }
+  const uint16_t* rb = (const uint16_t*)ref.getBuffer();
+  const uint16_t* gb = (const uint16_t*)got.getBuffer();
+  for (int k=0; k<4; k++) {
+    avatar.useSpanImage = (k & 1);
+    avatar.useUnderlayCache = (k & 2);
+    avatar.clearUnderlay();
+    if (avatar.useUnderlayCache) {
+      avatar.enableUnderlay("eye");
+    }
+    avatar.changeParts("eye", 1);
+    // 反転なしの全体と反転ありの全体
+    avatar.mirrorImage = false;
+    avatar.makeAvater(&ref, 0, 0, TFT_WHITE);
+    avatar.mirrorImage = true;
+    avatar.makeAvater(&got, 0, 0, TFT_WHITE);
+    int32_t badFull = 0, badTrim = 0;
+    for (int32_t y=0; y<h; y++) {
+      for (int32_t x=0; x<w; x++) {
+        if (gb[y * w + x] != rb[y * w + (w - 1 - x)]) badFull++;
+      }
+    }
+    // 反転ありで目だけ変えてトリム描画したものと、反転ありの全体
+    avatar.changeParts("eye", 0);
+    avatar.makeAvaterTrim(&got, 0, 0, TFT_WHITE, &eye);
+    avatar.makeAvater(&ref, 0, 0, TFT_WHITE);
+    for (int32_t i=0; i<w*h; i++) {
+      if (gb[i] != rb[i]) badTrim++;
+    }
+    spf("  mirror check: span=%d underlay=%d full=%s(%d) trim=%s(%d)\n", avatar.useSpanImage, avatar.useUnderlayCache,
+      badFull ? "NG" : "OK", badFull, badTrim ? "NG" : "OK", badTrim);
+  }
+  avatar.changeParts("eye", 1);
+  avatar.useSpanImage = spanSave;
+  avatar.useUnderlayCache = underlaySave;
+  avatar.mirrorImage = mirrorSave;
+  avatar.clearUnderlay();
+  avatar.enableUnderlay("eye");
+  avatar.enableUnderlay("mouth");
+  ref.deleteSprite();
+  got.deleteSprite();
+}
+
+// アバター描画のベンチマーク（まばたき・リップシンク・ボヨンの描画を繰り返してフレーム時間を計る）
+void extend_avatar_benchmark() {
+  const int frames = 40;
+  const float boyonXs[] = { 1.0, 0.99, 0.98, 0.99 };
+  const float boyonYs[] = { 1.0, 1.01, 1.02, 1.01 };
+  const int configs = 9;  // 下に行くほど機能を1つずつ追加していく（最後の2つはスパン形式の代わりにパレット形式・圧縮形式）
+  bool reuse[] = { false, true, true, true, true, true, true, true, true };
+  bool underlay[] = { false, false, true, true, true, true, true, true, true };
+  bool span[] = { false, false, false, true, true, true, true, false, false };  // スパン形式の画像データが無ければ通常の画像データで描画される
+  bool indexed[] = { false, false, false, false, false, false, false, true, false };  // パレット形式・圧縮形式も同じ
+  bool packed[] = { false, false, false, false, false, false, false, false, true };
+  bool boyon[] = { false, false, false, false, true, true, true, true, true };
+  bool dma[] = { false, false, false, false, false, true, true, true, true };
+  bool mouth[] = { false, false, false, false, false, false, true, true, true };
+  String title[] = { "create/delete per frame", "persistent canvas", "+ underlay", "+ span", "+ boyon cache", "+ DMA present", "+ mouth tiles", "palette instead of span", "packed instead of span" };
+  int i, k;
+
+  sp("Entering Avatar Benchmark mode.");
+  extend_blit_benchmark();
+  extend_mirror_check();
+  for (k=0; k<configs; k++) {
+    avatar.reuseCanvas = reuse[k];
+    avatar.useUnderlayCache = underlay[k];
+    avatar.useSpanImage = span[k];
+    avatar.useIndexedImage = indexed[k];
+    avatar.usePackedImage = packed[k];
+    avatar.useBoyonCache = boyon[k];
+    avatar.useDmaPresent = dma[k];
+    avatar.useMouthTiles = mouth[k];
+    avatar.clearBoyonCache();
+    avatar.clearMouthTiles();
+    avatar.clearDecodeCache();
+    avatar.freeCanvas();
+    avatar.clearUnderlay();
+    avatar.enableUnderlay("eye");
+    avatar.enableUnderlay("mouth");
+    avatar.resetFrameStat();
+    for (i=0; i<frames; i++) {
+      avatar.drawAvatarTrim(64, 71, 81, 33, false); // まばたき相当（目の範囲）
+      if (mouth[k]) {
+        avatar.changeMouth(avatar.autoLipsyncIdxs[i % 6]); // リップシンク（口タイルの転送だけ）
+      } else {
+        avatar.drawAvatarTrim(93, 107, 23, 19, false); // リップシンク相当（口の範囲）
+      }
+      avatar.scaleBodyCanvasX = boyonXs[i % 4];     // ボヨン相当（全体の変形）
+      avatar.scaleBodyCanvasY = boyonYs[i % 4];
+      avatar.drawAvatar(false);
+    }
+    avatar.scaleBodyCanvasX = 1.0;
+    avatar.scaleBodyCanvasY = 1.0;
+    avatar.changeMouth(avatar.autoLipsyncIdxs[5]);  // 口を閉じておく
+    avatar.printFrameStat(title[k]);
+    spf("  largest free block (PSRAM) = %d\n", heap_caps_get_largest_free_block(MALLOC_CAP_SPIRAM));
+  }
+  avatar.reuseCanvas = true;
+  avatar.useUnderlayCache = true;
+  avatar.useSpanImage = true;
+  avatar.useIndexedImage = true;
+  avatar.usePackedImage = true;
+  avatar.useBoyonCache = true;
+  avatar.useDmaPresent = true;
+  avatar.useMouthTiles = true;
+  avatar.drawAvatar();
+}
+
 // LCDにテキストを表示
 // void lcdtext(LovyanGFX* dst, String text, int x=-1, int y=-1, int size=-1) {
 //   static int oldsize;
@@ -37,6 +37,13 @@ Zundavatar avatar;
 #include "image_metan.h"   // 画像データ　四国めたん
 #endif
 
+// キャラクターバンドル（LittleFSの /character<番号>.zcb にあれば、上の画像データ・CharacterConfig.hの代わりに使う）
+#include <LittleFS.h>
+#include "CharacterBundle.h"
+using namespace character_bundle;
+CharacterBundle bundles[2];   // 読み込んだキャラクターバンドル（切り替えるときは使っていない方に読み込んでから入れ替える）
+int bundleNow = -1;           // 使用中のキャラクターバンドル（-1は内蔵の画像データ）
+
 // WiFi関連
 #include <WiFi.h>
 
@@ -82,6 +89,12 @@ bool singleMode = true;   // 一人会話モード。2台のズンダチャン
 // 設定
 #define VOICEVOX_RESTAPI_ENDPOINT "http://192.168.x.xx:50021"    // VOICEVOX RESR-APIのエンドポイント
 
+// アバターのクリップ（キーフレームアニメーション）
+ClipKey nadeKeys[6];    // なでモードのバンザイ（腕上げ→頭右→腕下げ→頭左を50msごとに繰り返す）
+Clip nadeClip = { nadeKeys, 6, 200, true, 1 };
+uint32_t nadeClipId = 0;  // 再生中のなでモードのクリップ
+void clipServoHead(float x, float y) { servo.headPosition(x, y); }  // クリップのサーボのキーフレーム
+
 // タッチパネル
 static box_t btnBody;
 static box_t btnHead;
@@ -127,9 +140,22 @@ void setup() {
   M5.Lcd.setColorDepth(16);
   M5.Lcd.fillScreen(TFT_WHITE);
 
+  // キャラクターバンドルを読み込む（前回切り替えたキャラクターがあればそれを使う）
+  if (LittleFS.begin(true)) {
+    int no = bootCharacterNo();
+    if (bundles[0].load(LittleFS, bundlePath(no).c_str())) {
+      if (bundles[0].characterNo < characterMaxNum) {
+        bundleNow = 0;
+        characterNo = bundles[0].characterNo;
+      } else {
+        bundles[0].unload();
+      }
+    }
+  }
+
   // WiFi接続
   wifiConnect();
-  mdnsRegister(hostNames[characterNo]);  // mDNSにホスト名を登録する
+  mdnsRegister((bundleNow != -1) ? (char*)bundles[bundleNow].hostName.c_str() : hostNames[characterNo]);  // mDNSにホスト名を登録する
 
   // スピーカーの設定
   auto spk_cfg = M5.Speaker.config(); // https://docs.m5stack.com/ja/api/m5unified/m5unified_appendix
@@ -147,48 +173,54 @@ void setup() {
   //tts.init(&out, VoicevoxApiType::WebApiStream);    // VOICEVOX WEB版(WebApiStream)を使う場合はこちら
   tts.init(&out, VoicevoxApiType::RestApi);                               // VOICEVOX RESR-APIを使う場合はこちら
   tts.setEndpoint(VoicevoxApiType::RestApi, VOICEVOX_RESTAPI_ENDPOINT);   // VOICEVOX RESR-APIを使う場合はこちら
-  tts.changeCharacter(VOICEVOX_SPEAKER_NO);   // 話者設定
+  //tts.sentencePipeline = false;  // 文単位で合成しながら再生せず、全文を合成してから再生する場合はこちら
+  tts.setCacheFS(LittleFS);   // 合成した音声のキャッシュをLittleFSにも保存する（再起動後も通信せずに喋れる）
+  tts.changeCharacter((bundleNow != -1) ? bundles[bundleNow].speakerNo : VOICEVOX_SPEAKER_NO);   // 話者設定
 
   // アバターの設定
   avatar.usePSRAM(true);
-  String tableNames[]   = { "body", "rhand", "lhand", "eyebrow", "eye", "mouth" };  // 部位名（imgTablesと順番を揃える）
-  uint16_t* imgTables[] = { imgTableBody, imgTableRhand, imgTableLhand, imgTableEyebrow, imgTableEye, imgTableMouth };  // 部位ごとにリスト化した表（テーブル）
-  avatar.setImageData(imgInfo, tableNames, imgTables, 6); // 画像データを登録する
+  if (bundleNow != -1) {
+    bundles[bundleNow].applyImages(&avatar);  // キャラクターバンドルの画像データを登録する
+  } else {
+    avatar.setImageData(imgInfo, imgTableNames, imgTables, imgTableNum, imgOffsets); // 画像データを登録する（部位名・テーブル・相対位置は画像変換ツールが出力したもの）
+  }
   avatar.useAntiAliases = false;  // アンチエイリアス
-  avatar.mirrorImage = false;//反転はバグあり(CHARACTER_NO != 0);      // 左右反転
+  avatar.mirrorImage = false;      // 左右反転（めたんの画像は変換時に反転済み image_metan.ini mirror=1、実行時の反転は向きを変えるときに使う）
   avatar.setDrawDisplay(&M5.Lcd, 40,0, TFT_WHITE); // アバターの表示先を設定する（出力先, x, y, 背景色）
+  //avatar.setBackground(bgimgInfo, bgimgNum);  // 背景画像を使う（tools/psdsplit_rgb565.py で変換したヘッダーをincludeする。画面全体はdrawBackground()で描く）
   //avatar.changeDrawPosition(40, 0); // アバターの表示先を変更する（x, y）
   avatar.debugtable();
   debug_free_memory("after avater setting");
 
-  // 表示するアバターのパーツを決める
-  avatar.changeParts("body", 0);    // 体
-  avatar.changeParts("rhand", 0);   // 右腕
-  avatar.changeParts("lhand", 0);   // 左腕
-  avatar.changeParts("eyebrow", 0); // 眉毛
-  avatar.changeParts("eye", 1);     // 目
-  avatar.changeParts("mouth", 1);   // 口
+  // 表示するアバターのパーツ・クリップ・まばたき・リップシンク・表情セットを設定する
+  setupCharacter();
   avatar.drawAvatar(); // アバター全体表示
 
-  // アバターのまばたきとリップシンクの設定
-  avatar.setBlink("eye", 1, 0);   // まばたき用のインデックス番号を設定する
-  avatar.setLipsync("mouth", 2, 3, 4, 5, 6, 1);   // リップシンク用のインデックス番号を設定する
+  // Bボタンを押しながら起動したら、アバター描画のベンチマークを実行する
+  if (M5.BtnB.isPressed()) {
+    beep();
+    extend_avatar_benchmark();
+  }
+  avatar.frameRateHz = 30;    // 描画タスクのフレームレート（描画の要求は1/30秒ごとにまとめて1回だけ描画する）
+  avatar.startRenderTask();   // 描画タスクを開始する（以降の描画は描画タスクが行う）
+  avatar.clipServo = clipServoHead;
   //avatar.startAutoBlink();  // 自動まばたきスタート（タスク実行）
   avatar.startAutoLipsync();  // リップシンクをスタート（タスク実行）
 
   // ChatGPTの設定
   gpt.init(OPENAI_APIKEY);
   gpt.setMainValues(characterMaxNum, characterNo, characterNames, hostNames);   // キャラクター情報を渡す
+  if (bundleNow != -1) gpt.setCharacterInfo(bundles[bundleNow].characterInfo);  // キャラ設定の文章
   // gpt.addHistory(-1, "あなたの名前を教えてください");
   // String resMessage = gpt.requestChat(true);
   // tts.speak(resMessage, true);
 
   // Webサーバーの設定
-  web.webSetup(&tts, &gpt);   // Webサーバーの初期化と開始、各クラスのポインタを渡す
+  web.webSetup(&tts, &gpt, &avatar);   // Webサーバーの初期化と開始、各クラスのポインタを渡す
   web.setMainValues(characterMaxNum, characterNo, characterNames, hostNames);   // キャラクター情報を渡す
 
   // 起動サウンドを鳴らす「のだー」　（データはsound.hに格納）
-  tts.playProgmem(soundFlashData[0], soundFlashSize[0], AudioFormat::wav);  //内蔵サウンド「のだー」
+  playSound(0);  //内蔵サウンド「のだー」
   delay(1000);
 }
 
@@ -287,6 +319,17 @@ else sp("singlemode off");
     web.notice.singleModeChange = -1;
   }
 
+  // キャラクターの切り替え（切り替えたら自由モードに入り直す）
+  if (web.notice.changeCharacter != -1) {
+    if (switchCharacter(web.notice.changeCharacter)) {
+      mTouch = Bstat();
+      mNade = Bstat();
+      stat = Mode::Free;
+      oldstat = Mode::None;
+    }
+    web.notice.changeCharacter = -1;
+  }
+
   // モードに変化があったら新しいモードに遷移する（変化があったときに一度だけ実行する）
   if (stat != oldstat) {
 
@@ -295,6 +338,8 @@ else sp("singlemode off");
       avatar.scaleBodyCanvasY = 1.0;
       avatar.scaleBodyCanvasX = 1.0;
       refreshAvatar = true;
+      avatar.printFrameStat("Touch mode");  // ボヨン中のフレーム時間と変形キャッシュの効き具合
+      avatar.printRenderStat("Touch mode");
     }
 
     switch (stat) {
@@ -308,11 +353,7 @@ else sp("singlemode off");
       avatar.startAutoBlink();    // 自動まばたきスタート（タスク実行）
       avatar.startAutoLipsync();  // リップシンクをスタート（タスク実行）
       // アバターの表情
-      avatar.changeParts("eyebrow", 0); // 眉毛　普通
-      avatar.changeParts("eye", 1);     // 目　開き
-      avatar.changeParts("mouth", 1);   // 口　閉じ
-      avatar.changeParts("rhand", 0);   // 右腕　下げ
-      avatar.changeParts("lhand", 0);   // 左腕　下げ
+      avatar.apllyExpression("free");   // 眉毛・目・口・腕を普通に
       // ランダムサーボとランダムトーク
       freeservo.now = true;
       freeservo.tm = 0;
@@ -323,17 +364,17 @@ else sp("singlemode off");
 
     case Mode::Touch : //----- タッチモード -----
       sp("Enter Touch mode");
+      avatar.resetFrameStat();
+      avatar.resetRenderStat();
       if (oldstat == Mode::Free) {
         tts.stopAutoPlay();   // 再生中なら中断する
-        tts.playProgmem(soundFlashData[0], soundFlashSize[0], AudioFormat::wav);  //内蔵サウンド「のだー」
+        playSound(0);  //内蔵サウンド「のだー」
         //tts.speak("なのだ");
       }
       servo.setSpeedDefault(SERVO_SPEED_FAST);  // 高速
       servo.headPosition(0, 1.0, true);           // 頭を上げて、完了まで待つ
       servo.setSpeedDefault(SERVO_SPEED_SLOW);  // 低速に戻す
-      avatar.changeParts("eye", 2);     // 目　左（カメラ目線）
-      avatar.setBlink("eye", 2, 0);     // まばたき　同上
-      avatar.changeParts("mouth", 1);   // 口　閉じ
+      avatar.apllyExpression("touch");  // 目　左（カメラ目線）、口　閉じ
       //lipsync.now = false;   // 自動リップシンク オフ
       freeservo.now = false;
       freetalk.now = false;
@@ -346,55 +387,30 @@ else sp("singlemode off");
       // 表情変更
       avatar.stopAutoBlink();    // 自動まばたき終了（タスク終了）
       //avatar.stopAutoLipsync();  // リップシンク終了（タスク終了）
-      avatar.changeParts("eye", 5);     // 目　＞＜
-      avatar.changeParts("mouth", 0);   // 口　普通
+      avatar.apllyExpression("nade");   // 目　＞＜、口　普通
       // 喋る
       tts.stopAutoPlay();   // 再生中なら中断する
-      tts.playProgmem(soundFlashData[1], soundFlashSize[1], AudioFormat::wav);  //内蔵サウンド「くすぐったいのだ」
-      // バンザイのループ処理
-      mNade.tm = millis() + 2000;
+      playSound(1);  //内蔵サウンド「くすぐったいのだ」
+      // バンザイ（2秒間、描画タスクがクリップを再生する。終わったら下で元に戻す）
       servo.setSpeedDefault(SERVO_SPEED_VFAST);  // サーボ　超高速
-      while (millis() < mNade.tm) {
-        kp = mNade.k++ % 4;
-        if (kp == 0) {
-          if (characterNo == 0) {  // ずんだもん
-            avatar.changeParts("rhand", 1);   // 右腕　上げ
-            avatar.changeParts("lhand", 1);   // 左腕　上げ
-          } else if (characterNo == 1) { // めたん
-            avatar.changeParts("rhand", 2);   // 右腕　指差し
-            avatar.changeParts("lhand", 0);   // 左腕　普通
-          }
-          refreshAvatar = true;
-        } else if (kp == 2) {
-          avatar.changeParts("rhand", 0);   // 右腕　下げ
-          avatar.changeParts("lhand", 0);   // 左腕　下げ
-          refreshAvatar = true;
-        } else if (kp == 1) {
-          servo.headPosition(-1.0, 1.0);    // 頭を右に振る
-        } else if (kp == 3) {
-          servo.headPosition(1.0, 1.0);    // 頭を左に振る
-        }
-        if (refreshAvatar) avatar.drawAvatar(); // アバターを再描画
-        delay(50);
-      }
-      servo.setSpeedDefault(SERVO_SPEED_SLOW);  // サーボ　低速に戻す
-      // 変更したものを元に戻す（その他タッチモードで設定するものは次回のループ時に行う）
-      avatar.changeParts("rhand", 0);   // 右腕　普通
-      avatar.changeParts("lhand", 0);   // 左腕　普通
-      avatar.changeParts("eye", 2);     // 目　左（カメラ目線）
-      avatar.changeParts("mouth", 1);   // 口　閉じ
-      refreshAvatar = true;
-      avatar.startAutoBlink();    // 自動まばたきスタート（タスク実行）
-      nextstat = Mode::Touch;   // 次回、タッチモードに戻る
-      mTouch.tm = millis() + 2000;  // 2秒後にタッチモードを抜ける
-      mNade.now = false;
-      //tts.awaitPlayable();  // 再生が終わってなかったら終わるまで待つ
+      nadeClipId = avatar.playClip(&nadeClip, 2000);
       break;
 
     }//switch
     oldstat = stat;
   }
 
+  // なでモードのバンザイが終わったら、変更したものを元に戻す（その他タッチモードで設定するものは次回のループ時に行う）
+  if (stat == Mode::Nade && mNade.now && !avatar.isClipPlaying(nadeClipId)) {
+    servo.setSpeedDefault(SERVO_SPEED_SLOW);  // サーボ　低速に戻す
+    avatar.apllyExpression("touch");  // 腕　普通、目　左（カメラ目線）、口　閉じ
+    avatar.startAutoBlink();    // 自動まばたきスタート（タスク実行）
+    nextstat = Mode::Touch;   // 次回、タッチモードに戻る
+    mTouch.tm = millis() + 2000;  // 2秒後にタッチモードを抜ける
+    mNade.now = false;
+    //tts.awaitPlayable();  // 再生が終わってなかったら終わるまで待つ
+  }
+
   // 自動まばたき実行中に目をキョロキョロさせる
   if (blink.now && avatar.autoBlink && (stat == Mode::Free)) {
     if (blink.tm < millis()) {
@@ -572,8 +588,7 @@ void loop_old1() {
       avatar.changeDrawPosition(x, 0);   // ディスプレイ上の出力位置
       //avatar.setEnpandCanvas(0, k%2*3, 0, 0);  // キャンバス内の表示位置変更
       avatar.scaleBodyCanvasY = 1.0 + k%2 * 0.02;
-      avatar.drawAvatar(); // アバター全体表示
-      M5.Lcd.fillRect(x+240,0, speed,M5.Lcd.width(), TFT_WHITE);
+      avatar.drawAvatar(); // アバター全体表示（前の位置で空いた範囲は背景が描き直される）
       //delay(100);
       k++;
     }
@@ -583,8 +598,7 @@ void loop_old1() {
       avatar.changeDrawPosition(x, 0);   // ディスプレイ上の出力位置
       avatar.scaleBodyCanvasY = 1.0 + k%2 * 0.02;
       //avatar.setEnpandCanvas(0, k%2*3, 0, 0);  // キャンバス内の表示位置変更
-      avatar.drawAvatar(); // アバター全体表示
-      M5.Lcd.fillRect(x-speed,0, speed,M5.Lcd.width(), TFT_WHITE);
+      avatar.drawAvatar(); // アバター全体表示（前の位置で空いた範囲は背景が描き直される）
       //delay(100);
       k++;
     }
@@ -634,12 +648,129 @@ void loop_old1() {
   }
 
   // アバターの表示
-  //avatar.setBackgroud(&display, 60,0, pose, zbgimgData[0]);
+  //avatar.setBackground(bgimgInfo, bgimgNum); avatar.drawBackground();
   delay(999999);
   //delay(1);
 }
 */
 
+// 表示するアバターのパーツ・クリップ・まばたき・リップシンク・表情セットを設定する（部位のテーブル番号は画像データを登録した後に決まる）
+void setupCharacter() {
+  // 表示するアバターのパーツを決める
+  avatar.changeParts("body", 0);    // 体
+  avatar.changeParts("rhand", 0);   // 右腕
+  avatar.changeParts("lhand", 0);   // 左腕
+  avatar.changeParts("eyebrow", 0); // 眉毛
+  avatar.changeParts("eye", 1);     // 目
+  avatar.changeParts("mouth", 1);   // 口
+
+  // クリップの設定
+  PartId rhand(avatar.name2table("rhand")), lhand(avatar.name2table("lhand"));
+  nadeKeys[0] = ClipKey::part(0, rhand, (characterNo == 0) ? 1 : 2);  // 右腕　ずんだもん:上げ、めたん:指差し
+  nadeKeys[1] = ClipKey::part(0, lhand, (characterNo == 0) ? 1 : 0);  // 左腕　ずんだもん:上げ、めたん:普通
+  nadeKeys[2] = ClipKey::servo(50, -1.0, 1.0);  // 頭を右に振る
+  nadeKeys[3] = ClipKey::part(100, rhand, 0);   // 右腕　下げ
+  nadeKeys[4] = ClipKey::part(100, lhand, 0);   // 左腕　下げ
+  nadeKeys[5] = ClipKey::servo(150, 1.0, 1.0);  // 頭を左に振る
+
+  // アバターのまばたきとリップシンクの設定
+  avatar.setBlink("eye", 1, 0);   // まばたき用のインデックス番号を設定する
+  avatar.setLipsync("mouth", 2, 3, 4, 5, 6, 1);   // リップシンク用のインデックス番号を設定する
+
+  // 表情セットの設定（モードごとの表情をまとめて1回で切り替える）
+  avatar.createExpression("free");    // 自由モード
+  avatar.setExpressionParts("free", "eyebrow", 0); // 眉毛　普通
+  avatar.setExpressionParts("free", "eye", 1);     // 目　開き
+  avatar.setExpressionParts("free", "mouth", 1);   // 口　閉じ
+  avatar.setExpressionParts("free", "rhand", 0);   // 右腕　下げ
+  avatar.setExpressionParts("free", "lhand", 0);   // 左腕　下げ
+  avatar.setExpressionBlink("free", 1, 0);         // まばたき　目　開き
+  avatar.createExpression("touch");   // タッチモード
+  avatar.setExpressionParts("touch", "eye", 2);    // 目　左（カメラ目線）
+  avatar.setExpressionParts("touch", "mouth", 1);  // 口　閉じ
+  avatar.setExpressionParts("touch", "rhand", 0);  // 右腕　普通
+  avatar.setExpressionParts("touch", "lhand", 0);  // 左腕　普通
+  avatar.setExpressionBlink("touch", 2, 0);        // まばたき　同上
+  avatar.createExpression("nade");    // なでモード
+  avatar.setExpressionParts("nade", "eye", 5);     // 目　＞＜
+  avatar.setExpressionParts("nade", "mouth", 0);   // 口　普通
+}
+
+// キャラクターバンドルのファイル名
+String bundlePath(int no) {
+  return "/character" + String(no) + ".zcb";
+}
+
+// 起動時のキャラクター番号（前回切り替えたキャラクター。/character.txt が無ければ CHARACTER_NO）
+int bootCharacterNo() {
+  int no = CHARACTER_NO;
+  File file = LittleFS.open("/character.txt", "r");
+  if (file) {
+    no = file.readString().toInt();
+    file.close();
+  }
+  return (no >= 0 && no < characterMaxNum) ? no : CHARACTER_NO;
+}
+
+// 起動サウンドを鳴らす（キャラクターバンドルにあればそちら、無ければsound.hのもの）
+void playSound(int no) {
+  if (bundleNow != -1 && no < bundles[bundleNow].soundNum) {
+    tts.playProgmem(bundles[bundleNow].soundData(no), bundles[bundleNow].soundSize(no), AudioFormat::wav);
+  } else {
+    tts.playProgmem(soundFlashData[no], soundFlashSize[no], AudioFormat::wav);
+  }
+}
+
+// キャラクターを切り替える（キャラクターバンドルを読み込んで、画像・話者・キャラ設定・ホスト名を入れ替える。再起動は不要）
+bool switchCharacter(int no) {
+  unsigned long tm = millis();
+  int slot = (bundleNow == 0) ? 1 : 0;   // 使っていない方に読み込む（失敗したら今のキャラクターのまま）
+  if (!bundles[slot].load(LittleFS, bundlePath(no).c_str())) return false;
+  if (bundles[slot].characterNo != no) {
+    sp("switchCharacter: character number mismatch");
+    bundles[slot].unload();
+    return false;
+  }
+
+  // 前のキャラクターの画像・音声を使っているものを止める
+  tts.stopAutoPlay();
+  if (!tts.awaitPlayable(5000)) {   // 再生中のサウンドは前のキャラクターバンドルのデータなので終わるまで待つ（止まらなければ解放できないので切り替えない）
+    sp("switchCharacter: audio did not stop");
+    bundles[slot].unload();
+    return false;
+  }
+  avatar.stopAllClips();
+  avatar.stopAutoBlink();     // まばたき・リップシンクのタスクが終わるまで待つ（画像データを入れ替える前に）
+  avatar.stopAutoLipsync();
+  avatar.stopRenderTask();
+  servo.setSpeedDefault(SERVO_SPEED_SLOW);
+
+  // 新しいキャラクターに入れ替える
+  characterNo = no;
+  bundles[slot].applyImages(&avatar);
+  tts.changeCharacter(bundles[slot].speakerNo);
+  gpt.setMainValues(characterMaxNum, characterNo, characterNames, hostNames);
+  gpt.setCharacterInfo(bundles[slot].characterInfo);
+  web.setMainValues(characterMaxNum, characterNo, characterNames, hostNames);
+  MDNS.end();
+  mdnsRegister((char*)bundles[slot].hostName.c_str());
+  setupCharacter();
+  avatar.drawAvatar();
+  avatar.startRenderTask();
+  avatar.startAutoLipsync();
+  if (bundleNow != -1) bundles[bundleNow].unload();
+  bundleNow = slot;
+
+  // 次回の起動時もこのキャラクターにする
+  File file = LittleFS.open("/character.txt", "w");
+  if (file) {
+    file.print(no);
+    file.close();
+  }
+  spf("switchCharacter: %s (load %u ms, total %u ms)\n", bundles[slot].name.c_str(), bundles[slot].loadMs, millis() - tm);
+  return true;
+}
+
 // 空きメモリ確認
 void debug_free_memory(String str) {
   sp("## "+str);
@@ -0,0 +1,174 @@
+/*
+  M5GFX.h (host)
+  ズンダチャン　PCでアバターを描画するための代用ヘッダー
+
+  Zundavatar.cpp をPC(Linux)でビルドするために、使っている分だけのM5GFX・Arduino・FreeRTOSの機能を用意する。
+  キャンバスはメモリ上のRGB565（バイトスワップ済み）のバッファで、実機と同じ並びになる。
+  タスクは作れない（xTaskCreateUniversalは失敗する）ので、描画タスクを使わない場合と同じ動作になる。
+
+  Copyright (c) 2024 Kaz  (https://akibabara.com/blog/)
+  Released under the MIT license.
+  see https://opensource.org/licenses/MIT
+*/
+#pragma once
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <math.h>
+#include <string>
+
+// ==== Arduino =========================================================================
+
+class String {
+public:
+  String() {}
+  String(const char* c) : _s(c ? c : "") {}
+  String(const std::string& s) : _s(s) {}
+  explicit String(int v) : _s(std::to_string(v)) {}
+  explicit String(unsigned int v) : _s(std::to_string(v)) {}
+  explicit String(long v) : _s(std::to_string(v)) {}
+  explicit String(unsigned long v) : _s(std::to_string(v)) {}
+  bool operator==(const String& o) const { return _s == o._s; }
+  bool operator!=(const String& o) const { return _s != o._s; }
+  bool operator==(const char* o) const { return _s == o; }
+  bool operator!=(const char* o) const { return _s != o; }
+  String operator+(const String& o) const { return String(_s + o._s); }
+  String operator+(const char* o) const { return String(_s + o); }
+  friend String operator+(const char* a, const String& b) { return String(a + b._s); }
+  String& operator+=(const String& o) { _s += o._s; return *this; }
+  const char* c_str() const { return _s.c_str(); }
+  unsigned int length() const { return _s.size(); }
+  long toInt() const { return atol(_s.c_str()); }
+private:
+  std::string _s;
+};
+
+struct HostSerial {  // シリアルの代わりに標準出力に出す
+  void print(const String& s) { fputs(s.c_str(), stdout); }
+  void print(const char* s) { fputs(s, stdout); }
+  void print(long v) { printf("%ld", v); }
+  void println(const String& s) { puts(s.c_str()); }
+  void println(const char* s) { puts(s); }
+  void println(long v) { printf("%ld\n", v); }
+  void println() { puts(""); }
+  void printf(const char* fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    vprintf(fmt, ap);
+    va_end(ap);
+  }
+};
+extern HostSerial Serial;
+
+unsigned long micros();   // 単調増加する時計(us)
+unsigned long millis();   // 単調増加する時計(ms)
+void delay(unsigned long ms);
+long random(long min, long max);
+long random(long max);
+
+// ==== ESP32・FreeRTOS ==================================================================
+
+#define IRAM_ATTR
+#define MALLOC_CAP_SPIRAM   (1 << 0)
+#define MALLOC_CAP_DMA      (1 << 1)
+#define MALLOC_CAP_INTERNAL (1 << 2)
+#define MALLOC_CAP_8BIT     (1 << 3)
+void* heap_caps_malloc(size_t size, uint32_t caps);
+void heap_caps_free(void* p);
+size_t heap_caps_get_free_size(uint32_t caps);
+size_t heap_caps_get_largest_free_block(uint32_t caps);
+void* ps_malloc(size_t size);
+
+typedef void* TaskHandle_t;
+typedef void* QueueHandle_t;
+typedef void* SemaphoreHandle_t;
+typedef uint32_t TickType_t;
+typedef int BaseType_t;
+typedef unsigned int UBaseType_t;
+struct portMUX_TYPE { int owner; };
+#define portMUX_INITIALIZER_UNLOCKED { 0 }
+#define portENTER_CRITICAL(x) (void)(x)
+#define portEXIT_CRITICAL(x) (void)(x)
+#define portMAX_DELAY 0xFFFFFFFFu
+#define pdTRUE  1
+#define pdFALSE 0
+#define pdPASS  1
+#define pdFAIL  0
+#define pdMS_TO_TICKS(x) ((TickType_t)(x))
+#define CONFIG_ARDUINO_RUNNING_CORE 1
+
+QueueHandle_t xQueueCreate(UBaseType_t len, UBaseType_t itemSize);
+BaseType_t xQueueSend(QueueHandle_t q, const void* item, TickType_t wait);
+BaseType_t xQueueReceive(QueueHandle_t q, void* item, TickType_t wait);
+UBaseType_t uxQueueMessagesWaiting(QueueHandle_t q);
+SemaphoreHandle_t xSemaphoreCreateMutex();
+BaseType_t xSemaphoreTake(SemaphoreHandle_t s, TickType_t wait);
+BaseType_t xSemaphoreGive(SemaphoreHandle_t s);
+void vTaskDelay(TickType_t ticks);
+void vTaskDelete(TaskHandle_t task);
+TaskHandle_t xTaskGetCurrentTaskHandle();
+BaseType_t xTaskCreateUniversal(void (*func)(void*), const char* name, uint32_t stack, void* arg, UBaseType_t prio, TaskHandle_t* handle, BaseType_t core);
+
+// ==== M5GFX ============================================================================
+
+namespace lgfx {
+struct swap565_t { uint16_t raw; };  // バイトスワップ済みのRGB565
+}
+
+#define TFT_BLACK 0x0000
+#define TFT_WHITE 0xFFFF
+#define TFT_RED   0xF800
+#define TFT_GREEN 0x07E0
+#define TFT_BLUE  0x001F
+
+// メモリ上のRGB565（バイトスワップ済み）のバッファに描画する。回転は使わない（setRotationは値を覚えるだけ）
+class M5Canvas;
+class LovyanGFX {
+  friend class M5Canvas;
+public:
+  virtual ~LovyanGFX() {}
+  int32_t width() const { return _w; }
+  int32_t height() const { return _h; }
+  void* getBuffer() const { return _buf; }
+  uint16_t* buffer() const { return _buf; }
+  void getClipRect(int32_t* x, int32_t* y, int32_t* w, int32_t* h) const { *x = _cx; *y = _cy; *w = _cw; *h = _ch; }
+  void setClipRect(int32_t x, int32_t y, int32_t w, int32_t h);
+  void clearClipRect() { setClipRect(0, 0, _w, _h); }
+  void startWrite() {}
+  void endWrite() {}
+  bool dmaBusy() const { return false; }  // DMA転送はすぐに終わる（同期でコピーする）
+  void waitDMA() {}
+  void setRotation(int r) { _rotation = r; }
+  void setPivot(float x, float y) { _px = x; _py = y; }
+  void fillRect(int32_t x, int32_t y, int32_t w, int32_t h, uint32_t color);
+  void fillScreen(uint32_t color) { fillRect(0, 0, _w, _h, color); }
+  void pushImage(int32_t x, int32_t y, int32_t w, int32_t h, const uint16_t* data);     // RGB565（スワップなし）
+  void pushImage(int32_t x, int32_t y, int32_t w, int32_t h, const lgfx::swap565_t* data);  // RGB565（バイトスワップ済み）
+  void pushImageDMA(int32_t x, int32_t y, int32_t w, int32_t h, const lgfx::swap565_t* data) { pushImage(x, y, w, h, data); }
+  static uint16_t swap16(uint16_t c) { return (uint16_t)(c << 8 | c >> 8); }
+protected:
+  uint16_t* _buf = nullptr;
+  int32_t _w = 0, _h = 0;
+  int32_t _cx = 0, _cy = 0, _cw = 0, _ch = 0;
+  int _rotation = 0;
+  float _px = 0, _py = 0;
+  void _putRaw(int32_t x, int32_t y, int32_t w, int32_t h, const uint16_t* raw, bool swap, bool useKey, uint16_t keyRaw);
+};
+
+class M5Canvas : public LovyanGFX {
+public:
+  ~M5Canvas() { deleteSprite(); }
+  void setPsram(bool) {}
+  void setColorDepth(int) {}
+  void* createSprite(int32_t w, int32_t h);
+  void deleteSprite();
+  void pushSprite(LovyanGFX* dst, int32_t x, int32_t y);
+  void pushSprite(LovyanGFX* dst, int32_t x, int32_t y, uint32_t transparent);
+  // 基準点(setPivot)を出力先のx,yに合わせて拡大縮小する（回転は未対応、最近傍の画素を使う）
+  void pushRotateZoom(LovyanGFX* dst, float x, float y, float angle, float zx, float zy, uint32_t transparent);
+  void pushRotateZoomWithAA(LovyanGFX* dst, float x, float y, float angle, float zx, float zy, uint32_t transparent) {
+    pushRotateZoom(dst, x, y, angle, zx, zy, transparent);  // アンチエイリアスは省略
+  }
+};
@@ -0,0 +1,164 @@
+/*
+  host_shim.cpp
+  ズンダチャン　PCでアバターを描画するための代用ヘッダー(M5GFX.h)の実装
+
+  Copyright (c) 2024 Kaz  (https://akibabara.com/blog/)
+  Released under the MIT license.
+  see https://opensource.org/licenses/MIT
+*/
+#include "M5GFX.h"
+#include <chrono>
+#include <thread>
+
+HostSerial Serial;
+
+// ==== Arduino =========================================================================
+
+static const std::chrono::steady_clock::time_point hostStart = std::chrono::steady_clock::now();
+
+unsigned long micros() {
+  return (unsigned long)std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - hostStart).count();
+}
+
+unsigned long millis() {
+  return micros() / 1000;
+}
+
+void delay(unsigned long ms) {
+  std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+}
+
+long random(long min, long max) {
+  return (max > min) ? min + rand() % (max - min) : min;
+}
+
+long random(long max) {
+  return random(0, max);
+}
+
+// ==== ESP32・FreeRTOS ==================================================================
+
+void* heap_caps_malloc(size_t size, uint32_t) { return malloc(size); }
+void heap_caps_free(void* p) { free(p); }
+size_t heap_caps_get_free_size(uint32_t) { return 8 * 1024 * 1024; }
+size_t heap_caps_get_largest_free_block(uint32_t) { return 8 * 1024 * 1024; }
+void* ps_malloc(size_t size) { return malloc(size); }
+
+// タスクは作れないので、キューも使われない（描画タスクを使わない動作になる）
+QueueHandle_t xQueueCreate(UBaseType_t, UBaseType_t) { return nullptr; }
+BaseType_t xQueueSend(QueueHandle_t, const void*, TickType_t) { return pdFALSE; }
+BaseType_t xQueueReceive(QueueHandle_t, void*, TickType_t) { return pdFALSE; }
+UBaseType_t uxQueueMessagesWaiting(QueueHandle_t) { return 0; }
+
+// 1つのスレッドだけで使うので、排他処理はいつでも取れる
+static int hostMutex;
+SemaphoreHandle_t xSemaphoreCreateMutex() { return &hostMutex; }
+BaseType_t xSemaphoreTake(SemaphoreHandle_t, TickType_t) { return pdTRUE; }
+BaseType_t xSemaphoreGive(SemaphoreHandle_t) { return pdTRUE; }
+
+void vTaskDelay(TickType_t ticks) { delay(ticks); }
+void vTaskDelete(TaskHandle_t) {}
+TaskHandle_t xTaskGetCurrentTaskHandle() { return nullptr; }
+BaseType_t xTaskCreateUniversal(void (*)(void*), const char*, uint32_t, void*, UBaseType_t, TaskHandle_t* handle, BaseType_t) {
+  if (handle != nullptr) *handle = nullptr;
+  return pdFAIL;
+}
+
+// ==== M5GFX ============================================================================
+
+void LovyanGFX::setClipRect(int32_t x, int32_t y, int32_t w, int32_t h) {
+  int32_t x2 = x + w, y2 = y + h;
+  if (x < 0) x = 0;
+  if (y < 0) y = 0;
+  if (x2 > _w) x2 = _w;
+  if (y2 > _h) y2 = _h;
+  _cx = x;
+  _cy = y;
+  _cw = (x2 > x) ? x2 - x : 0;
+  _ch = (y2 > y) ? y2 - y : 0;
+}
+
+void LovyanGFX::fillRect(int32_t x, int32_t y, int32_t w, int32_t h, uint32_t color) {
+  int32_t x1 = (x > _cx) ? x : _cx;
+  int32_t y1 = (y > _cy) ? y : _cy;
+  int32_t x2 = (x + w < _cx + _cw) ? x + w : _cx + _cw;
+  int32_t y2 = (y + h < _cy + _ch) ? y + h : _cy + _ch;
+  uint16_t raw = swap16(color);
+  for (int32_t yy=y1; yy<y2; yy++) {
+    for (int32_t xx=x1; xx<x2; xx++) _buf[yy * _w + xx] = raw;
+  }
+}
+
+// クリップ範囲内だけに画像を書き込む（useKeyの場合は透明色keyRawのピクセルは書かない）
+void LovyanGFX::_putRaw(int32_t x, int32_t y, int32_t w, int32_t h, const uint16_t* raw, bool swap, bool useKey, uint16_t keyRaw) {
+  int32_t x1 = (x > _cx) ? x : _cx;
+  int32_t y1 = (y > _cy) ? y : _cy;
+  int32_t x2 = (x + w < _cx + _cw) ? x + w : _cx + _cw;
+  int32_t y2 = (y + h < _cy + _ch) ? y + h : _cy + _ch;
+  for (int32_t yy=y1; yy<y2; yy++) {
+    for (int32_t xx=x1; xx<x2; xx++) {
+      uint16_t p = raw[(yy - y) * w + (xx - x)];
+      if (swap) p = swap16(p);
+      if (useKey && p == keyRaw) continue;
+      _buf[yy * _w + xx] = p;
+    }
+  }
+}
+
+void LovyanGFX::pushImage(int32_t x, int32_t y, int32_t w, int32_t h, const uint16_t* data) {
+  _putRaw(x, y, w, h, data, true, false, 0);
+}
+
+void LovyanGFX::pushImage(int32_t x, int32_t y, int32_t w, int32_t h, const lgfx::swap565_t* data) {
+  _putRaw(x, y, w, h, (const uint16_t*)data, false, false, 0);
+}
+
+void* M5Canvas::createSprite(int32_t w, int32_t h) {
+  deleteSprite();
+  _buf = (uint16_t*)calloc((size_t)w * h, sizeof(uint16_t));
+  if (_buf == nullptr) return nullptr;
+  _w = w;
+  _h = h;
+  clearClipRect();
+  return _buf;
+}
+
+void M5Canvas::deleteSprite() {
+  free(_buf);
+  _buf = nullptr;
+  _w = _h = 0;
+  _cx = _cy = _cw = _ch = 0;
+}
+
+void M5Canvas::pushSprite(LovyanGFX* dst, int32_t x, int32_t y) {
+  if (_buf == nullptr) return;
+  dst->pushImage(x, y, _w, _h, (const lgfx::swap565_t*)_buf);
+}
+
+void M5Canvas::pushSprite(LovyanGFX* dst, int32_t x, int32_t y, uint32_t transparent) {
+  if (_buf == nullptr) return;
+  dst->_putRaw(x, y, _w, _h, _buf, false, true, swap16(transparent));
+}
+
+void M5Canvas::pushRotateZoom(LovyanGFX* dst, float x, float y, float, float zx, float zy, uint32_t transparent) {
+  if (_buf == nullptr || zx <= 0 || zy <= 0) return;
+  uint16_t keyRaw = swap16(transparent);
+  // 出力先の範囲（元のキャンバス全体を変形した範囲）
+  int32_t x1 = (int32_t)floorf(x - _px * zx), x2 = (int32_t)ceilf(x + (_w - _px) * zx);
+  int32_t y1 = (int32_t)floorf(y - _py * zy), y2 = (int32_t)ceilf(y + (_h - _py) * zy);
+  if (x1 < dst->_cx) x1 = dst->_cx;
+  if (y1 < dst->_cy) y1 = dst->_cy;
+  if (x2 > dst->_cx + dst->_cw) x2 = dst->_cx + dst->_cw;
+  if (y2 > dst->_cy + dst->_ch) y2 = dst->_cy + dst->_ch;
+  for (int32_t dy=y1; dy<y2; dy++) {
+    int32_t sy = (int32_t)floorf((dy + 0.5f - y) / zy + _py);
+    if (sy < 0 || sy >= _h) continue;
+    for (int32_t dx=x1; dx<x2; dx++) {
+      int32_t sx = (int32_t)floorf((dx + 0.5f - x) / zx + _px);
+      if (sx < 0 || sx >= _w) continue;
+      uint16_t p = _buf[sy * _w + sx];
+      if (p == keyRaw) continue;
+      dst->_buf[dy * dst->_w + dx] = p;
+    }
+  }
+}
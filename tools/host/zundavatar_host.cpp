@@ -0,0 +1,534 @@
+/*
+  zundavatar_host.cpp
+  ズンダチャン　PCでアバターを描画する（描画結果の確認・ベンチマーク用）
+
+  src/Zundavatar.cpp をそのままPC(Linux)でビルドし、メモリ上のキャンバスに描画する。
+  画像データは変換ツールが出力したヘッダーを使うか、無ければ合成した確認用の画像を使う。
+
+  使い方（README.md参照）
+    zundavatar_host check [--update]   描画結果の確認（ゴールデン値との比較と、設定・反転・部分描画の整合性）
+    zundavatar_host render <dir>       状態ごとの描画結果をPPM形式で保存する
+    zundavatar_host bench [frames]     まばたき・リップシンク・ボヨンを繰り返してフレーム時間を計る
+
+  Copyright (c) 2024 Kaz  (https://akibabara.com/blog/)
+  Released under the MIT license.
+  see https://opensource.org/licenses/MIT
+*/
+#include "Zundavatar.h"
+#include <vector>
+#include <string>
+using namespace zundavatar;
+
+#ifdef HOST_IMAGE_HEADER
+#include HOST_IMAGE_HEADER    // 変換ツールが出力した画像データ（例 -DHOST_IMAGE_HEADER='"image_zundamon.h"'）
+static const char* imageSetName = "generated";
+#else
+static const char* imageSetName = "synthetic";
+#endif
+
+#ifndef HOST_GOLDEN_DIR
+#define HOST_GOLDEN_DIR "tools/host"
+#endif
+
+static const int displayW = 320, displayH = 240;  // 出力先（M5Stack Core2の画面と同じ大きさ）
+static const int drawX = 40, drawY = 0;           // アバターの出力位置
+static const unsigned short bgColor = TFT_WHITE;  // 背景色
+
+Zundavatar avatar;
+M5Canvas display;
+
+// ==== 確認用の画像データ ===============================================================
+// 部位の構成は変換ツールの出力と同じ（body, rhand, lhand, eyebrow, eye, mouth）。
+// 画像は楕円に模様を付けたもので、左右非対称にするために左上寄りに透明な穴を開けてある。
+// 色は255色のパレットから選んでいるので、通常の形式・スパン形式・パレット形式・圧縮形式のどれでも同じ画像になる。
+
+static const unsigned short synthKey = 0x0020;  // 透明色（ImageInfo.transparentの値）
+struct SynthPart { const char* name; int num; int x, y, w, h; };  // 部位名・画像数・体の左上基準の位置と大きさ
+static const SynthPart synthParts[] = {
+  { "body",    1,   0,   0, 200, 240 },
+  { "rhand",   3,   6, 128,  50,  92 },
+  { "lhand",   2, 146, 128,  48,  90 },
+  { "eyebrow", 2,  60,  52,  90,  20 },
+  { "eye",     6,  64,  71,  81,  33 },
+  { "mouth",   7,  93, 107,  23,  19 },
+};
+static const int synthPartNum = sizeof(synthParts) / sizeof(synthParts[0]);
+static const int synthBodyX = 100, synthBodyY = 50;  // 元画像上の体の位置（ImageInfo.posX, posY）
+
+static std::vector<std::vector<uint16_t>> synthData, synthSpan;
+static std::vector<std::vector<uint8_t>> synthIndex, synthPacked;
+static uint16_t synthPalette[256];  // パレット（バイトスワップ済み、[0]は透明色）
+static std::vector<std::vector<uint32_t>> synthRows;
+static std::vector<ImageInfo> synthInfo;
+static std::vector<std::vector<uint16_t>> synthTableData;
+static std::vector<std::vector<XYaddress>> synthOffsetData;
+static uint16_t* synthTables[tableNumZundavatar];
+static const XYaddress* synthOffsets[tableNumZundavatar];
+static const char* synthNames[tableNumZundavatar];
+
+// パレットの色（バイトスワップ済み）
+static uint16_t synthColor(int i) {
+  uint16_t r = (i * 7) & 31;
+  uint16_t g = (i * 13 + 5) & 63;
+  uint16_t b = (i * 3 + 11) & 31;
+  uint16_t c = (r << 11) | (g << 5) | b;
+  if (c == synthKey) c ^= 1;
+  return LovyanGFX::swap16(c);
+}
+
+// 画像1枚分のピクセルのパレット番号（0は透明）
+static uint8_t synthPixel(int n, int k, int x, int y, int w, int h) {
+  float fx = (x + 0.5f) / w * 2 - 1, fy = (y + 0.5f) / h * 2 - 1;
+  if (fx * fx + fy * fy > 1.0f) return 0;   // 楕円の外は透明
+  float hx = fx + 0.45f, hy = fy + 0.35f;
+  if (hx * hx + hy * hy < 0.04f) return 0;  // 左上寄りの穴
+  return 1 + (x * 3 + y * 5 + (x ^ y) + n * 37 + k * 11) % 255;
+}
+
+// スパン形式に変換する（行ごとに ラン数, (前のランの終わりからの透明の長さ, 長さ, ピクセル...) の並び）
+static void synthEncodeSpan(const std::vector<uint16_t>& img, int w, int h, std::vector<uint16_t>& span, std::vector<uint32_t>& rows) {
+  uint16_t key = LovyanGFX::swap16(synthKey);
+  for (int y=0; y<h; y++) {
+    rows.push_back(span.size());
+    size_t cntPos = span.size();
+    span.push_back(0);
+    int x = 0, last = 0;
+    while (x < w) {
+      if (img[y * w + x] == key) { x++; continue; }
+      int s = x;
+      while (x < w && img[y * w + x] != key) x++;
+      span.push_back(s - last);
+      span.push_back(x - s);
+      for (int i=s; i<x; i++) span.push_back(img[y * w + i]);
+      last = x;
+      span[cntPos] ++;
+    }
+  }
+}
+
+// 圧縮形式に変換する（tools/psdutil_lib.py の encode_packed() と同じ）
+static void synthEncodePacked(const std::vector<uint16_t>& img, std::vector<uint8_t>& out) {
+  uint16_t table[64] = { 0 };
+  uint16_t prev = 0;
+  size_t n = img.size();
+  for (size_t i=0; i<n; ) {
+    uint16_t c = LovyanGFX::swap16(img[i]);
+    if (c == synthKey || c == prev) {
+      size_t run = 1;
+      while (i + run < n && run < 64 && img[i + run] == img[i]) run ++;
+      out.push_back(((c == synthKey) ? packOpKey : packOpRun) | (run - 1));
+      i += run;
+      continue;
+    }
+    int dr = (c >> 11) - (prev >> 11);
+    int dg = ((c >> 5) & 0x3F) - ((prev >> 5) & 0x3F);
+    int db = (c & 0x1F) - (prev & 0x1F);
+    if (table[packHash(c)] == c) {
+      out.push_back(packOpIndex | packHash(c));
+    } else if (dr >= -1 && dr <= 1 && dg >= -1 && dg <= 1 && db >= -1 && db <= 1) {
+      out.push_back(packOpDiff + (dr + 1) * 9 + (dg + 1) * 3 + (db + 1));
+    } else {
+      out.push_back(packOpRGB);
+      out.push_back(c >> 8);
+      out.push_back(c & 0xFF);
+    }
+    table[packHash(c)] = c;
+    prev = c;
+    i ++;
+  }
+}
+
+// 確認用の画像データを作って登録する
+static void synthSetup() {
+  if (!synthInfo.empty()) {  // 2回目以降は作ったものを登録し直すだけ
+    avatar.setImageData(synthInfo.data(), synthNames, synthTables, synthPartNum, synthOffsets);
+    return;
+  }
+  int no = 0;
+  for (int p=0; p<synthPartNum; p++) no += synthParts[p].num;
+  synthData.resize(no);
+  synthIndex.resize(no);
+  synthPacked.resize(no);
+  synthSpan.resize(no);
+  synthRows.resize(no);
+  synthInfo.reserve(no);
+  synthTableData.resize(synthPartNum);
+  synthOffsetData.resize(synthPartNum);
+  synthPalette[0] = LovyanGFX::swap16(synthKey);
+  for (int i=1; i<256; i++) synthPalette[i] = synthColor(i);
+  no = 0;
+  for (int p=0; p<synthPartNum; p++) {
+    const SynthPart& sp = synthParts[p];
+    for (int k=0; k<sp.num; k++) {
+      int w = sp.w - (k % 2) * 4;   // インデックス番号ごとに大きさと位置を少し変える
+      int h = sp.h - (k % 3) * 2;
+      int x = sp.x + (k % 2) * 2;
+      int y = sp.y + (k % 3);
+      std::vector<uint16_t>& img = synthData[no];
+      std::vector<uint8_t>& idx = synthIndex[no];
+      img.resize(w * h);
+      idx.resize(w * h);
+      for (int yy=0; yy<h; yy++) {
+        for (int xx=0; xx<w; xx++) {
+          idx[yy * w + xx] = synthPixel(p, k, xx, yy, w, h);
+          img[yy * w + xx] = synthPalette[idx[yy * w + xx]];
+        }
+      }
+      synthEncodeSpan(img, w, h, synthSpan[no], synthRows[no]);
+      synthEncodePacked(img, synthPacked[no]);
+      synthInfo.push_back({ img.data(), (uint16_t)w, (uint16_t)h, (uint16_t)(w * h), (uint16_t)(synthBodyX + x), (uint16_t)(synthBodyY + y),
+                            synthKey, synthSpan[no].data(), synthRows[no].data(), idx.data(), synthPalette, synthPacked[no].data(),
+                            (uint32_t)synthPacked[no].size() });
+      synthTableData[p].push_back(no);
+      synthOffsetData[p].push_back({ (int16_t)x, (int16_t)y });
+      no ++;
+    }
+    synthTables[p] = synthTableData[p].data();
+    synthOffsets[p] = synthOffsetData[p].data();
+    synthNames[p] = sp.name;
+  }
+  avatar.setImageData(synthInfo.data(), synthNames, synthTables, synthPartNum, synthOffsets);
+}
+
+// ==== 共通 =============================================================================
+
+// アバターを初期状態にする（実機のsetup()と同じ部位の設定）
+static void setupAvatar() {
+  avatar.usePSRAM(true);
+#ifdef HOST_IMAGE_HEADER
+  avatar.setImageData(imgInfo, imgTableNames, imgTables, imgTableNum, imgOffsets);
+#else
+  synthSetup();
+#endif
+  display.createSprite(displayW, displayH);
+  display.fillScreen(bgColor);
+  avatar.setDrawDisplay(&display, drawX, drawY, bgColor);
+  avatar.changeParts("body", 0);
+  avatar.changeParts("rhand", 0);
+  avatar.changeParts("lhand", 0);
+  avatar.changeParts("eyebrow", 0);
+  avatar.changeParts("eye", 1);
+  avatar.changeParts("mouth", 1);
+  avatar.setBlink("eye", 1, 0);
+  avatar.setLipsync("mouth", 2, 3, 4, 5, 6, 1);
+}
+
+// 描画の設定（下に行くほど機能を1つずつ追加していく、最後の2つはスパン形式の代わりにパレット形式・圧縮形式。ベンチマークと同じ）
+struct HostConfig { const char* title; bool reuse, underlay, span, boyon, dma, mouth, indexed, packed; };
+static const HostConfig configs[] = {
+  { "create/delete per frame", false, false, false, false, false, false, false, false },
+  { "persistent canvas",       true,  false, false, false, false, false, false, false },
+  { "+ underlay",              true,  true,  false, false, false, false, false, false },
+  { "+ span",                  true,  true,  true,  false, false, false, false, false },
+  { "+ boyon cache",           true,  true,  true,  true,  false, false, false, false },
+  { "+ DMA present",           true,  true,  true,  true,  true,  false, false, false },
+  { "+ mouth tiles",           true,  true,  true,  true,  true,  true,  false, false },
+  { "palette instead of span", true,  true,  false, true,  true,  true,  true,  false },
+  { "packed instead of span",  true,  true,  false, true,  true,  true,  false, true  },
+};
+static const int configNum = sizeof(configs) / sizeof(configs[0]);
+
+static void applyConfig(const HostConfig& c) {
+  avatar.reuseCanvas = c.reuse;
+  avatar.useUnderlayCache = c.underlay;
+  avatar.useSpanImage = c.span;
+  avatar.useIndexedImage = c.indexed;
+  avatar.usePackedImage = c.packed;
+  avatar.useBoyonCache = c.boyon;
+  avatar.useDmaPresent = c.dma;
+  avatar.useMouthTiles = c.mouth;
+  avatar.clearBoyonCache();
+  avatar.clearMouthTiles();
+  avatar.clearDecodeCache();
+  avatar.freeCanvas();
+  avatar.clearUnderlay();
+  if (c.underlay) {
+    avatar.enableUnderlay("eye");
+    avatar.enableUnderlay("mouth");
+  }
+}
+
+// 確認する状態の並び（前の状態に続けて変更していく）
+struct HostState { const char* name; const char* part; int16_t idx; float scale; int mirror; };  // partがnullptrなら部位は変えない、mirrorは-1で変えない
+static const HostState states[] = {
+  { "base",         nullptr,   0, 1.0f,  0 },
+  { "blink",        "eye",     0, 1.0f, -1 },
+  { "eye5",         "eye",     5, 1.0f, -1 },
+  { "mouth_a",      "mouth",   2, 1.0f, -1 },
+  { "rhand_up",     "rhand",   1, 1.0f, -1 },
+  { "lhand_up",     "lhand",   1, 1.0f, -1 },
+  { "boyon",        nullptr,   0, 0.98f, -1 },
+  { "boyon_mouth",  "mouth",   4, 0.98f, -1 },
+  { "mirror",       nullptr,   0, 1.0f,  1 },
+  { "mirror_eye",   "eye",     2, 1.0f, -1 },
+  { "mirror_mouth", "mouth",   6, 1.0f, -1 },
+  { "mirror_boyon", nullptr,   0, 1.02f, -1 },
+};
+static const int stateNum = sizeof(states) / sizeof(states[0]);
+
+// 状態を変更して描画する（部位だけの変更は変化した範囲だけ、それ以外は全体を描画する）
+static void applyState(const HostState& s) {
+  bool full = false;
+  if (s.mirror != -1 && (bool)s.mirror != avatar.mirrorImage) {
+    avatar.mirrorImage = s.mirror;
+    full = true;
+  }
+  if (s.scale != avatar.scaleBodyCanvasY) {
+    avatar.scaleBodyCanvasX = 2.0f - s.scale;
+    avatar.scaleBodyCanvasY = s.scale;
+    full = true;
+  }
+  if (s.part != nullptr && strcmp(s.part, "mouth") == 0 && !full) {
+    avatar.changeMouth(s.idx);  // リップシンクと同じ変更（口タイルを使う設定では転送するだけ）
+  } else if (s.part != nullptr) {
+    avatar.changeParts(s.part, s.idx);
+  }
+  if (full) avatar.drawAvatar();
+  else avatar.drawAvatarDirty();
+}
+
+// 出力先のハッシュ値（FNV-1a）
+static uint32_t frameHash(const LovyanGFX& d) {
+  uint32_t h = 2166136261u;
+  const uint8_t* p = (const uint8_t*)d.getBuffer();
+  for (size_t i=0; i<(size_t)d.width() * d.height() * 2; i++) h = (h ^ p[i]) * 16777619u;
+  return h;
+}
+
+// PPM形式で保存する
+static bool writePPM(const LovyanGFX& d, const std::string& path) {
+  FILE* fp = fopen(path.c_str(), "wb");
+  if (fp == nullptr) return false;
+  fprintf(fp, "P6\n%d %d\n255\n", (int)d.width(), (int)d.height());
+  const uint16_t* buf = (const uint16_t*)d.getBuffer();
+  for (int i=0; i<d.width() * d.height(); i++) {
+    uint16_t c = LovyanGFX::swap16(buf[i]);
+    uint8_t rgb[3] = { (uint8_t)((c >> 11) * 255 / 31), (uint8_t)(((c >> 5) & 63) * 255 / 63), (uint8_t)((c & 31) * 255 / 31) };
+    fwrite(rgb, 1, 3, fp);
+  }
+  fclose(fp);
+  return true;
+}
+
+// 確認用の背景画像（2枚の短冊。右側の短冊は上下を空けて、背景色で塗る隙間を作っておく）
+static std::vector<uint16_t> bgStripData[2];
+static std::vector<ImageInfo> bgStrips;
+static void backgroundSetup() {
+  if (!bgStrips.empty()) return;
+  const int xs[] = { 0, 200 }, ys[] = { 0, 16 }, ws[] = { 200, 120 }, hs[] = { 240, 200 };
+  for (int i=0; i<2; i++) {
+    for (int y=0; y<hs[i]; y++) {
+      for (int x=0; x<ws[i]; x++) bgStripData[i].push_back(synthColor(((xs[i] + x) / 6 + (ys[i] + y) / 5 * 7 + i * 50) & 255));
+    }
+    bgStrips.push_back({ bgStripData[i].data(), (uint16_t)ws[i], (uint16_t)hs[i], (uint16_t)(ws[i] * hs[i]), (uint16_t)xs[i], (uint16_t)ys[i],
+                         synthKey, nullptr, nullptr, nullptr, nullptr, nullptr, 0 });
+  }
+}
+
+// 背景画像の上にアバターを透過で重ねたもの（背景画像を使った描画結果と一致するはず）
+static void backgroundReference(M5Canvas& ref, int x, int y) {
+  ref.fillScreen(bgColor);
+  for (const ImageInfo& s : bgStrips) ref.pushImage(s.posX, s.posY, s.width, s.height, (const lgfx::swap565_t*)s.data);
+  int16_t no = avatar.nameidx2no(avatar.defaultBaseBodyName, 0);
+  avatar.makeAvater(&ref, x, y, avatar._imgInfo[no].transparent);
+}
+
+// 体の範囲の大きさ
+static void bodySize(int* w, int* h) {
+  int16_t no = avatar.nameidx2no(avatar.defaultBaseBodyName, 0);
+  *w = avatar._imgInfo[no].width;
+  *h = avatar._imgInfo[no].height;
+}
+
+// ==== 描画結果の確認 ====================================================================
+
+static int failures = 0;
+static void report(bool ok, const char* what, const char* config, const char* state) {
+  if (!ok) failures ++;
+  if (!ok) printf("  NG  %-14s %-24s %s\n", what, config, state);
+}
+
+static int cmdCheck(bool update) {
+  std::string goldenPath = std::string(HOST_GOLDEN_DIR) + "/golden_" + imageSetName + ".txt";
+  std::vector<uint32_t> hashes[configNum];
+  int bw = 0, bh = 0;
+  M5Canvas ref, flip;
+  ref.createSprite(displayW, displayH);
+  flip.createSprite(displayW, displayH);
+
+  for (int c=0; c<configNum; c++) {
+    setupAvatar();
+    applyConfig(configs[c]);
+    bodySize(&bw, &bh);
+    avatar.mirrorImage = false;
+    avatar.scaleBodyCanvasX = avatar.scaleBodyCanvasY = 1.0f;
+    avatar.drawAvatar();
+    for (int s=0; s<stateNum; s++) {
+      applyState(states[s]);
+      hashes[c].push_back(frameHash(display));
+      // 部分描画の結果が、全体を描画し直したものと一致するか
+      ref.fillScreen(bgColor);
+      avatar.makeAvater(&ref, drawX, drawY, bgColor);
+      report(frameHash(ref) == hashes[c].back(), "trim==full", configs[c].title, states[s].name);
+      // 変形なしの状態で、反転の有無を切り替えたものが左右対称になっているか（体の範囲）
+      if (avatar.scaleBodyCanvasX == 1.0f && avatar.scaleBodyCanvasY == 1.0f) {
+        avatar.mirrorImage = !avatar.mirrorImage;
+        flip.fillScreen(bgColor);
+        avatar.makeAvater(&flip, drawX, drawY, bgColor);
+        avatar.mirrorImage = !avatar.mirrorImage;
+        const uint16_t* a = ref.buffer();
+        const uint16_t* b = flip.buffer();
+        bool ok = true;
+        for (int y=0; y<bh && ok; y++) {
+          for (int x=0; x<bw; x++) {
+            if (a[(drawY + y) * displayW + drawX + x] != b[(drawY + y) * displayW + drawX + bw - 1 - x]) { ok = false; break; }
+          }
+        }
+        report(ok, "mirror==flip", configs[c].title, states[s].name);
+      }
+      // どの設定でも同じ結果になるか（最初の設定と比べる）
+      if (c > 0) report(hashes[c][s] == hashes[0][s], "config==base", configs[c].title, states[s].name);
+    }
+  }
+
+  // 背景画像：状態の変更と、移動・変形しながらの描画結果が、背景画像の上にアバターを透過で重ねたものと一致するか
+  struct Walk { const char* name; int x, y; float scale; const char* part; int16_t idx; };
+  static const Walk walks[] = {
+    { "bg_base",   drawX, drawY, 1.0f,  nullptr, 0 },
+    { "bg_blink",  drawX, drawY, 1.0f,  "eye",   0 },
+    { "bg_mouth",  drawX, drawY, 1.0f,  "mouth", 3 },
+    { "bg_right",  70,    0,     1.0f,  nullptr, 0 },
+    { "bg_mouth2", 70,    0,     1.0f,  "mouth", 5 },
+    { "bg_down",   90,    20,    1.0f,  nullptr, 0 },
+    { "bg_boyon",  90,    20,    0.98f, nullptr, 0 },
+    { "bg_boyon2", 110,   20,    0.98f, nullptr, 0 },
+    { "bg_left",   -30,   10,    1.02f, nullptr, 0 },
+    { "bg_back",   drawX, drawY, 1.0f,  "eye",   1 },
+  };
+  backgroundSetup();
+  for (int c=0; c<configNum; c++) {
+    setupAvatar();
+    applyConfig(configs[c]);
+    avatar.mirrorImage = false;
+    avatar.scaleBodyCanvasX = avatar.scaleBodyCanvasY = 1.0f;
+    avatar.setBackground(bgStrips.data(), bgStrips.size());
+    avatar.drawBackground();
+    for (const Walk& w : walks) {
+      if (w.x != avatar.drawX || w.y != avatar.drawY || w.scale != avatar.scaleBodyCanvasY) {
+        avatar.changeDrawPosition(w.x, w.y);
+        avatar.scaleBodyCanvasX = 2.0f - w.scale;
+        avatar.scaleBodyCanvasY = w.scale;
+        avatar.drawAvatar();
+      }
+      if (w.part != nullptr && strcmp(w.part, "mouth") == 0) {
+        avatar.changeMouth(w.idx);
+        avatar.drawAvatarDirty();
+      } else if (w.part != nullptr) {
+        avatar.changeParts(w.part, w.idx);
+        avatar.drawAvatarDirty();
+      }
+      backgroundReference(ref, w.x, w.y);
+      report(frameHash(ref) == frameHash(display), "background", configs[c].title, w.name);
+    }
+    avatar.clearBackground();
+  }
+
+  // ゴールデン値と比べる（--updateの場合は書き直す）
+  if (update) {
+    FILE* fp = fopen(goldenPath.c_str(), "w");
+    if (fp == nullptr) {
+      printf("cannot write %s\n", goldenPath.c_str());
+      return 1;
+    }
+    for (int s=0; s<stateNum; s++) fprintf(fp, "%s %08x\n", states[s].name, hashes[0][s]);
+    fclose(fp);
+    printf("updated %s\n", goldenPath.c_str());
+  } else {
+    FILE* fp = fopen(goldenPath.c_str(), "r");
+    if (fp == nullptr) {
+      printf("no golden file %s (run with --update to create)\n", goldenPath.c_str());
+      failures ++;
+    } else {
+      char name[64];
+      unsigned int h;
+      int s = 0;
+      while (s < stateNum && fscanf(fp, "%63s %x", name, &h) == 2) {
+        report(strcmp(name, states[s].name) == 0 && h == hashes[0][s], "golden", imageSetName, states[s].name);
+        s ++;
+      }
+      report(s == stateNum, "golden count", imageSetName, "");
+      fclose(fp);
+    }
+  }
+  printf("check %s: %d configs x %d states (+%d background), %s (%d failures)\n", imageSetName, configNum, stateNum, (int)(sizeof(walks) / sizeof(walks[0])),
+         failures ? "FAIL" : "OK", failures);
+  return failures ? 1 : 0;
+}
+
+// ==== 描画結果の保存 ====================================================================
+
+static int cmdRender(const char* dir) {
+  setupAvatar();
+  applyConfig(configs[configNum - 1]);
+  avatar.drawAvatar();
+  for (int s=0; s<stateNum; s++) {
+    applyState(states[s]);
+    char path[512];
+    snprintf(path, sizeof(path), "%s/%02d_%s.ppm", dir, s, states[s].name);
+    if (!writePPM(display, path)) {
+      printf("cannot write %s\n", path);
+      return 1;
+    }
+    printf("%s\n", path);
+  }
+  return 0;
+}
+
+// ==== ベンチマーク ======================================================================
+// 実機のextend_avatar_benchmark()と同じ並び（まばたき相当・リップシンク相当の部分描画と、ボヨン相当の全体描画）
+
+static int cmdBench(int frames) {
+  const float boyonXs[] = { 1.0, 0.99, 0.98, 0.99 };
+  const float boyonYs[] = { 1.0, 1.01, 1.02, 1.01 };
+  setupAvatar();
+  for (int c=0; c<configNum; c++) {
+    applyConfig(configs[c]);
+    avatar.resetFrameStat();
+    avatar.resetProfile();
+    unsigned long t0 = micros();
+    for (int i=0; i<frames; i++) {
+      avatar.changeParts("eye", (i % 2) ? 0 : 1);     // まばたき
+      avatar.drawAvatarDirty();
+      avatar.changeMouth(avatar.autoLipsyncIdxs[i % 6]);  // リップシンク
+      avatar.scaleBodyCanvasX = boyonXs[i % 4];     // ボヨン
+      avatar.scaleBodyCanvasY = boyonYs[i % 4];
+      avatar.drawAvatar();
+      avatar.scaleBodyCanvasX = 1.0;
+      avatar.scaleBodyCanvasY = 1.0;
+    }
+    unsigned long us = micros() - t0;
+    const FrameStat& st = avatar.frameStat;
+    printf("%-24s frames=%u fps=%.0f avg=%uus max=%uus pixels/frame=%u cache hit=%u miss=%u decode hit=%u miss=%u mouth tile=%u\n", configs[c].title,
+           st.frames, st.frames * 1e6 / (us ? us : 1), st.frames ? st.totalUs / st.frames : 0, st.maxUs,
+           st.frames ? st.pixels / st.frames : 0, st.cacheHits, st.cacheMisses, st.decodeHits, st.decodeMisses, st.mouthTileHits);
+    ProfileSummary sum;
+    for (uint8_t s=0; s<ProfLayer0; s++) {
+      if (!avatar.profileSummary(s, &sum)) continue;
+      printf("    %-9s avg=%uus p95=%uus p99=%uus max=%uus\n", profileStageName(s), sum.avgUs, sum.p95Us, sum.p99Us, sum.maxUs);
+    }
+  }
+  return 0;
+}
+
+int main(int argc, char** argv) {
+  std::string cmd = (argc > 1) ? argv[1] : "";
+  if (cmd == "check") {
+    return cmdCheck(argc > 2 && std::string(argv[2]) == "--update");
+  } else if (cmd == "render" && argc > 2) {
+    return cmdRender(argv[2]);
+  } else if (cmd == "bench") {
+    return cmdBench((argc > 2) ? atoi(argv[2]) : 200);
+  }
+  printf("usage: %s check [--update] | render <dir> | bench [frames]\n", argv[0]);
+  return 2;
+}
@@ -0,0 +1,169 @@
+# mock_voicevox.py  Ver.0.1
+#
+# VOICEVOX REST-APIのモック（audio_query と synthesis だけ）
+# 本物のVOICEVOXが無くても、文単位パイプラインの動作確認や最初の音声が出るまでの時間の計測ができる
+# 合成時間は音声の長さ×RTF（実時間比）だけ待ってから返す。音声はモーラごとに音程が変わるだけのブザー音
+# keep-aliveの接続は、本物（uvicorn）と同じく5秒使われないと切る。ログの #番号 は接続の番号
+# --net-kbps で音声の送信速度を絞り、--net-stall-ms で送信の途中に止まる時間を入れる（遅い・ゆらぐネットワークの再現）
+#
+# 使い方
+#   python mock_voicevox.py [--host 0.0.0.0] [--port 50021] [--rtf 0.5] [--query-ms 30] [--keep-alive 5]
+#                          [--net-kbps 0] [--net-stall-ms 0]
+#   ズンダチャンの VOICEVOX_RESTAPI_ENDPOINT を http://PCのIPアドレス:50021 にする
+#
+# Copyright (c) 2024 kaz  (https://akibabara.com/blog/)
+# Released under the MIT license.
+# see https://opensource.org/licenses/MIT
+import argparse
+import io
+import json
+import math
+import struct
+import threading
+import time
+import urllib.parse
+import wave
+from http.server import BaseHTTPRequestHandler, ThreadingHTTPServer
+
+SAMPLE_RATE = 24000
+CONSONANT_LENGTH = 0.05   # モーラごとの子音の長さ(秒)
+VOWEL_LENGTH = 0.10       # モーラごとの母音の長さ(秒)
+PAUSE_LENGTH = 0.20       # 読点の長さ(秒)
+SKIP_CHARS = "。！？!?「」『』（）()・ー 　\r\n"
+
+args = None
+log_lock = threading.Lock()
+log_origin = 0.0   # しばらくリクエストが無かった後の最初のリクエストの時刻（speak()の開始とみなす）
+log_last = 0.0
+conn_count = 0     # 接続の数
+
+## 経過時間つきでログを出力する
+def log(msg):
+    global log_origin, log_last
+    with log_lock:
+        now = time.time()
+        if now - log_last > 2.0:
+            log_origin = now
+            print("----")
+        log_last = now
+        print(f"[{(now - log_origin) * 1000:7.0f}ms] {msg}", flush=True)
+
+## テキストからaudio_queryの結果を作る（1文字1モーラ、読点でアクセント句を区切る）
+def make_query(text):
+    phrases = []
+    for part in text.replace("，", "、").replace(",", "、").split("、"):
+        moras = []
+        for c in part:
+            if c in SKIP_CHARS:
+                continue
+            if c == "ン":
+                vowel = "N"
+            elif c == "ッ":
+                vowel = "cl"
+            else:
+                vowel = "aiueo"[ord(c) % 5]
+            moras.append({ "text": c, "consonant": "k", "consonant_length": CONSONANT_LENGTH,
+                           "vowel": vowel, "vowel_length": VOWEL_LENGTH, "pitch": 5.0 + (ord(c) % 7) * 0.1 })
+        if moras:
+            phrases.append({ "moras": moras, "accent": 1, "pause_mora": None, "is_interrogative": False })
+    for p in phrases[:-1]:
+        p["pause_mora"] = { "text": "、", "consonant": None, "consonant_length": None,
+                            "vowel": "pau", "vowel_length": PAUSE_LENGTH, "pitch": 0.0 }
+    return { "accent_phrases": phrases, "speedScale": 1.0, "pitchScale": 0.0, "intonationScale": 1.0,
+             "volumeScale": 1.0, "prePhonemeLength": 0.1, "postPhonemeLength": 0.1,
+             "outputSamplingRate": SAMPLE_RATE, "outputStereo": False, "kana": "" }
+
+## audio_queryの結果からWAVを作る（前後の無音、モーラごとの音、読点の無音）
+def make_wav(query):
+    pieces = [ (None, query["prePhonemeLength"]) ]
+    for p in query["accent_phrases"]:
+        for m in p["moras"]:
+            pieces.append((m["pitch"], (m["consonant_length"] or 0) + m["vowel_length"]))
+        if p.get("pause_mora"):
+            pieces.append((None, p["pause_mora"]["vowel_length"]))
+    pieces.append((None, query["postPhonemeLength"]))
+    samples = bytearray()
+    for pitch, length in pieces:
+        n = int(length * SAMPLE_RATE)
+        if pitch is None:
+            samples += bytes(n * 2)
+        else:
+            freq = 100.0 * pitch
+            samples += b"".join(struct.pack("<h", int(8000 * math.sin(2 * math.pi * freq * i / SAMPLE_RATE))) for i in range(n))
+    buf = io.BytesIO()
+    with wave.open(buf, "wb") as w:
+        w.setnchannels(1)
+        w.setsampwidth(2)
+        w.setframerate(SAMPLE_RATE)
+        w.writeframes(bytes(samples))
+    return buf.getvalue(), len(samples) / 2 / SAMPLE_RATE
+
+class Handler(BaseHTTPRequestHandler):
+    protocol_version = "HTTP/1.1"
+
+    def setup(self):
+        global conn_count
+        self.timeout = args.keep_alive   # 次のリクエストを待つ時間（過ぎたら接続を切る）
+        super().setup()
+        with log_lock:
+            conn_count += 1
+            self.conn_no = conn_count
+
+    def log_message(self, format, *a):
+        pass
+
+    def send_body(self, code, ctype, body):
+        self.send_response(code)
+        self.send_header("Content-Type", ctype)
+        self.send_header("Content-Length", str(len(body)))
+        self.end_headers()
+        if args.net_kbps <= 0 or ctype != "audio/wav":
+            self.wfile.write(body)
+            return
+        chunk = 1024
+        stalled = args.net_stall_ms <= 0
+        for i in range(0, len(body), chunk):   # 決めた速度で少しずつ送る
+            self.wfile.write(body[i:i + chunk])
+            self.wfile.flush()
+            time.sleep(chunk * 8 / (args.net_kbps * 1000))
+            if not stalled and i >= len(body) // 3:   # 1/3送ったところで1回止まる
+                time.sleep(args.net_stall_ms / 1000)
+                stalled = True
+
+    def do_POST(self):
+        url = urllib.parse.urlparse(self.path)
+        params = urllib.parse.parse_qs(url.query)
+        length = int(self.headers.get("Content-Length", 0))
+        body = self.rfile.read(length) if length > 0 else b""
+        if url.path == "/audio_query":
+            text = params.get("text", [""])[0]
+            time.sleep(args.query_ms / 1000)
+            query = make_query(text)
+            log(f"#{self.conn_no:<3d} audio_query  {len(text):3d} chars  \"{text}\"")
+            self.send_body(200, "application/json", json.dumps(query, ensure_ascii=False).encode("utf-8"))
+        elif url.path == "/synthesis":
+            try:
+                query = json.loads(body.decode("utf-8"))
+            except ValueError:
+                self.send_body(422, "application/json", b'{"detail":"bad json"}')
+                return
+            wav, seconds = make_wav(query)
+            time.sleep(seconds * args.rtf)
+            log(f"#{self.conn_no:<3d} synthesis    {seconds:5.2f}s audio  {len(wav)} bytes")
+            self.send_body(200, "audio/wav", wav)
+        else:
+            self.send_body(404, "application/json", b'{"detail":"Not Found"}')
+
+## メイン
+if __name__ == '__main__':
+    parser = argparse.ArgumentParser(description="VOICEVOX REST-API mock")
+    parser.add_argument("--host", default="0.0.0.0")
+    parser.add_argument("--port", type=int, default=50021)
+    parser.add_argument("--rtf", type=float, default=0.5, help="合成時間 = 音声の長さ x RTF")
+    parser.add_argument("--query-ms", type=float, default=30, help="audio_queryの応答時間(ms)")
+    parser.add_argument("--keep-alive", type=float, default=5, help="使われていない接続を切るまでの時間(秒)")
+    parser.add_argument("--net-kbps", type=float, default=0, help="音声の送信速度(kbps)（0は絞らない）")
+    parser.add_argument("--net-stall-ms", type=float, default=0, help="音声の送信の途中で止まる時間(ms)")
+    args = parser.parse_args()
+    print(f"mock VOICEVOX on http://{args.host}:{args.port}  rtf={args.rtf} query={args.query_ms}ms keep-alive={args.keep_alive}s net={args.net_kbps}kbps stall={args.net_stall_ms}ms")
+    ThreadingHTTPServer((args.host, args.port), Handler).serve_forever()
@@ -4,6 +4,7 @@
 #
 # 使い方
 #   python pngmerger_rgb565.py config-file.ini png-dir output.h 
+#   python pngmerger_rgb565.py config-file.ini png-dir output.zcb   （キャラクターバンドルを出力する）
 #
 # Copyright (c) 2024 Kaz  (https://akibabara.com/blog/)
 # Released under the MIT license.
@@ -18,7 +19,7 @@ if __name__ == "__main__":
 
     ## 引数
     if len(sys.argv) != 4:
-        exit("Usage: pngmerger_rgb565.py config-file.ini png-dir output.h")
+        exit("Usage: pngmerger_rgb565.py config-file.ini png-dir output.h|output.zcb")
     config_path = sys.argv[1]
     png_dir = sys.argv[2]
     outhpp_path = sys.argv[3]
@@ -28,14 +29,34 @@ if __name__ == "__main__":
         exit("Error: config-file not found")
     if not os.path.isdir(png_dir):
         exit("Error: png-dir not found")
-    if not outhpp_path.endswith('.h'):
-        exit("Error: output-file is not .h")
+    bundle = outhpp_path.endswith('.zcb')
+    if not outhpp_path.endswith('.h') and not bundle:
+        exit("Error: output-file is not .h or .zcb")
 
     ## 設定ファイルを読み込む
     conf = load_configfile(config_path)
     if conf is None:
         exit("設定ファイルを読み込めませんでした。")
     header_prefix = conf['setting']['prefix'] if 'prefix' in conf['setting'] else "img"
+    span_mode = conf['setting']['span'] if 'span' in conf['setting'] else 0
+    palette_mode = conf['setting']['palette'] if 'palette' in conf['setting'] else 0
+    pack_mode = conf['setting']['pack'] if 'pack' in conf['setting'] else 0
+
+    ## キャラクターバンドルの場合は、キャラクター設定と起動サウンドを読み込む
+    sounds = []
+    if bundle:
+        if 'character' not in conf:
+            exit("Error: [character] section not found")
+        character = conf['character']
+        if isinstance(character['info'], list):  # カンマを含む文章は配列になっているので戻す
+            character['info'] = ",".join(map(str, character['info']))
+        files = character.get('sounds', [])
+        for name in (files if isinstance(files, list) else [files]):
+            sound_path = os.path.join(os.path.dirname(config_path), name)
+            if not os.path.isfile(sound_path):
+                exit(f"Error: '{sound_path}' file not found")
+            with open(sound_path, "rb") as file:
+                sounds.append((name, file.read()))
 
     ## 指定したPNGファイルが存在するか事前にチェックする
     for data in conf['data']:
@@ -58,8 +79,15 @@ if __name__ == "__main__":
         comment1_text += resource['comment1'].replace("<num>",str(idx))+" *\n"
         #comment2_text += resource['comment2'].replace("<num>",str(idx))
 
+    ## キャラクターバンドルの作成と保存
+    if bundle:
+        with open(outhpp_path, "wb") as file:
+            file.write(generate_bundle(rgb565bins, character, sounds, span_mode, palette_mode, pack_mode))
+        print(f"Saved: {outhpp_path}")
+        sys.exit(0)
+
     ## .hppヘッダーの作成と保存
-    header_text, table_content = generate_header(rgb565bins, header_prefix)
+    header_text, table_content = generate_header(rgb565bins, header_prefix, span_mode, palette_mode, pack_mode)
     with open(outhpp_path, "w", encoding="utf-8") as file:
         file.write(f"{table_content}\n/*\n{comment1_text}*/\n{header_text}\n")
     print(f"Saved: {outhpp_path}")
@@ -2,6 +2,8 @@
 # PNG画像を横方向に分割してRGB565形式で出力する
 #
 # 使い方
+#   python psdsplit_rgb565.py 背景.png [幅 幅 ...]
+#   幅を省略すると1枚のまま出力する。出力した bgimgInfo[] と bgimgNum を Zundavatar::setBackground() に渡す
 #
 # Copyright (c) 2024 Kaz  (https://akibabara.com/blog/)
 # Released under the MIT license.
@@ -15,13 +17,11 @@ IMAGE_SUB_PREFIX = "bgimg"
 ## メイン
 if __name__ == "__main__":
     ## 引数
-    if len(sys.argv) < 4:
-        print("Usage: psdsplit_rgb565.py png-file 100 200 300...")
-        #sys.exit(1)
-    #png_path = sys.argv[1]
-    #widths = [int(arg) for arg in sys.argv[2:]]
-    png_path = "zundaroom_morning-320x240.png"
-    widths = [320]#[60,200,60]
+    if len(sys.argv) < 2:
+        print("Usage: psdsplit_rgb565.py png-file [100 200 300...]")
+        sys.exit(1)
+    png_path = sys.argv[1]
+    widths = [int(arg) for arg in sys.argv[2:]]
     outhpp_path = os.path.splitext(png_path)[0] + ".h"
 
     ## ファイルチェック
@@ -32,6 +32,9 @@ if __name__ == "__main__":
     ## 変換スタート
     image = Image.open(png_path)
     src_width, src_height = image.size
+    if not widths:
+        widths = [src_width]
+    os.makedirs('png', exist_ok=True)
     start_x = 0
     rgb565bins = []
     for i, width in enumerate(widths):
@@ -42,11 +45,11 @@ if __name__ == "__main__":
         ## RGB565に変換する
         binsize = segment.width * segment.height
         rgb565bin = convert_image_to_rgb565(segment)
-        rgb565bins.append((segment.width, segment.height, binsize, start_x, 0, rgb565bin));
+        rgb565bins.append((segment.width, segment.height, binsize, start_x, 0, rgb565bin, "background", f"segment_{i+1}"))
         start_x += width
 
     ## .hppヘッダーの作成と保存
-    header_text = generate_header(rgb565bins, IMAGE_SUB_PREFIX)
+    header_text, table_content = generate_header(rgb565bins, IMAGE_SUB_PREFIX)
     with open(outhpp_path, "w", encoding="utf-8") as file:
-        file.write(header_text)
+        file.write(f"{header_text}\n{table_content}\nconstexpr uint16_t {IMAGE_SUB_PREFIX}Num = {len(rgb565bins)};  // 短冊の数\n")
     print(f"Saved: {outhpp_path}")
@@ -11,6 +11,7 @@ import re
 import array
 from PIL import Image, ImageOps
 import math
+import struct
 
 ## 透明色の置き換え
 transparent_replacement_rgb565 = 0b0000000000100000
@@ -156,30 +157,172 @@ def convert_pnglayer2rgb565(conf, data, png_dir, ratio=1.0):
         'comment2': comment2,
     }
 
+## RGB565：エンディアンの変更
+def swap_rgb565(byte):
+    return (byte & 0xFF) << 8 | (byte & 0xFF00) >> 8
+
+## スパン形式：透明色の部分を飛ばして、不透明な部分（ラン）だけを並べる
+##   data = 行ごとに [ラン数, (飛ばす数, ランの長さ, ピクセル...) x ラン数]
+##   rows = 各行の data 上の開始位置
+def encode_span(byte_array, width, height):
+    data = array.array("H")
+    rows = []
+    for y in range(height):
+        rows.append(len(data))
+        row = byte_array[y*width:(y+1)*width]
+        spans = []
+        x = 0
+        last = 0
+        while x < width:
+            if row[x] == transparent_replacement_rgb565:
+                x += 1
+                continue
+            start = x
+            while x < width and row[x] != transparent_replacement_rgb565:
+                x += 1
+            spans.append((start - last, row[start:x]))
+            last = x
+        data.append(len(spans))
+        for skip, pixels in spans:
+            data.append(skip)
+            data.append(len(pixels))
+            data.extend(swap_rgb565(px) for px in pixels)
+    return data, rows
+
+## 圧縮形式：RGB565向けのQOI風の圧縮（src/ZundavatarCodec.h の unpackImage() と対になっている）
+##   0x00-0x3F 透明色がn+1個 / 0x40-0x7F 直前の色がn+1個 / 0x80-0xBF 最近使った色の表のn番目
+##   0xC0-0xDA 直前の色からRGBを-1～+1 / 0xFF 続く2バイトの色
+def pack_hash(c):
+    return ((c >> 11) * 3 + ((c >> 5) & 0x3F) * 5 + (c & 0x1F) * 7) & 0x3F
+
+def encode_packed(byte_array):
+    data = bytearray()
+    table = [0] * 64
+    prev = 0
+    i = 0
+    n = len(byte_array)
+    while i < n:
+        c = byte_array[i]
+        if c == transparent_replacement_rgb565 or c == prev:
+            run = 1
+            while i + run < n and run < 64 and byte_array[i + run] == c:
+                run += 1
+            data.append((0x00 if c == transparent_replacement_rgb565 else 0x40) | (run - 1))
+            i += run
+            continue
+        dr = (c >> 11) - (prev >> 11)
+        dg = ((c >> 5) & 0x3F) - ((prev >> 5) & 0x3F)
+        db = (c & 0x1F) - (prev & 0x1F)
+        if table[pack_hash(c)] == c:
+            data.append(0x80 | pack_hash(c))
+        elif -1 <= dr <= 1 and -1 <= dg <= 1 and -1 <= db <= 1:
+            data.append(0xC0 + (dr + 1) * 9 + (dg + 1) * 3 + (db + 1))
+        else:
+            data += bytes((0xFF, c >> 8, c & 0xFF))
+        table[pack_hash(c)] = c
+        prev = c
+        i += 1
+    return data
+
+## パレット形式：全画像で共通の255色のパレットを作り、各画像を1ピクセル1バイトのインデックスに変換する
+##   インデックス0は透明、パレットの[0]には透明色を入れておく
+##   色数が255色を超える場合は、全画像の不透明なピクセルをまとめてメディアンカットで減色する
+def build_palette(images_info, colors=255):
+    pixels = array.array("H")
+    for img_info in images_info:
+        pixels.extend(px for px in img_info[5] if px != transparent_replacement_rgb565)
+    uniq = sorted(set(pixels))
+    if len(uniq) <= colors:
+        palette = [transparent_replacement_rgb565] + uniq
+        lookup = {c: i+1 for i, c in enumerate(uniq)}
+    else:
+        flat = Image.new("RGB", (len(pixels), 1))
+        flat.putdata([((c >> 11) << 3, ((c >> 5) & 0x3F) << 2, (c & 0x1F) << 3) for c in pixels])
+        quantized = flat.quantize(colors=colors)
+        rgb = quantized.getpalette()
+        palette = [transparent_replacement_rgb565]
+        for i in range(min(colors, len(rgb) // 3)):
+            c = rgb_to_rgb565(rgb[i*3], rgb[i*3+1], rgb[i*3+2])
+            palette.append(specific_replacement_rgb565 if c == transparent_replacement_rgb565 else c)
+        lookup = {}
+        for c, q in zip(pixels, quantized.getdata()):
+            lookup.setdefault(c, q + 1)
+    palette += [specific_replacement_rgb565] * (256 - len(palette))
+    indexes = []
+    for img_info in images_info:
+        indexes.append(array.array("B", (0 if px == transparent_replacement_rgb565 else lookup[px] for px in img_info[5])))
+    print(f"Palette: {len(uniq)} colors -> {min(len(uniq), colors)} colors")
+    return palette, indexes
+
+## RGB565：配列をC++の配列定義に変換する
+def generate_array(ctype, name, values, digits=4):
+    text = f"const {ctype} {name}[{len(values)}] PROGMEM = {{  \n"
+    for i, value in enumerate(values):
+        if i % 8 == 0 and i != 0:
+            text += "\n  "
+        text += f"0x{value:0{digits}X}, "
+    return text.rstrip(', ') + "};\n"
+
 ## RGB565：RGB565バイナリからC++用のヘッダーを作成
-def generate_header(images_info, prefix=""):
+##   span_mode 0=通常の配列のみ 1=スパン形式のみ 2=両方（比較用）
+##   palette_mode 0=パレット形式なし 1=パレット形式（通常の配列は出力しない） 2=両方（比較用）
+##   pack_mode 0=圧縮形式なし 1=圧縮形式（通常の配列は出力しない） 2=両方（比較用）
+def generate_header(images_info, prefix="", span_mode=0, palette_mode=0, pack_mode=0):
     # 画像の個別配列とポインタの配列の定義
     table = {}
     table2 = {}
     img_bin_arrays = ""
     img_imginfo_arrays = f"const zundavatar::ImageInfo {prefix}Info[] PROGMEM = {{\n"
+    span_bytes = 0
+    index_bytes = 0
+    pack_bytes = 0
+    pal_name = "nullptr"
+    if palette_mode != 0:
+        palette, indexes = build_palette(images_info)
+        pal_name = f"{prefix}Palette"
+        img_bin_arrays += generate_array("uint16_t", pal_name, [swap_rgb565(c) for c in palette])
+        index_bytes += len(palette) * 2
     
     # 各画像データの処理
     for idx, img_info in enumerate(images_info):
         width, height, img_size, posx, posy, byte_array, parts, title = img_info
-        img_bin_arrays += f"const unsigned short {prefix}Bin{idx}[{img_size}] PROGMEM = {{  \n"
-        for i, byte in enumerate(byte_array):
-            byte = (byte & 0xFF) << 8 | (byte & 0xFF00) >> 8  # エンディアンの変更
-            if i % 8 == 0 and i != 0:
-                img_bin_arrays += "\n  "
-            img_bin_arrays += f"0x{byte:04X}, "
-        img_bin_arrays = img_bin_arrays.rstrip(', ')
-        img_bin_arrays += "};\n"
+        bin_name = "nullptr"
+        span_name = "nullptr"
+        rows_name = "nullptr"
+        index_name = "nullptr"
+        pack_name = "nullptr"
+        pack_size = 0
+        if span_mode != 1 and palette_mode != 1 and pack_mode != 1:
+            bin_name = f"{prefix}Bin{idx}"
+            img_bin_arrays += generate_array("unsigned short", bin_name, [swap_rgb565(byte) for byte in byte_array])  # エンディアンの変更
+        if span_mode != 0:
+            span_data, span_rows = encode_span(byte_array, width, height)
+            span_name = f"{prefix}Span{idx}"
+            rows_name = f"{prefix}SpanRow{idx}"
+            img_bin_arrays += generate_array("uint16_t", span_name, span_data)
+            img_bin_arrays += generate_array("uint32_t", rows_name, span_rows, 8)
+            span_bytes += len(span_data) * 2 + len(span_rows) * 4
+        if palette_mode != 0:
+            index_name = f"{prefix}Index{idx}"
+            img_bin_arrays += generate_array("uint8_t", index_name, indexes[idx], 2)
+            index_bytes += len(indexes[idx])
+        if pack_mode != 0:
+            packed = encode_packed(byte_array)
+            pack_name = f"{prefix}Pack{idx}"
+            img_bin_arrays += generate_array("uint8_t", pack_name, packed, 2)
+            pack_size = len(packed)
+            pack_bytes += pack_size
         table.setdefault(parts, []).append(idx)
         table2.setdefault(parts, []).append(title)
         comma = "," if idx < len(images_info)-1 else ""
-        img_imginfo_arrays += f"  {{{prefix}Bin{idx}, {width}, {height}, {img_size}, {posx}, {posy}, 0x{transparent_replacement_rgb565:04X}}}{comma}\t\t// [{idx}] {title}\n"
+        img_imginfo_arrays += f"  {{{bin_name}, {width}, {height}, {img_size}, {posx}, {posy}, 0x{transparent_replacement_rgb565:04X}, {span_name}, {rows_name}, {index_name}, {pal_name}, {pack_name}, {pack_size}}}{comma}\t\t// [{idx}] {title}\n"
     img_imginfo_arrays = img_imginfo_arrays.rstrip(',\n') + "\n};\n"
+    if span_mode != 0:
+        print(f"Image data: dense {sum(i[2] for i in images_info) * 2} bytes -> span {span_bytes} bytes")
+    if palette_mode != 0:
+        print(f"Image data: dense {sum(i[2] for i in images_info) * 2} bytes -> palette {index_bytes} bytes")
+    if pack_mode != 0:
+        print(f"Image data: dense {sum(i[2] for i in images_info) * 2} bytes -> packed {pack_bytes} bytes")
 
     # テーブルの処理
     table_content = "// 画像パーツの部位別テーブル\n"
@@ -189,7 +332,100 @@ def generate_header(images_info, prefix=""):
         for i, title in enumerate(table2[parts]):
             table_content += f"  // [{i}] = {title}\n"
 
+    # 部位ごとの相対位置の表（体の最初の画像からの相対位置）
+    base = images_info[table["body"][0]] if "body" in table else None
+    basex, basey = (base[3], base[4]) if base else (0, 0)
+    table_content += "\n// 部位ごとの各画像の相対位置（体の[0]の左上が基準）\n"
+    for parts, ary in table.items():
+        xy = ", ".join(f"{{{images_info[i][3] - basex}, {images_info[i][4] - basey}}}" for i in ary)
+        table_content += f"const zundavatar::XYaddress {prefix}Offset{parts.capitalize()}[] = {{ {xy} }};\n"
+
+    # 部位ID（テーブル番号）と、setImageData()にそのまま渡せる一覧
+    names = list(table.keys())
+    table_content += "\n// 部位ID（テーブル番号）\n"
+    table_content += f"namespace {prefix}Part {{\n"
+    for i, parts in enumerate(names):
+        table_content += f"  constexpr zundavatar::PartId {parts.capitalize()}({i});\n"
+    table_content += "}\n"
+    table_content += f"constexpr size_t {prefix}TableNum = {len(names)};\n"
+    quoted = ", ".join('"' + n + '"' for n in names)
+    table_content += f"const char* const {prefix}TableNames[] = {{ {quoted} }};\n"
+    table_content += f"uint16_t* const {prefix}Tables[] = {{ {', '.join(f'{prefix}Table{n.capitalize()}' for n in names)} }};\n"
+    table_content += f"const zundavatar::XYaddress* const {prefix}Offsets[] = {{ {', '.join(f'{prefix}Offset{n.capitalize()}' for n in names)} }};\n"
+
     # 最終的なヘッダー内容の結合
     header_content = img_bin_arrays + "\n" + img_imginfo_arrays
     return (header_content, table_content)
 
+## キャラクターバンドル：画像・部位テーブル・キャラクター設定・起動サウンドを1つのファイル(.zcb)にまとめる
+##   形式は src/CharacterBundle.h を参照。数値はリトルエンディアン、画像データは4バイト境界に揃える
+##   character = {'no', 'name', 'host', 'speaker', 'master', 'info'}、sounds = [(ファイル名, バイナリ), ...]
+BUNDLE_HEADER_FORMAT = "<4sHHHHhBB8I"
+def generate_bundle(images_info, character, sounds, span_mode=0, palette_mode=0, pack_mode=0):
+    blob = bytearray(struct.calcsize(BUNDLE_HEADER_FORMAT))
+    def put(data):
+        while len(blob) % 4:
+            blob.append(0)
+        offset = len(blob)
+        blob.extend(data)
+        return offset
+
+    # 文字列（名前・ホスト名・キャラ設定の文章・部位名をNUL区切りで並べる）
+    table = {}
+    for idx, img_info in enumerate(images_info):
+        table.setdefault(img_info[6], []).append(idx)
+    names = list(table.keys())
+    strings = [character['name'], character['host'], character['info']] + names
+    strings_ofs = put(b"".join(str(v).encode("utf-8") + b"\0" for v in strings))
+
+    # 部位ごとのテーブル（画像数, 画像番号..., 体の[0]の左上からの相対位置(x,y)...）
+    base = images_info[table["body"][0]] if "body" in table else None
+    basex, basey = (base[3], base[4]) if base else (0, 0)
+    tables = bytearray()
+    for parts in names:
+        ary = table[parts]
+        tables += struct.pack(f"<H{len(ary)}H", len(ary), *ary)
+        for i in ary:
+            tables += struct.pack("<hh", images_info[i][3] - basex, images_info[i][4] - basey)
+    tables_ofs = put(tables)
+
+    # パレット（全画像で共通）
+    palette_ofs = 0
+    if palette_mode != 0:
+        palette, indexes = build_palette(images_info)
+        palette_ofs = put(struct.pack("<256H", *[swap_rgb565(c) for c in palette]))
+
+    # 画像データと画像ごとの情報（データの位置、0は無し）
+    records = bytearray()
+    for idx, img_info in enumerate(images_info):
+        width, height, img_size, posx, posy, byte_array, parts, title = img_info
+        data_ofs = span_ofs = rows_ofs = index_ofs = pack_ofs = 0
+        span_size = pack_size = 0
+        if span_mode != 1 and palette_mode != 1 and pack_mode != 1:
+            data_ofs = put(array.array("H", [swap_rgb565(px) for px in byte_array]).tobytes())
+        if span_mode != 0:
+            span_data, span_rows = encode_span(byte_array, width, height)
+            span_ofs = put(span_data.tobytes())
+            span_size = len(span_data) * 2
+            rows_ofs = put(array.array("I", span_rows).tobytes())
+        if palette_mode != 0:
+            index_ofs = put(indexes[idx].tobytes())
+        if pack_mode != 0:
+            packed = encode_packed(byte_array)
+            pack_ofs = put(packed)
+            pack_size = len(packed)
+        records += struct.pack("<6H7I", width, height, posx, posy, transparent_replacement_rgb565, 0,
+                               data_ofs, span_ofs, rows_ofs, index_ofs, pack_ofs, span_size, pack_size)
+    images_ofs = put(records)
+
+    # 起動サウンド（位置, バイト数の表と、データ）
+    sound_table = bytearray()
+    for name, data in sounds:
+        sound_table += struct.pack("<II", put(data), len(data))
+    sounds_ofs = put(sound_table)
+
+    struct.pack_into(BUNDLE_HEADER_FORMAT, blob, 0, b"ZCB1", 2, len(images_info), len(names), len(sounds),
+                     int(character['speaker']), int(character['no']), int(character['master']),
+                     strings_ofs, tables_ofs, images_ofs, palette_ofs, sounds_ofs, len(blob), 0, 0)
+    print(f"Bundle: {len(blob)} bytes ({len(images_info)} images, {len(names)} tables, {len(sounds)} sounds)")
+    return bytes(blob)